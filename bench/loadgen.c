@@ -0,0 +1,918 @@
+//MQTT 3.1.1 QoS 1 load generator: thousands of epoll driven connections split over worker threads,
+//scenarios ring, spread (1 to N), fanin (N to 1) and churn (subscriptions changing while publishing)
+//every PUBLISH payload carries its send time, receivers record end-to-end latency in a log-linear histogram
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#define MAX_EVENTS 512
+#define RX_INITIAL 4096
+#define PAYLOAD_HEADER 12            //send time (8 bytes) + publishing client (4 bytes)
+#define IDLE_TIMEOUT_NS 2000000000ull //run ends when deliveries stop progressing for this long after the last PUBACK
+
+//log-linear histogram, 64 sub-buckets per power of two (~1.6% precision), values in ns
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} histogram;
+
+typedef enum { SCENARIO_RING, SCENARIO_SPREAD, SCENARIO_FANIN, SCENARIO_CHURN } scenario_type;
+static const char *scenario_names[] = {"ring", "spread", "fanin", "churn"};
+
+typedef struct {
+    const char *host;
+    int port;
+    scenario_type scenario;
+    int clients;
+    int threads;
+    uint64_t messages;               //per publisher (ring: laps)
+    int payload;                     //bytes, at least PAYLOAD_HEADER
+    int window;                      //unacknowledged PUBLISH per publisher (ring: laps in flight)
+    int qos;                         //of every PUBLISH and SUBSCRIBE, QoS 0 publishers aren't limited by the window
+    double rate;                     //messages per second over all publishers, 0 is unlimited
+    int churn_every;                 //churn: publishes between subscription changes
+    int duration;                    //seconds before the run is cut short
+    const char *json_path;           //results appended as one JSON line
+    const char *label;               //free text stored with the results (e.g. commit)
+} loadgen_config;
+
+static loadgen_config config = {
+    .host = "127.0.0.1", .port = 1883, .scenario = SCENARIO_SPREAD, .clients = 100, .threads = 1,
+    .messages = 1000, .payload = 64, .window = 16, .qos = 1, .rate = 0, .churn_every = 100, .duration = 60,
+    .json_path = NULL, .label = "",
+};
+
+typedef enum { CLIENT_CONNECTING, CLIENT_SUBSCRIBING, CLIENT_READY } client_state;
+
+typedef struct {
+    int fd;
+    int index;
+    client_state state;
+    int is_publisher;
+
+    uint8_t *rx;
+    size_t rx_len;
+    size_t rx_cap;
+    uint8_t *tx;
+    size_t tx_len;
+    size_t tx_off;
+    size_t tx_cap;
+    int tx_dirty;
+    int tx_blocked;
+
+    uint16_t next_pck_id;
+    int outstanding;                 //PUBLISH waiting for PUBACK
+    uint64_t to_send;
+    uint64_t next_send_ns;           //rate pacing
+    uint64_t sent_since_churn;
+    unsigned seed;                   //churn: target choice
+    uint32_t churn_gen;              //generation currently subscribed (churn)
+    int churn_switching;             //SUBSCRIBE for churn_gen + 1 sent, SUBACK not seen yet
+} client;
+
+//per thread state, counters are read by the main thread
+typedef struct {
+    int id;
+    int epoll_fd;
+    pthread_t thread;
+    client **clients;
+    int count;
+    client **dirty;
+    int dirty_count;
+    histogram latency;
+    uint64_t laps_started;
+    _Atomic uint64_t sent;
+    _Atomic uint64_t acked;
+    _Atomic uint64_t delivered;
+    _Atomic uint64_t subscription_ops;
+    _Atomic int ready;
+} worker;
+
+static worker *workers;
+static _Atomic int running = 0;      //publishing phase started
+static _Atomic int stopping = 0;
+static _Atomic uint32_t *churn_gens; //subscribed generation of every client, read by publishers of any thread
+static uint64_t rate_interval_ns;    //per publisher interval between messages, 0 unlimited
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//=============================================================//
+//histogram
+
+static int hist_index(uint64_t value) {
+    if (value < HIST_SUB) {
+        return (int)value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    return (exponent - HIST_SUB_BITS + 1) * HIST_SUB + (int)((value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+//upper bound of a bucket
+static uint64_t hist_value(int index) {
+    if (index < HIST_SUB) {
+        return index;
+    }
+    int exponent = index / HIST_SUB + HIST_SUB_BITS - 1;
+    uint64_t sub = index % HIST_SUB;
+    return ((HIST_SUB + sub + 1) << (exponent - HIST_SUB_BITS)) - 1;
+}
+
+static void hist_record(histogram *hist, uint64_t value) {
+    hist->counts[hist_index(value)]++;
+    hist->total++;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+static void hist_merge(histogram *into, const histogram *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+static uint64_t hist_percentile(const histogram *hist, double percentile) {
+    if (hist->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percentile / 100.0 * hist->total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            uint64_t value = hist_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+//=============================================================//
+//MQTT encoding into a client's outbound buffer
+
+static void tx_reserve(client *c, size_t len) {
+    if (c->tx_len + len <= c->tx_cap) {
+        return;
+    }
+    if (c->tx_off > 0) { //drop what was already written
+        memmove(c->tx, c->tx + c->tx_off, c->tx_len - c->tx_off);
+        c->tx_len -= c->tx_off;
+        c->tx_off = 0;
+    }
+    size_t cap = c->tx_cap ? c->tx_cap : 4096;
+    while (cap < c->tx_len + len) {
+        cap *= 2;
+    }
+    if (cap != c->tx_cap) {
+        c->tx = realloc(c->tx, cap);
+        if (!c->tx) {
+            perror("Failed to grow send buffer");
+            exit(EXIT_FAILURE);
+        }
+        c->tx_cap = cap;
+    }
+}
+
+static void tx_mark(worker *w, client *c) {
+    if (!c->tx_dirty) {
+        c->tx_dirty = 1;
+        w->dirty[w->dirty_count++] = c;
+    }
+}
+
+//fixed header with remaining length, returns where the body starts
+static uint8_t *put_header(worker *w, client *c, uint8_t first_byte, size_t remaining) {
+    tx_reserve(c, remaining + 5);
+    uint8_t *p = c->tx + c->tx_len;
+    *p++ = first_byte;
+    do {
+        uint8_t byte = remaining % 128;
+        remaining /= 128;
+        *p++ = remaining ? (byte | 0x80) : byte;
+    } while (remaining);
+    tx_mark(w, c);
+    return p;
+}
+
+static uint8_t *put_string(uint8_t *p, const char *text, size_t len) {
+    *p++ = len >> 8;
+    *p++ = len & 0xFF;
+    memcpy(p, text, len);
+    return p + len;
+}
+
+static uint16_t next_id(client *c) {
+    if (++c->next_pck_id == 0) {
+        c->next_pck_id = 1;
+    }
+    return c->next_pck_id;
+}
+
+static void send_connect(worker *w, client *c) {
+    char client_id[48];
+    int id_len = snprintf(client_id, sizeof(client_id), "lg-%d-%d", (int)getpid(), c->index);
+    uint8_t *start = put_header(w, c, 0x10, 10 + 2 + id_len);
+    uint8_t *p = put_string(start, "MQTT", 4);
+    *p++ = 4;                        //protocol level 3.1.1
+    *p++ = 0x02;                     //clean session
+    *p++ = 0;
+    *p++ = 0;                        //keepalive off, subscribers may only read for longer than any interval
+    p = put_string(p, client_id, id_len);
+    c->tx_len = p - c->tx;
+}
+
+static void send_subscribe(worker *w, client *c, const char *topic) {
+    size_t topic_len = strlen(topic);
+    uint8_t *p = put_header(w, c, 0x82, 2 + 2 + topic_len + 1);
+    uint16_t id = next_id(c);
+    *p++ = id >> 8;
+    *p++ = id & 0xFF;
+    p = put_string(p, topic, topic_len);
+    *p++ = config.qos;
+    c->tx_len = p - c->tx;
+    atomic_fetch_add_explicit(&w->subscription_ops, 1, memory_order_relaxed);
+}
+
+static void send_unsubscribe(worker *w, client *c, const char *topic) {
+    size_t topic_len = strlen(topic);
+    uint8_t *p = put_header(w, c, 0xA2, 2 + 2 + topic_len);
+    uint16_t id = next_id(c);
+    *p++ = id >> 8;
+    *p++ = id & 0xFF;
+    p = put_string(p, topic, topic_len);
+    c->tx_len = p - c->tx;
+    atomic_fetch_add_explicit(&w->subscription_ops, 1, memory_order_relaxed);
+}
+
+static void send_puback(worker *w, client *c, uint16_t id) {
+    uint8_t *p = put_header(w, c, 0x40, 2);
+    *p++ = id >> 8;
+    *p++ = id & 0xFF;
+    c->tx_len = p - c->tx;
+}
+
+//PUBLISH with the configured QoS, the payload starts with its send time unless one is forwarded as is (ring)
+static void send_publish(worker *w, client *c, const char *topic, const uint8_t *forward) {
+    size_t topic_len = strlen(topic);
+    size_t id_len = config.qos ? 2 : 0;
+    uint8_t *p = put_header(w, c, 0x30 | (config.qos << 1), 2 + topic_len + id_len + config.payload);
+    p = put_string(p, topic, topic_len);
+    if (config.qos) {
+        uint16_t id = next_id(c);
+        *p++ = id >> 8;
+        *p++ = id & 0xFF;
+    }
+    if (forward) {
+        memcpy(p, forward, config.payload);
+    }
+    else {
+        uint64_t sent = now_ns();
+        uint32_t origin = c->index;
+        memcpy(p, &sent, 8);
+        memcpy(p + 8, &origin, 4);
+        memset(p + PAYLOAD_HEADER, 'x', config.payload - PAYLOAD_HEADER);
+    }
+    p += config.payload;
+    c->tx_len = p - c->tx;
+    atomic_fetch_add_explicit(&w->sent, 1, memory_order_relaxed);
+}
+
+//=============================================================//
+//scenario roles
+
+static void subscription_topic(client *c, char *topic, size_t size, uint32_t gen) {
+    switch (config.scenario) {
+    case SCENARIO_RING:
+        snprintf(topic, size, "ring/%d", c->index);
+        break;
+    case SCENARIO_SPREAD:
+        snprintf(topic, size, "spread/all");
+        break;
+    case SCENARIO_FANIN:
+        snprintf(topic, size, "fanin/#");
+        break;
+    case SCENARIO_CHURN:
+        snprintf(topic, size, "churn/%d/%u", c->index, gen);
+        break;
+    }
+}
+
+static int subscribes(client *c) {
+    switch (config.scenario) {
+    case SCENARIO_SPREAD:
+        return c->index != 0;
+    case SCENARIO_FANIN:
+        return c->index == 0;
+    default:
+        return 1;
+    }
+}
+
+static void setup_roles(client *c) {
+    c->is_publisher = 0;
+    c->to_send = 0;
+    switch (config.scenario) {
+    case SCENARIO_RING:
+        c->is_publisher = (c->index == 0); //starts laps, every other client forwards
+        break;
+    case SCENARIO_SPREAD:
+        c->is_publisher = (c->index == 0);
+        break;
+    case SCENARIO_FANIN:
+        c->is_publisher = (c->index != 0);
+        break;
+    case SCENARIO_CHURN:
+        c->is_publisher = 1;
+        break;
+    }
+    if (c->is_publisher && config.scenario != SCENARIO_RING) {
+        c->to_send = config.messages;
+    }
+}
+
+//publishes as much as the window and the rate allow
+static void pump(worker *w, client *c, uint64_t now) {
+    if (config.scenario == SCENARIO_RING) {
+        //client 0 keeps up to window laps going around the ring, the others forward
+        while (w->laps_started < config.messages && w->laps_started - atomic_load_explicit(&w->delivered, memory_order_relaxed) < (uint64_t)config.window &&
+               (rate_interval_ns == 0 || now >= c->next_send_ns)) {
+            send_publish(w, c, config.clients > 1 ? "ring/1" : "ring/0", NULL);
+            w->laps_started++;
+            if (rate_interval_ns) {
+                c->next_send_ns = (c->next_send_ns ? c->next_send_ns : now) + rate_interval_ns;
+            }
+        }
+        return;
+    }
+
+    while (c->to_send > 0 && (c->outstanding < config.window || config.qos == 0) && (rate_interval_ns == 0 || now >= c->next_send_ns)) {
+        char topic[64];
+        if (config.scenario == SCENARIO_SPREAD) {
+            snprintf(topic, sizeof(topic), "spread/all");
+        }
+        else if (config.scenario == SCENARIO_FANIN) {
+            snprintf(topic, sizeof(topic), "fanin/%d", c->index);
+        }
+        else {
+            int target = rand_r(&c->seed) % config.clients;
+            snprintf(topic, sizeof(topic), "churn/%d/%u", target, atomic_load_explicit(&churn_gens[target], memory_order_acquire));
+        }
+        send_publish(w, c, topic, NULL);
+        if (config.qos) {
+            c->outstanding++;
+        }
+        c->to_send--;
+        if (rate_interval_ns) {
+            c->next_send_ns = (c->next_send_ns ? c->next_send_ns : now) + rate_interval_ns;
+        }
+
+        //churn: move to a new subscription every churn_every messages
+        if (config.scenario == SCENARIO_CHURN && ++c->sent_since_churn >= (uint64_t)config.churn_every && !c->churn_switching) {
+            c->sent_since_churn = 0;
+            c->churn_switching = 1;
+            subscription_topic(c, topic, sizeof(topic), c->churn_gen + 1);
+            send_subscribe(w, c, topic);
+        }
+    }
+}
+
+//=============================================================//
+//incoming packets
+
+static void on_publish(worker *w, client *c, uint8_t flags, const uint8_t *body, size_t len) {
+    if (len < 2) {
+        return;
+    }
+    size_t topic_len = (body[0] << 8) | body[1];
+    size_t offset = 2 + topic_len;
+    uint16_t id = 0;
+    if ((flags >> 1) & 0x03) {
+        id = (body[offset] << 8) | body[offset + 1];
+        offset += 2;
+        send_puback(w, c, id);
+    }
+    if (len - offset < PAYLOAD_HEADER || !atomic_load_explicit(&running, memory_order_relaxed)) {
+        return; //not one of ours (e.g. $SYS) or before the start
+    }
+    const uint8_t *payload = body + offset;
+    uint64_t sent;
+    memcpy(&sent, payload, 8);
+
+    if (config.scenario == SCENARIO_RING && c->index != 0) {
+        char topic[32];
+        snprintf(topic, sizeof(topic), "ring/%d", (c->index + 1) % config.clients);
+        send_publish(w, c, topic, payload);
+        return;
+    }
+    hist_record(&w->latency, now_ns() - sent);
+    atomic_fetch_add_explicit(&w->delivered, 1, memory_order_relaxed);
+}
+
+static void on_packet(worker *w, client *c, uint8_t first_byte, const uint8_t *body, size_t len) {
+    char topic[64];
+    switch (first_byte >> 4) {
+    case 2: //CONNACK
+        if (len < 2 || body[1] != 0) {
+            fprintf(stderr, "Client %d refused, return code %d\n", c->index, len >= 2 ? body[1] : -1);
+            exit(EXIT_FAILURE);
+        }
+        if (subscribes(c)) {
+            subscription_topic(c, topic, sizeof(topic), 0);
+            send_subscribe(w, c, topic);
+            c->state = CLIENT_SUBSCRIBING;
+        }
+        else {
+            c->state = CLIENT_READY;
+            atomic_fetch_add(&w->ready, 1);
+        }
+        break;
+    case 9: //SUBACK
+        if (len >= 3 && body[2] == 0x80) {
+            fprintf(stderr, "Client %d subscription refused\n", c->index);
+            exit(EXIT_FAILURE);
+        }
+        if (c->state == CLIENT_SUBSCRIBING) {
+            c->state = CLIENT_READY;
+            atomic_fetch_add(&w->ready, 1);
+        }
+        else if (c->churn_switching) {
+            //new generation is live, publishers move over, then the old one goes away
+            c->churn_switching = 0;
+            uint32_t old_gen = c->churn_gen++;
+            atomic_store_explicit(&churn_gens[c->index], c->churn_gen, memory_order_release);
+            subscription_topic(c, topic, sizeof(topic), old_gen);
+            send_unsubscribe(w, c, topic);
+        }
+        break;
+    case 3: //PUBLISH
+        on_publish(w, c, first_byte & 0x0F, body, len);
+        break;
+    case 4: //PUBACK
+        if (config.scenario != SCENARIO_RING) {
+            c->outstanding--;
+        }
+        atomic_fetch_add_explicit(&w->acked, 1, memory_order_relaxed);
+        break;
+    default: //UNSUBACK, PINGRESP
+        break;
+    }
+}
+
+//splits the receive buffer into packets
+static int process_rx(worker *w, client *c) {
+    size_t pos = 0;
+    while (c->rx_len - pos >= 2) {
+        size_t remaining = 0;
+        int multiplier = 1;
+        size_t offset = 1;
+        uint8_t byte;
+        do {
+            if (pos + offset >= c->rx_len) {
+                goto partial;
+            }
+            byte = c->rx[pos + offset++];
+            remaining += (byte & 127) * multiplier;
+            multiplier *= 128;
+        } while ((byte & 128) && offset < 5);
+        if (c->rx_len - pos < offset + remaining) {
+            if (offset + remaining > c->rx_cap) {
+                c->rx_cap = offset + remaining;
+                c->rx = realloc(c->rx, c->rx_cap);
+                if (!c->rx) {
+                    perror("Failed to grow receive buffer");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            break;
+        }
+        on_packet(w, c, c->rx[pos], c->rx + pos + offset, remaining);
+        pos += offset + remaining;
+    }
+partial:
+    if (pos > 0) {
+        memmove(c->rx, c->rx + pos, c->rx_len - pos);
+        c->rx_len -= pos;
+    }
+    return 0;
+}
+
+static void handle_read(worker *w, client *c) {
+    while (1) {
+        if (c->rx_len == c->rx_cap) {
+            c->rx_cap *= 2;
+            c->rx = realloc(c->rx, c->rx_cap);
+            if (!c->rx) {
+                perror("Failed to grow receive buffer");
+                exit(EXIT_FAILURE);
+            }
+        }
+        ssize_t n = read(c->fd, c->rx + c->rx_len, c->rx_cap - c->rx_len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) {
+            if (!atomic_load(&stopping)) {
+                fprintf(stderr, "Client %d lost its connection\n", c->index);
+                exit(EXIT_FAILURE);
+            }
+            return;
+        }
+        c->rx_len += n;
+        process_rx(w, c);
+    }
+}
+
+static void set_writable(worker *w, client *c, int enable) {
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLET | (enable ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->tx_blocked = enable;
+}
+
+static void flush(worker *w, client *c) {
+    while (c->tx_off < c->tx_len) {
+        ssize_t n = write(c->fd, c->tx + c->tx_off, c->tx_len - c->tx_off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!c->tx_blocked) {
+                set_writable(w, c, 1);
+            }
+            return;
+        }
+        if (n < 0) {
+            if (!atomic_load(&stopping)) {
+                perror("Send failed");
+                exit(EXIT_FAILURE);
+            }
+            return;
+        }
+        c->tx_off += n;
+    }
+    c->tx_off = c->tx_len = 0;
+    if (c->tx_blocked) {
+        set_writable(w, c, 0);
+    }
+}
+
+//=============================================================//
+//workers
+
+static int open_connection(void) {
+    struct addrinfo hints = {0}, *result;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char port[8];
+    snprintf(port, sizeof(port), "%d", config.port);
+    if (getaddrinfo(config.host, port, &hints, &result) != 0) {
+        fprintf(stderr, "Can't resolve %s\n", config.host);
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, result->ai_addr, result->ai_addrlen) < 0) {
+        perror("Connect failed");
+        freeaddrinfo(result);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    freeaddrinfo(result);
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static void *worker_run(void *arg) {
+    worker *w = (worker *)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (int i = 0; i < w->count; i++) {
+        client *c = w->clients[i];
+        c->fd = open_connection();
+        if (c->fd < 0) {
+            exit(EXIT_FAILURE);
+        }
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = c;
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+        send_connect(w, c);
+    }
+
+    while (!atomic_load_explicit(&stopping, memory_order_relaxed)) {
+        int is_running = atomic_load_explicit(&running, memory_order_acquire);
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, (is_running && rate_interval_ns) ? 1 : 10);
+        for (int i = 0; i < n; i++) {
+            client *c = events[i].data.ptr;
+            if (events[i].events & EPOLLOUT) {
+                flush(w, c);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                handle_read(w, c);
+            }
+        }
+        if (is_running) {
+            uint64_t now = now_ns();
+            for (int i = 0; i < w->count; i++) {
+                if (w->clients[i]->is_publisher) {
+                    pump(w, w->clients[i], now);
+                }
+            }
+        }
+        for (int i = 0; i < w->dirty_count; i++) {
+            w->dirty[i]->tx_dirty = 0;
+            flush(w, w->dirty[i]);
+        }
+        w->dirty_count = 0;
+    }
+    return NULL;
+}
+
+//=============================================================//
+//main
+
+static void usage(const char *program) {
+    printf("Usage: %s [options]\n"
+           "  -H, --host HOST          broker address (127.0.0.1)\n"
+           "  -p, --port PORT          broker port (1883)\n"
+           "  -s, --scenario NAME      ring | spread | fanin | churn (spread)\n"
+           "  -c, --clients N          connections (100)\n"
+           "  -T, --threads N          worker threads (1)\n"
+           "  -m, --messages N         messages per publisher, laps for ring (1000)\n"
+           "  -P, --payload BYTES      payload size, at least %d (64)\n"
+           "  -w, --window N           unacknowledged messages per publisher, laps in flight for ring (16)\n"
+           "  -q, --qos N              QoS of publishes and subscriptions, 0 or 1 (1)\n"
+           "  -r, --rate N             messages per second over all publishers, 0 unlimited (0)\n"
+           "  -C, --churn-every N      churn: messages between subscription changes (100)\n"
+           "  -d, --duration S         stop after S seconds (60)\n"
+           "  -j, --json FILE          append results as one JSON line\n"
+           "  -l, --label TEXT         stored with the JSON results, e.g. the commit\n",
+           program, PAYLOAD_HEADER);
+}
+
+static int parse_args(int argc, char **argv) {
+    static const struct option options[] = {
+        {"host", required_argument, NULL, 'H'}, {"port", required_argument, NULL, 'p'},
+        {"scenario", required_argument, NULL, 's'}, {"clients", required_argument, NULL, 'c'},
+        {"threads", required_argument, NULL, 'T'}, {"messages", required_argument, NULL, 'm'},
+        {"payload", required_argument, NULL, 'P'}, {"window", required_argument, NULL, 'w'},
+        {"qos", required_argument, NULL, 'q'},
+        {"rate", required_argument, NULL, 'r'}, {"churn-every", required_argument, NULL, 'C'},
+        {"duration", required_argument, NULL, 'd'}, {"json", required_argument, NULL, 'j'},
+        {"label", required_argument, NULL, 'l'}, {"help", no_argument, NULL, 'h'}, {0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:s:c:T:m:P:w:q:r:C:d:j:l:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'H': config.host = optarg; break;
+        case 'p': config.port = atoi(optarg); break;
+        case 's': {
+            int found = 0;
+            for (int i = 0; i < 4; i++) {
+                if (strcmp(optarg, scenario_names[i]) == 0) {
+                    config.scenario = i;
+                    found = 1;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "Unknown scenario '%s'\n", optarg);
+                return -1;
+            }
+            break;
+        }
+        case 'c': config.clients = atoi(optarg); break;
+        case 'T': config.threads = atoi(optarg); break;
+        case 'm': config.messages = strtoull(optarg, NULL, 10); break;
+        case 'P': config.payload = atoi(optarg); break;
+        case 'w': config.window = atoi(optarg); break;
+        case 'q': config.qos = atoi(optarg); break;
+        case 'r': config.rate = atof(optarg); break;
+        case 'C': config.churn_every = atoi(optarg); break;
+        case 'd': config.duration = atoi(optarg); break;
+        case 'j': config.json_path = optarg; break;
+        case 'l': config.label = optarg; break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    int min_clients = (config.scenario == SCENARIO_SPREAD || config.scenario == SCENARIO_FANIN) ? 2 : 1;
+    if (config.clients < min_clients || config.threads < 1 || config.window < 1 || config.payload < PAYLOAD_HEADER || config.churn_every < 1 ||
+        config.qos < 0 || config.qos > 1) {
+        fprintf(stderr, "Invalid arguments (clients >= %d, threads >= 1, window >= 1, payload >= %d, qos 0 or 1)\n", min_clients, PAYLOAD_HEADER);
+        return -1;
+    }
+    if (config.threads > config.clients) {
+        config.threads = config.clients;
+    }
+    return 0;
+}
+
+static uint64_t sum_counter(size_t offset) {
+    uint64_t total = 0;
+    for (int i = 0; i < config.threads; i++) {
+        total += atomic_load_explicit((_Atomic uint64_t *)((char *)&workers[i] + offset), memory_order_relaxed);
+    }
+    return total;
+}
+#define SUM(field) sum_counter(offsetof(worker, field))
+
+int main(int argc, char **argv) {
+    if (parse_args(argc, argv) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    //thousands of connections need the fd limit raised
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    //expected deliveries and publishers
+    int publishers = 0;
+    uint64_t expected = 0;
+    switch (config.scenario) {
+    case SCENARIO_RING:
+        publishers = 1;
+        expected = config.messages;
+        break;
+    case SCENARIO_SPREAD:
+        publishers = 1;
+        expected = config.messages * (config.clients - 1);
+        break;
+    case SCENARIO_FANIN:
+        publishers = config.clients - 1;
+        expected = config.messages * publishers;
+        break;
+    case SCENARIO_CHURN:
+        publishers = config.clients;
+        expected = config.messages * publishers;
+        break;
+    }
+    if (config.rate > 0) {
+        rate_interval_ns = (uint64_t)(1e9 * publishers / config.rate);
+    }
+
+    churn_gens = calloc(config.clients, sizeof(*churn_gens));
+    client *clients = calloc(config.clients, sizeof(client));
+    workers = calloc(config.threads, sizeof(worker));
+    if (!churn_gens || !clients || !workers) {
+        perror("Failed to allocate clients");
+        return EXIT_FAILURE;
+    }
+    for (int t = 0; t < config.threads; t++) {
+        workers[t].id = t;
+        workers[t].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        workers[t].clients = calloc(config.clients / config.threads + 1, sizeof(client *));
+        workers[t].dirty = calloc(config.clients / config.threads + 1, sizeof(client *));
+    }
+    for (int i = 0; i < config.clients; i++) {
+        client *c = &clients[i];
+        c->index = i;
+        c->rx_cap = RX_INITIAL;
+        c->rx = malloc(RX_INITIAL);
+        c->seed = i + 1;
+        setup_roles(c);
+        worker *w = &workers[i % config.threads];
+        w->clients[w->count++] = c;
+    }
+
+    printf("Scenario %s || %d clients || %d threads || %llu messages per publisher || payload %d || window %d || QoS %d\n",
+           scenario_names[config.scenario], config.clients, config.threads, (unsigned long long)config.messages, config.payload, config.window, config.qos);
+
+    //connect and subscribe everything before the clock starts
+    uint64_t setup_start = now_ns();
+    for (int t = 0; t < config.threads; t++) {
+        pthread_create(&workers[t].thread, NULL, worker_run, &workers[t]);
+    }
+    while (1) {
+        int ready = 0;
+        for (int t = 0; t < config.threads; t++) {
+            ready += atomic_load(&workers[t].ready);
+        }
+        if (ready == config.clients) {
+            break;
+        }
+        if (now_ns() - setup_start > 30000000000ull) {
+            fprintf(stderr, "Only %d of %d clients ready after 30 s\n", ready, config.clients);
+            return EXIT_FAILURE;
+        }
+        usleep(1000);
+    }
+    printf("Setup: %d clients connected and subscribed in %.3f s\n", config.clients, (now_ns() - setup_start) / 1e9);
+
+    uint64_t start = now_ns();
+    atomic_store_explicit(&running, 1, memory_order_release);
+
+    //wait for every delivery, or until deliveries stop once every publish was acknowledged
+    uint64_t last_delivered = 0;
+    uint64_t last_progress = start;
+    uint64_t end;
+    while (1) {
+        usleep(10000);
+        end = now_ns();
+        uint64_t delivered = SUM(delivered);
+        if (delivered != last_delivered) {
+            last_delivered = delivered;
+            last_progress = end;
+        }
+        if (delivered >= expected) {
+            break;
+        }
+        int all_acked = (config.scenario == SCENARIO_RING) || config.qos == 0 || SUM(acked) >= SUM(sent);
+        if (all_acked && end - last_progress > IDLE_TIMEOUT_NS) {
+            end = last_progress;
+            break;
+        }
+        if (end - start > (uint64_t)config.duration * 1000000000ull) {
+            fprintf(stderr, "Duration limit reached\n");
+            break;
+        }
+    }
+    atomic_store(&stopping, 1);
+    for (int t = 0; t < config.threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+
+    histogram *latency = calloc(1, sizeof(histogram));
+    for (int t = 0; t < config.threads; t++) {
+        hist_merge(latency, &workers[t].latency);
+    }
+    double seconds = (end - start) / 1e9;
+    uint64_t sent = SUM(sent);
+    uint64_t delivered = SUM(delivered);
+    uint64_t deliveries = (config.scenario == SCENARIO_RING) ? delivered * config.clients : delivered; //ring: every hop is a delivery
+    double rate = seconds > 0 ? deliveries / seconds : 0;
+
+    printf("Sent %llu || delivered %llu of %llu || lost %llu || subscription ops %llu\n",
+           (unsigned long long)sent, (unsigned long long)delivered, (unsigned long long)expected,
+           (unsigned long long)(expected > delivered ? expected - delivered : 0), (unsigned long long)SUM(subscription_ops));
+    printf("Duration %.3f s || %.0f messages/s delivered\n", seconds, rate);
+    printf("Latency (us) || p50 %.1f || p99 %.1f || p99.9 %.1f || max %.1f\n",
+           hist_percentile(latency, 50) / 1e3, hist_percentile(latency, 99) / 1e3, hist_percentile(latency, 99.9) / 1e3, latency->max / 1e3);
+
+    if (config.json_path) {
+        FILE *json = fopen(config.json_path, "a");
+        if (!json) {
+            perror("Failed to open JSON output");
+            return EXIT_FAILURE;
+        }
+        fprintf(json, "{\"label\":\"%s\",\"time\":%lld,\"scenario\":\"%s\",\"clients\":%d,\"threads\":%d,\"messages\":%llu,"
+                      "\"payload\":%d,\"window\":%d,\"qos\":%d,\"rate_limit\":%.0f,\"sent\":%llu,\"delivered\":%llu,\"expected\":%llu,"
+                      "\"duration_s\":%.6f,\"msgs_per_sec\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+                config.label, (long long)time(NULL), scenario_names[config.scenario], config.clients, config.threads,
+                (unsigned long long)config.messages, config.payload, config.window, config.qos, config.rate,
+                (unsigned long long)sent, (unsigned long long)delivered, (unsigned long long)expected,
+                seconds, rate, hist_percentile(latency, 50) / 1e3, hist_percentile(latency, 99) / 1e3,
+                hist_percentile(latency, 99.9) / 1e3, latency->max / 1e3);
+        fclose(json);
+    }
+    //churn loses messages sent to a generation just unsubscribed, every other scenario must deliver everything
+    if (delivered == 0 || (config.scenario != SCENARIO_CHURN && delivered < expected)) {
+        return 2;
+    }
+    return EXIT_SUCCESS;
+}
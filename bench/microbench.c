@@ -0,0 +1,528 @@
+//micro-benchmarks of the broker hot paths, linked against libbroker.a
+//reports ns/op and heap allocations/op (malloc, calloc and realloc are wrapped at link time)
+
+#include "broker.h"
+
+#include <getopt.h>
+
+#define SAMPLE_COUNT 4096            //pre-generated inputs, cycled through by every benchmark (power of two)
+#define SUBSCRIBERS 256
+#define REGIONS 8
+#define VEHICLES 128                 //per region
+#define FANOUT_BATCH 32              //publishes between acknowledgement rounds, below max_inflight
+#define PLANTS 16                    //Sparkplug groups, edge nodes and devices of the deep topic benchmark
+#define EDGE_NODES 64
+
+//=============================================================//
+//allocation counting
+
+static uint64_t alloc_count;
+static int alloc_counting;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    alloc_count += alloc_counting;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    alloc_count += alloc_counting;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    alloc_count += alloc_counting;
+    return __real_realloc(ptr, size);
+}
+
+//=============================================================//
+//timing and reporting
+
+typedef struct {
+    uint64_t start_ns;
+    uint64_t elapsed_ns;
+    uint64_t allocs;
+} bench_clock;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void clock_start(bench_clock *clock) {
+    alloc_count = 0;
+    alloc_counting = 1;
+    clock->start_ns = now_ns();
+}
+
+static void clock_stop(bench_clock *clock) {
+    clock->elapsed_ns += now_ns() - clock->start_ns;
+    alloc_counting = 0;
+    clock->allocs += alloc_count;
+}
+
+static const char *json_path = NULL;
+static const char *label = "";
+static double scale = 1.0;           //multiplies every iteration count
+static volatile uint64_t sink;       //keeps results alive
+
+static void report(const char *name, uint64_t ops, bench_clock *clock) {
+    double ns_per_op = (double)clock->elapsed_ns / ops;
+    double allocs_per_op = (double)clock->allocs / ops;
+    printf("%-28s %12llu ops %10.1f ns/op %8.2f allocs/op\n", name, (unsigned long long)ops, ns_per_op, allocs_per_op);
+    if (json_path) {
+        FILE *json = fopen(json_path, "a");
+        if (!json) {
+            perror("Failed to open JSON output");
+            return;
+        }
+        fprintf(json, "{\"label\":\"%s\",\"time\":%lld,\"benchmark\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.2f,\"allocs_per_op\":%.3f}\n",
+                label, (long long)time(NULL), name, (unsigned long long)ops, ns_per_op, allocs_per_op);
+        fclose(json);
+    }
+}
+
+static uint64_t iterations(uint64_t base) {
+    uint64_t count = (uint64_t)(base * scale);
+    return count ? count : 1;
+}
+
+//=============================================================//
+//input distributions
+
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+//payload sizes: mostly small telemetry, some medium documents, a few large blobs
+static size_t sample_payload_len(void) {
+    uint32_t pick = rng() % 100;
+    if (pick < 70) {
+        return 16 + rng() % 112;
+    }
+    if (pick < 95) {
+        return 128 + rng() % 896;
+    }
+    return 1024 + rng() % 7168;
+}
+
+static const char *metric_names[] = {"position", "speed", "fuel", "status"};
+
+//publish topics, vehicles are skewed so a few of them are hot
+static void sample_topic(char *topic, size_t size) {
+    uint32_t vehicle = (uint32_t)(((uint64_t)(rng() % VEHICLES) * (rng() % VEHICLES)) / VEHICLES);
+    snprintf(topic, size, "fleet/region-%u/vehicle-%u/%s", rng() % REGIONS, vehicle, metric_names[rng() % 4]);
+}
+
+//Sparkplug-style topics: ten levels, around 100 bytes
+static void sample_sparkplug_topic(char *topic, size_t size) {
+    snprintf(topic, size, "spBv1.0/plant-%02u/DDATA/edge-node-%04u/device-%04u/line-%u/cell-%u/sensors/%s/value",
+             rng() % PLANTS, rng() % EDGE_NODES, rng() % 1024, rng() % 8, rng() % 16, metric_names[rng() % 4]);
+}
+
+//=============================================================//
+//broker fixture: connections write to /dev/null, packets go through mqtt_process_pck like the event loop feeds them
+
+static broker_shared shared;
+static broker_ctx broker;
+
+static connection *fixture_connection(void) {
+    int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || fd >= broker.max_connections) {
+        perror("Failed to open /dev/null");
+        exit(EXIT_FAILURE);
+    }
+    connection *conn = calloc(1, sizeof(connection));
+    conn->conn_fd = fd;
+    broker.connections[fd] = conn;
+    return conn;
+}
+
+//fixed header in front of a body, returns the packet length
+static size_t build_packet(uint8_t *packet, uint8_t first_byte, const uint8_t *body, size_t body_len) {
+    packet[0] = first_byte;
+    int length_size = encode_remaining_length(packet + 1, body_len);
+    memcpy(packet + 1 + length_size, body, body_len);
+    return 1 + length_size + body_len;
+}
+
+//PUBLISH with the given QoS, pck_id is left out for QoS 0
+static size_t build_publish(uint8_t *packet, const char *topic, int qos, uint16_t pck_id, size_t payload_len) {
+    uint8_t body[2 + 256 + 2 + 8192];
+    size_t topic_len = strlen(topic);
+    body[0] = topic_len >> 8;
+    body[1] = topic_len & 0xFF;
+    memcpy(body + 2, topic, topic_len);
+    size_t len = 2 + topic_len;
+    if (qos > 0) {
+        body[len++] = pck_id >> 8;
+        body[len++] = pck_id & 0xFF;
+    }
+    memset(body + len, 'p', payload_len);
+    return build_packet(packet, 0x30 | (qos << 1), body, len + payload_len);
+}
+
+static void process(connection *conn, uint8_t *packet) {
+    mqtt_pck received_pck = {0};
+    received_pck.conn_fd = conn->conn_fd;
+    if (mqtt_process_pck(packet, received_pck, &broker) < 0) {
+        fprintf(stderr, "Fixture packet rejected\n");
+        exit(EXIT_FAILURE);
+    }
+    arena_reset(&broker.arena); //one packet per read, like the event loop would see it
+}
+
+static void fixture_connect(connection *conn, const char *client_id) {
+    uint8_t body[64] = {0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, 0x02, 0x00, 60};
+    size_t id_len = strlen(client_id);
+    body[10] = id_len >> 8;
+    body[11] = id_len & 0xFF;
+    memcpy(body + 12, client_id, id_len);
+    uint8_t packet[80];
+    build_packet(packet, 0x10, body, 12 + id_len);
+    process(conn, packet);
+}
+
+static void fixture_subscribe(connection *conn, const char *filter) {
+    uint8_t body[128] = {0x00, 0x01};
+    size_t filter_len = strlen(filter);
+    body[2] = filter_len >> 8;
+    body[3] = filter_len & 0xFF;
+    memcpy(body + 4, filter, filter_len);
+    body[4 + filter_len] = 1;
+    uint8_t packet[160];
+    build_packet(packet, 0x82, body, 5 + filter_len);
+    process(conn, packet);
+}
+
+//writes every queued packet, what the event loop does when a batch ends
+static void flush_all(void) {
+    for (int i = 0; i < broker.dirty_count; i++) {
+        connection *conn = broker.connections[broker.dirty_fds[i]];
+        if (conn) {
+            conn->tx_dirty = 0;
+            tx_flush(&broker, conn);
+        }
+    }
+    broker.dirty_count = 0;
+}
+
+//acknowledges everything in flight for the subscribers, through the PUBACK handler
+static void ack_all(connection **subscribers, int count) {
+    for (int i = 0; i < count; i++) {
+        session *subscriber = subscribers[i]->session;
+        for (int slot = 0; subscriber->inflight && slot < broker.config.max_inflight && subscriber->inflight_count > 0; slot++) {
+            mqtt_pck *inflight = &subscriber->inflight[slot];
+            if (inflight->pck_type != 3) {
+                continue;
+            }
+            uint8_t packet[4] = {0x40, 0x02, inflight->pck_id >> 8, inflight->pck_id & 0xFF};
+            process(subscribers[i], packet);
+        }
+    }
+}
+
+static void fixture_init(void) {
+    broker_config config;
+    config_defaults(&config);
+    config.max_clients = 100000;
+    config.max_topics = 16;
+    config.sys_interval = 0;
+    config.log_level = LOG_LEVEL_ERROR;
+    log_init(config.log_level);
+    if (broker_shared_init(&shared, &config) < 0 || broker_init(&broker, &shared, 0) < 0) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+//=============================================================//
+//benchmarks
+
+//remaining lengths of a realistic packet mix: PUBLISH of the payload distribution and 2 byte acknowledgements
+static void bench_remaining_length(void) {
+    static uint8_t encoded[SAMPLE_COUNT][5];
+    static uint32_t lengths[SAMPLE_COUNT];
+    for (int i = 0; i < SAMPLE_COUNT; i++) {
+        lengths[i] = (rng() % 2) ? 2 : 4 + 40 + sample_payload_len();
+        encoded[i][0] = 0x30;
+        encode_remaining_length(encoded[i] + 1, lengths[i]);
+    }
+
+    bench_clock clock = {0};
+    uint64_t ops = iterations(20000000);
+    uint32_t remaining_length;
+    int offset;
+    uint64_t total = 0;
+    clock_start(&clock);
+    for (uint64_t i = 0; i < ops; i++) {
+        decode_remaining_length(encoded[i & (SAMPLE_COUNT - 1)], 5, &remaining_length, &offset);
+        total += remaining_length;
+    }
+    clock_stop(&clock);
+    sink = total;
+    report("decode_remaining_length", ops, &clock);
+
+    clock = (bench_clock){0};
+    uint8_t buffer[4];
+    clock_start(&clock);
+    for (uint64_t i = 0; i < ops; i++) {
+        total += encode_remaining_length(buffer, lengths[i & (SAMPLE_COUNT - 1)]);
+    }
+    clock_stop(&clock);
+    sink = total + buffer[0];
+    report("encode_remaining_length", ops, &clock);
+}
+
+//PUBLISH parsing and PUBACK without subscribers, PINGREQ, both through mqtt_process_pck
+static void bench_process_pck(void) {
+    connection *conn = fixture_connection();
+    fixture_connect(conn, "bench-parser");
+    flush_all();
+
+    static uint8_t *packets[SAMPLE_COUNT];
+    char topic[64];
+    for (int i = 0; i < SAMPLE_COUNT; i++) {
+        size_t payload_len = sample_payload_len();
+        packets[i] = malloc(5 + 2 + 64 + 2 + payload_len);
+        snprintf(topic, sizeof(topic), "unrouted/%u/%u", rng() % 64, rng() % 64);
+        build_publish(packets[i], topic, 1, (i % 65535) + 1, payload_len);
+    }
+
+    bench_clock clock = {0};
+    uint64_t ops = iterations(2000000);
+    for (uint64_t i = 0; i < ops; i += 64) {
+        clock_start(&clock);
+        for (uint64_t j = i; j < i + 64 && j < ops; j++) {
+            uint8_t *packet = packets[j & (SAMPLE_COUNT - 1)];
+            process(conn, packet);
+        }
+        flush_all();
+        clock_stop(&clock);
+    }
+    report("mqtt_process_pck publish", ops, &clock);
+
+    uint8_t pingreq[2] = {0xC0, 0x00};
+    clock = (bench_clock){0};
+    ops = iterations(5000000);
+    for (uint64_t i = 0; i < ops; i += 64) {
+        clock_start(&clock);
+        for (uint64_t j = i; j < i + 64 && j < ops; j++) {
+            process(conn, pingreq);
+        }
+        flush_all();
+        clock_stop(&clock);
+    }
+    report("mqtt_process_pck pingreq", ops, &clock);
+
+    for (int i = 0; i < SAMPLE_COUNT; i++) {
+        free(packets[i]);
+    }
+}
+
+//serialization of control packets into the outbound queue, flushed to /dev/null every 64 packets
+static void bench_send_pck(void) {
+    connection *conn = fixture_connection();
+    uint8_t variable_header[2] = {0x12, 0x34};
+    uint8_t suback_codes[4] = {1, 1, 0x80, 1};
+
+    bench_clock clock = {0};
+    uint64_t ops = iterations(5000000);
+    for (uint64_t i = 0; i < ops; i += 64) {
+        clock_start(&clock);
+        for (uint64_t j = i; j < i + 64 && j < ops; j++) {
+            mqtt_pck packet = {0};
+            packet.conn_fd = conn->conn_fd;
+            packet.variable_header = variable_header;
+            packet.variable_len = 2;
+            if (j & 3) { //PUBACK
+                packet.pck_type = 4;
+                packet.remaining_len = 2;
+            }
+            else { //SUBACK of a 1-4 filter SUBSCRIBE
+                packet.pck_type = 9;
+                packet.payload = suback_codes;
+                packet.payload_len = 1 + (j >> 2) % 4;
+                packet.remaining_len = 2 + packet.payload_len;
+            }
+            send_pck(&packet, &broker);
+        }
+        flush_all();
+        clock_stop(&clock);
+    }
+    report("send_pck", ops, &clock);
+}
+
+//subscriber match loop and fan-out of publish_handler for QoS 1 and QoS 0: exact, single-level and multi-level filters, skewed topics
+static void bench_publish_fanout(void) {
+    connection *publisher = fixture_connection();
+    fixture_connect(publisher, "bench-publisher");
+
+    connection *subscribers[SUBSCRIBERS];
+    char name[64];
+    for (int i = 0; i < SUBSCRIBERS; i++) {
+        subscribers[i] = fixture_connection();
+        snprintf(name, sizeof(name), "bench-subscriber-%d", i);
+        fixture_connect(subscribers[i], name);
+        uint32_t kind = rng() % 100;
+        int filters = 1 + rng() % 4;
+        for (int f = 0; f < filters; f++) {
+            if (kind < 60) { //one vehicle
+                snprintf(name, sizeof(name), "fleet/region-%u/vehicle-%u/#", rng() % REGIONS, rng() % VEHICLES);
+            }
+            else if (kind < 95) { //one metric of a region
+                snprintf(name, sizeof(name), "fleet/region-%u/+/%s", rng() % REGIONS, metric_names[rng() % 4]);
+            }
+            else { //everything
+                snprintf(name, sizeof(name), "fleet/#");
+            }
+            fixture_subscribe(subscribers[i], name);
+        }
+    }
+    flush_all();
+
+    //same topics and payloads for both QoS levels, subscriptions are granted QoS 1
+    static uint8_t *packets[2][SAMPLE_COUNT];
+    char topic[64];
+    for (int i = 0; i < SAMPLE_COUNT; i++) {
+        size_t payload_len = sample_payload_len();
+        sample_topic(topic, sizeof(topic));
+        for (int qos = 0; qos < 2; qos++) {
+            packets[qos][i] = malloc(5 + 2 + 64 + 2 + payload_len);
+            build_publish(packets[qos][i], topic, qos, (i % 65535) + 1, payload_len);
+        }
+    }
+
+    for (int qos = 1; qos >= 0; qos--) {
+        bench_clock clock = {0};
+        uint64_t ops = iterations(200000);
+        uint64_t deliveries = broker.tx_packets;
+        for (uint64_t i = 0; i < ops; i += FANOUT_BATCH) {
+            clock_start(&clock);
+            for (uint64_t j = i; j < i + FANOUT_BATCH && j < ops; j++) {
+                process(publisher, packets[qos][j & (SAMPLE_COUNT - 1)]);
+            }
+            flush_all();
+            clock_stop(&clock);
+            if (qos > 0) {
+                ack_all(subscribers, SUBSCRIBERS); //untimed, clears the windows for the next batch
+                flush_all();
+            }
+        }
+        deliveries = broker.tx_packets - deliveries - (qos > 0 ? ops : 0); //minus the PUBACKs to the publisher
+        report(qos > 0 ? "publish_handler fanout" : "publish_handler fanout qos0", ops, &clock);
+        printf("%-28s %12.1f deliveries per publish\n", "", (double)deliveries / ops);
+    }
+
+    for (int i = 0; i < SAMPLE_COUNT; i++) {
+        free(packets[0][i]);
+        free(packets[1][i]);
+    }
+}
+
+//topic validation and level splitting of long, deep names, then the whole QoS 0 publish path for them
+static void bench_deep_topics(void) {
+    static char topics[SAMPLE_COUNT][160];
+    static size_t lengths[SAMPLE_COUNT];
+    for (int i = 0; i < SAMPLE_COUNT; i++) {
+        sample_sparkplug_topic(topics[i], sizeof(topics[i]));
+        lengths[i] = strlen(topics[i]);
+    }
+
+    bench_clock clock = {0};
+    uint64_t ops = iterations(5000000);
+    uint16_t ends[160];
+    topic_levels levels = {ends};
+    uint64_t total = 0;
+    clock_start(&clock);
+    for (uint64_t i = 0; i < ops; i++) {
+        topic_scan(topics[i & (SAMPLE_COUNT - 1)], lengths[i & (SAMPLE_COUNT - 1)], &levels);
+        total += levels.count + ends[2];
+    }
+    clock_stop(&clock);
+    sink = total;
+    report("topic_scan sparkplug", ops, &clock);
+
+    //one application per plant and a few per edge node, most publishes reach one or two of them
+    connection *publisher = fixture_connection();
+    fixture_connect(publisher, "bench-sparkplug-publisher");
+    char name[96];
+    for (int i = 0; i < PLANTS + 32; i++) {
+        connection *conn = fixture_connection();
+        snprintf(name, sizeof(name), "bench-sparkplug-%d", i);
+        fixture_connect(conn, name);
+        if (i < PLANTS) {
+            snprintf(name, sizeof(name), "spBv1.0/plant-%02u/DDATA/#", i);
+        }
+        else {
+            snprintf(name, sizeof(name), "spBv1.0/+/DDATA/edge-node-%04u/+/+/+/sensors/#", rng() % EDGE_NODES);
+        }
+        fixture_subscribe(conn, name);
+    }
+    flush_all();
+
+    static uint8_t *packets[SAMPLE_COUNT];
+    for (int i = 0; i < SAMPLE_COUNT; i++) {
+        packets[i] = malloc(5 + 2 + 160 + 64);
+        build_publish(packets[i], topics[i], 0, 0, 32);
+    }
+    clock = (bench_clock){0};
+    ops = iterations(1000000);
+    for (uint64_t i = 0; i < ops; i += 64) {
+        clock_start(&clock);
+        for (uint64_t j = i; j < i + 64 && j < ops; j++) {
+            process(publisher, packets[j & (SAMPLE_COUNT - 1)]);
+        }
+        flush_all();
+        clock_stop(&clock);
+    }
+    report("publish_handler sparkplug qos0", ops, &clock);
+
+    for (int i = 0; i < SAMPLE_COUNT; i++) {
+        free(packets[i]);
+    }
+}
+
+//=============================================================//
+
+static void usage(const char *program) {
+    printf("Usage: %s [options]\n"
+           "  -s, --scale X            multiplies every iteration count (1.0)\n"
+           "  -j, --json FILE          append one JSON line per benchmark\n"
+           "  -l, --label TEXT         stored with the JSON results, e.g. the commit\n",
+           program);
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        {"scale", required_argument, NULL, 's'}, {"json", required_argument, NULL, 'j'},
+        {"label", required_argument, NULL, 'l'}, {"help", no_argument, NULL, 'h'}, {0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:j:l:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 's': scale = atof(optarg); break;
+        case 'j': json_path = optarg; break;
+        case 'l': label = optarg; break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    fixture_init();
+    bench_remaining_length();
+    bench_process_pck();
+    bench_send_pck();
+    bench_publish_fanout();
+    bench_deep_topics();
+    return EXIT_SUCCESS;
+}
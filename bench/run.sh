@@ -0,0 +1,33 @@
+#!/bin/sh
+#starts a local mqtt_broker for every scenario and appends one JSON line per run to the results file
+#usage: bench/run.sh [results file], BENCH_PORT / BENCH_THREADS / BROKER_THREADS / BENCH_LOADGEN_ARGS override defaults
+
+cd "$(dirname "$0")/.." || exit 1
+
+RESULTS=${1:-bench/results.jsonl}
+PORT=${BENCH_PORT:-18830}
+THREADS=${BENCH_THREADS:-2}
+LABEL=$(git describe --always --dirty 2>/dev/null || echo unknown)
+
+#name and loadgen arguments of each scenario
+SCENARIOS="ring:-s ring -c 100 -m 5000 -w 8
+spread:-s spread -c 2000 -m 500 -w 16
+fanin:-s fanin -c 2000 -m 100 -w 4
+churn:-s churn -c 500 -m 1000 -C 50 -w 8"
+
+status=0
+echo "$SCENARIOS" | while IFS=: read -r name args; do
+    #a fresh broker per scenario, sessions of the previous one don't carry over
+    ./mqtt_broker -p "$PORT" -T "${BROKER_THREADS:-1}" -n 100000 -q 10000000 -v 1 -y 0 >/dev/null 2>&1 &
+    broker=$!
+    sleep 0.3
+
+    echo "== $name"
+    ./bench/loadgen -p "$PORT" -T "$THREADS" -l "$LABEL" -j "$RESULTS" $args $BENCH_LOADGEN_ARGS || status=1
+
+    kill "$broker"
+    wait "$broker" 2>/dev/null
+    [ $status -eq 0 ] || exit 1
+done || exit 1
+
+echo "Results appended to $RESULTS"
@@ -0,0 +1,337 @@
+//stress test of the subscription index read without locks: reader threads match topics while writer threads
+//subscribe, resubscribe and unsubscribe, the way publishing and subscribing shards use it
+//every match must report each stable subscription of the topic exactly once and nothing but live subscriber objects
+//with a valid QoS, a torn read (half-published list, entry or table) or a node freed under a reader breaks that
+//built from the sources, STRESS_CFLAGS=-fsanitize=address (or thread) checks the memory accesses too
+
+#include "broker.h"
+
+#include <getopt.h>
+
+#define GROUPS 64                    //first topic levels the readers match
+#define LEAVES 64                    //second levels the writers add and remove next to the stable ones
+#define FILTERS (GROUPS * (3 + LEAVES * 3)) //filters the writers toggle
+#define WRITER_SUBSCRIBERS 64        //subscriber objects per writer
+#define MAX_THREADS 64
+#define SUBSCRIBER_MAGIC 0x5ab5c71be5ull
+
+#define STABLE_LEVEL 0               //"gI/s/x", one per group
+#define STABLE_WILDCARD 1            //"gI/+/x", one per group
+#define STABLE_ALL 2                 //"+/+/x", a single one
+#define VOLATILE 3                   //owned by a writer
+
+typedef struct {
+    uint64_t magic;
+    int kind;                        //STABLE_* or VOLATILE
+    int group;
+    uint8_t qos;                     //stable subscriptions keep theirs
+} stress_subscriber;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    _Atomic uint64_t matches;        //topics matched, read by the main thread while running
+    uint64_t delivered;              //subscribers reported
+    uint64_t operations;             //writers: subscription changes
+    uint64_t failures;
+    epoch_reader epoch;
+    stress_subscriber subscribers[WRITER_SUBSCRIBERS];
+    uint8_t *subscribed;             //writers: [subscriber][filter] -> 0 or QoS + 1
+} stress_thread;
+
+typedef struct {
+    stress_thread *thread;
+    int group;
+    int seen[3];                     //stable subscriptions reported, per kind
+} stress_match;
+
+static topic_tree tree;
+static epoch_domain epochs;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic int running;
+static _Atomic int writing;
+static stress_subscriber stable[GROUPS * 2 + 1];
+static char *filters[FILTERS];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//xorshift, one state per thread
+static uint32_t next_random(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+//filters sharing nodes with the stable subscriptions: same lists, sibling levels, wildcards on the same path,
+//and first levels readers never match so the root table grows and shrinks too
+static void filters_init(void) {
+    char buf[64];
+    int f = 0;
+    for (int group = 0; group < GROUPS; group++) {
+        snprintf(buf, sizeof(buf), "g%d/s/x", group);
+        filters[f++] = strdup(buf);
+        snprintf(buf, sizeof(buf), "g%d/+/x", group);
+        filters[f++] = strdup(buf);
+        snprintf(buf, sizeof(buf), "g%d/s/#", group);
+        filters[f++] = strdup(buf);
+        for (int leaf = 0; leaf < LEAVES; leaf++) {
+            snprintf(buf, sizeof(buf), "g%d/l%d/x", group, leaf);
+            filters[f++] = strdup(buf);
+            snprintf(buf, sizeof(buf), "g%d/l%d/#", group, leaf);
+            filters[f++] = strdup(buf);
+            snprintf(buf, sizeof(buf), "o%d/l%d", group * LEAVES + leaf, leaf);
+            filters[f++] = strdup(buf);
+        }
+    }
+}
+
+static void match_check(void *entry, uint8_t qos, void *arg) {
+    stress_match *match = (stress_match *)arg;
+    stress_subscriber *subscriber = (stress_subscriber *)entry;
+    //now and then the walk pauses halfway, so writers get to change what it is reading even on few cores
+    if ((++match->thread->delivered & 1023) == 0) {
+        sched_yield();
+    }
+    if (subscriber == NULL || subscriber->magic != SUBSCRIBER_MAGIC || qos > 1) {
+        match->thread->failures++;
+        return;
+    }
+    if (subscriber->kind == VOLATILE) {
+        return;
+    }
+    if (qos != subscriber->qos || (subscriber->kind != STABLE_ALL && subscriber->group != match->group)) {
+        match->thread->failures++;
+        return;
+    }
+    match->seen[subscriber->kind]++;
+}
+
+static void *reader_run(void *arg) {
+    stress_thread *thread = (stress_thread *)arg;
+    uint32_t seed = 0x9e3779b9u * (thread->id + 1);
+    char topic[32];
+    uint64_t matches = 0;
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        stress_match match = {thread, next_random(&seed) % GROUPS, {0, 0, 0}};
+        int len = snprintf(topic, sizeof(topic), "g%d/s/x", match.group);
+
+        epoch_enter(&epochs, &thread->epoch);
+        topic_tree_match(&tree, topic, len, match_check, &match);
+        epoch_exit(&thread->epoch);
+
+        if (match.seen[STABLE_LEVEL] != 1 || match.seen[STABLE_WILDCARD] != 1 || match.seen[STABLE_ALL] != 1) {
+            if (thread->failures++ < 10) {
+                fprintf(stderr, "'%s' reported stable subscriptions %d/%d/%d times, expected once each\n", topic,
+                        match.seen[STABLE_LEVEL], match.seen[STABLE_WILDCARD], match.seen[STABLE_ALL]);
+            }
+        }
+        atomic_store_explicit(&thread->matches, ++matches, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+static void *writer_run(void *arg) {
+    stress_thread *thread = (stress_thread *)arg;
+    uint32_t seed = 0x85ebca6bu * (thread->id + 1);
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        if (!atomic_load_explicit(&writing, memory_order_relaxed)) {
+            usleep(1000);
+            continue;
+        }
+        int s = next_random(&seed) % WRITER_SUBSCRIBERS;
+        int f = next_random(&seed) % FILTERS;
+        if (next_random(&seed) & 1) { //half of the changes go to the lists holding stable subscriptions
+            f = f / (3 + LEAVES * 3) * (3 + LEAVES * 3) + (f & 1);
+        }
+        uint8_t *state = &thread->subscribed[s * FILTERS + f];
+        uint8_t qos = next_random(&seed) & 1;
+
+        pthread_mutex_lock(&writer_lock);
+        //subscribed ones are removed three times out of four, else resubscribed with a new QoS
+        if (*state && (next_random(&seed) & 3) != 0) {
+            if (topic_tree_unsubscribe(&tree, filters[f], strlen(filters[f]), &thread->subscribers[s]) != 1) {
+                thread->failures++;
+            }
+            *state = 0;
+        }
+        else {
+            int ret = topic_tree_subscribe(&tree, filters[f], strlen(filters[f]), &thread->subscribers[s], qos);
+            if (ret != (*state ? 0 : 1)) {
+                thread->failures++;
+            }
+            *state = qos + 1;
+        }
+        pthread_mutex_unlock(&writer_lock);
+        if ((++thread->operations & 63) == 0) { //shares the cores with the readers, which pause too
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+//runs the readers (and writers) for a while, returns topics matched per second by all readers
+static double run_phase(stress_thread *readers, int reader_count, double seconds, int with_writers) {
+    uint64_t before = 0;
+    for (int i = 0; i < reader_count; i++) {
+        before += readers[i].matches;
+    }
+    atomic_store(&writing, with_writers);
+    uint64_t start = now_ns();
+    usleep((useconds_t)(seconds * 1e6));
+    uint64_t after = 0;
+    for (int i = 0; i < reader_count; i++) {
+        after += readers[i].matches;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    atomic_store(&writing, 0);
+    return (after - before) / elapsed;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options]\n"
+                    "  -r, --readers N   matching threads (4)\n"
+                    "  -w, --writers N   subscribing threads (2)\n"
+                    "  -s, --seconds S   length of each phase (2)\n",
+            program);
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        {"readers", required_argument, NULL, 'r'}, {"writers", required_argument, NULL, 'w'},
+        {"seconds", required_argument, NULL, 's'}, {"help", no_argument, NULL, 'h'}, {0}
+    };
+    int reader_count = 4;
+    int writer_count = 2;
+    double seconds = 2;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "r:w:s:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'r': reader_count = atoi(optarg); break;
+        case 'w': writer_count = atoi(optarg); break;
+        case 's': seconds = atof(optarg); break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (reader_count < 1 || writer_count < 1 || reader_count + writer_count > MAX_THREADS || seconds <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    epoch_domain_init(&epochs);
+    topic_tree_init(&tree, &epochs);
+    filters_init();
+
+    stress_thread *readers = calloc(reader_count, sizeof(stress_thread));
+    stress_thread *writers = calloc(writer_count, sizeof(stress_thread));
+    for (int i = 0; i < writer_count; i++) {
+        writers[i].id = reader_count + i;
+        writers[i].subscribed = calloc(WRITER_SUBSCRIBERS * FILTERS, 1);
+        for (int s = 0; s < WRITER_SUBSCRIBERS; s++) {
+            writers[i].subscribers[s] = (stress_subscriber){SUBSCRIBER_MAGIC, VOLATILE, 0, 0};
+        }
+        //writer entries ahead of the stable ones, so removals move the stable entries around in their lists
+        for (int f = 0; f < FILTERS; f += 3 + LEAVES * 3) {
+            for (int s = 0; s < WRITER_SUBSCRIBERS / 8; s++) {
+                topic_tree_subscribe(&tree, filters[f], strlen(filters[f]), &writers[i].subscribers[s], 0);
+                topic_tree_subscribe(&tree, filters[f + 1], strlen(filters[f + 1]), &writers[i].subscribers[s], 0);
+                writers[i].subscribed[s * FILTERS + f] = 1;
+                writers[i].subscribed[s * FILTERS + f + 1] = 1;
+            }
+        }
+    }
+
+    //stable subscriptions, the only ones each match must report exactly once
+    char filter[32];
+    for (int group = 0; group < GROUPS; group++) {
+        stable[group * 2] = (stress_subscriber){SUBSCRIBER_MAGIC, STABLE_LEVEL, group, group & 1};
+        stable[group * 2 + 1] = (stress_subscriber){SUBSCRIBER_MAGIC, STABLE_WILDCARD, group, (group + 1) & 1};
+        snprintf(filter, sizeof(filter), "g%d/s/x", group);
+        topic_tree_subscribe(&tree, filter, strlen(filter), &stable[group * 2], stable[group * 2].qos);
+        snprintf(filter, sizeof(filter), "g%d/+/x", group);
+        topic_tree_subscribe(&tree, filter, strlen(filter), &stable[group * 2 + 1], stable[group * 2 + 1].qos);
+    }
+    stable[GROUPS * 2] = (stress_subscriber){SUBSCRIBER_MAGIC, STABLE_ALL, 0, 1};
+    topic_tree_subscribe(&tree, "+/+/x", 5, &stable[GROUPS * 2], 1);
+
+    atomic_store(&running, 1);
+    for (int i = 0; i < reader_count; i++) {
+        readers[i].id = i;
+        epoch_reader_register(&epochs, &readers[i].epoch);
+        pthread_create(&readers[i].thread, NULL, reader_run, &readers[i]);
+    }
+    for (int i = 0; i < writer_count; i++) {
+        pthread_create(&writers[i].thread, NULL, writer_run, &writers[i]);
+    }
+
+    double quiet_rate = run_phase(readers, reader_count, seconds, 0);
+    double churn_rate = run_phase(readers, reader_count, seconds, 1);
+    atomic_store(&running, 0);
+
+    uint64_t failures = 0;
+    uint64_t operations = 0;
+    uint64_t delivered = 0;
+    for (int i = 0; i < reader_count; i++) {
+        pthread_join(readers[i].thread, NULL);
+        failures += readers[i].failures;
+        delivered += readers[i].delivered;
+    }
+    size_t expected = GROUPS * 2 + 1;
+    for (int i = 0; i < writer_count; i++) {
+        pthread_join(writers[i].thread, NULL);
+        failures += writers[i].failures;
+        operations += writers[i].operations;
+        for (int j = 0; j < WRITER_SUBSCRIBERS * FILTERS; j++) {
+            expected += writers[i].subscribed[j] != 0;
+        }
+    }
+    if (tree.filter_count != expected) {
+        fprintf(stderr, "tree holds %zu subscriptions, expected %zu\n", tree.filter_count, expected);
+        failures++;
+    }
+
+    //removing everything must leave the root without children, every node pruned and retired
+    for (int i = 0; i < writer_count; i++) {
+        for (int j = 0; j < WRITER_SUBSCRIBERS * FILTERS; j++) {
+            if (writers[i].subscribed[j]) {
+                const char *f = filters[j % FILTERS];
+                topic_tree_unsubscribe(&tree, f, strlen(f), &writers[i].subscribers[j / FILTERS]);
+            }
+        }
+    }
+    for (int group = 0; group < GROUPS; group++) {
+        snprintf(filter, sizeof(filter), "g%d/s/x", group);
+        topic_tree_unsubscribe(&tree, filter, strlen(filter), &stable[group * 2]);
+        snprintf(filter, sizeof(filter), "g%d/+/x", group);
+        topic_tree_unsubscribe(&tree, filter, strlen(filter), &stable[group * 2 + 1]);
+    }
+    topic_tree_unsubscribe(&tree, "+/+/x", 5, &stable[GROUPS * 2]);
+    if (tree.filter_count != 0 || tree.root.children_count != 0 || epochs.retired_count != 0) {
+        fprintf(stderr, "emptied tree kept %zu subscriptions, %u children, %u retired allocations\n",
+                tree.filter_count, tree.root.children_count, epochs.retired_count);
+        failures++;
+    }
+
+    for (int i = 0; i < writer_count; i++) {
+        free(writers[i].subscribed);
+    }
+    free(readers);
+    free(writers);
+    for (int f = 0; f < FILTERS; f++) {
+        free(filters[f]);
+    }
+
+    printf("readers %d, writers %d: %.0f matches/s quiet, %.0f matches/s while writing (%.1f%%), "
+           "%.0f subscription changes/s, %lu subscribers reported\n",
+           reader_count, writer_count, quiet_rate, churn_rate, 100.0 * churn_rate / quiet_rate,
+           operations / seconds, (unsigned long)delivered);
+    printf("%s: %lu failures\n", failures ? "FAILED" : "ok", (unsigned long)failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,9 +1,235 @@
 #include "broker.h"
 
+//prepares the state shared by every shard: limits, session registry and subscription index
+int broker_shared_init(broker_shared *shared, const broker_config *config) {
+    memset(shared, 0, sizeof(*shared));
+    shared->config = *config;
+    shared->shard_count = config->threads;
+
+    //size the connection table after the process fd limit, raising the soft limit as far as allowed
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        perror("getrlimit failed");
+        return -1;
+    }
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+    shared->max_connections = (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > (1 << 20)) ? (1 << 20) : (int)limit.rlim_cur;
+
+    //the table grows with the sessions, a large max_clients doesn't cost memory up front
+    if (session_table_init(&shared->sessions_by_id, config->max_clients < SESSION_CHUNK ? config->max_clients : SESSION_CHUNK) < 0) {
+        return -1;
+    }
+    pthread_mutex_init(&shared->sessions_lock, NULL);
+    pthread_mutex_init(&shared->subscriptions_lock, NULL);
+    epoch_domain_init(&shared->subscription_epochs);
+    topic_tree_init(&shared->subscriptions, &shared->subscription_epochs);
+    pthread_rwlock_init(&shared->retained_lock, NULL);
+    topic_tree_init(&shared->retained, NULL); //readers hold retained_lock
+    shared->start_ms = monotonic_ms();
+    if (config->persist_dir[0] != '\0' && persist_store_open(&shared->persist, config->persist_dir, (size_t)config->persist_segment_mb << 20, config->threads) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+//prepares the state of one shard
+int broker_init(broker_ctx *broker, broker_shared *shared, int shard_id) {
+    memset(broker, 0, sizeof(*broker));
+    broker->config = shared->config;
+    broker->shared = shared;
+    broker->shard_id = shard_id;
+    broker->max_connections = shared->max_connections;
+
+    //fds are unique process wide, so every shard indexes its own table by fd (untouched pages cost nothing)
+    broker->connections = calloc(broker->max_connections, sizeof(connection *));
+    if (!broker->connections) {
+        perror("Failed to allocate connection table");
+        return -1;
+    }
+    if (shard_queue_init(&broker->inbox) < 0) {
+        free(broker->connections);
+        return -1;
+    }
+    timer_wheel_init(&broker->timers, monotonic_ms());
+    broker->now_ms = broker->timers.now;
+    if (shared->config.persist_dir[0] != '\0' && persist_log_open(&broker->log, &shared->persist, shard_id) < 0) {
+        free(broker->connections);
+        return -1;
+    }
+    epoch_reader_register(&shared->subscription_epochs, &broker->epoch);
+    shared->shards[shard_id] = broker;
+    if (shard_id == 0) {
+        metrics_start(broker);
+    }
+    return 0;
+}
+
+//state of a replay, consecutive deliveries of one message share its frame
+typedef struct {
+    broker_ctx *broker;
+    pub_frame *frame;
+} recovery;
+
+//returns a session by registry index, NULL if it wasn't recreated
+static session *session_by_id(broker_shared *shared, uint32_t id) {
+    if (id >= (uint32_t)atomic_load(&shared->session_count)) {
+        return NULL;
+    }
+    return &shared->session_chunks[id / SESSION_CHUNK][id % SESSION_CHUNK];
+}
+
+static int recover_session(void *arg, uint32_t session_id, const char *client_id, size_t len) {
+    broker_ctx *broker = ((recovery *)arg)->broker;
+    broker_shared *shared = broker->shared;
+    char *id = malloc(len + 1);
+    if (!id) {
+        perror("Failed to allocate memory for client id");
+        return -1;
+    }
+    memcpy(id, client_id, len);
+    id[len] = '\0';
+
+    pthread_mutex_lock(&shared->sessions_lock);
+    //records refer to sessions by ID, so a session that wouldn't get its logged ID is skipped before it's registered
+    int session_count = atomic_load_explicit(&shared->session_count, memory_order_relaxed);
+    if (session_count < broker->config.max_clients && session_count != (int)session_id) {
+        pthread_mutex_unlock(&shared->sessions_lock);
+        LOG_WARN("Session %u out of order in the log, not recovering Client_ID: %s", session_id, id);
+        free(id);
+        return -1;
+    }
+    session *recovered = session_alloc(broker);
+    if (recovered && session_table_insert(&shared->sessions_by_id, id, recovered) < 0) {
+        recovered = NULL;
+    }
+    pthread_mutex_unlock(&shared->sessions_lock);
+    if (!recovered) {
+        LOG_WARN("Session limit reached, not recovering Client_ID: %s", id);
+        free(id);
+        return -1;
+    }
+    recovered->client_id = id;
+    return 0;
+}
+
+static void recover_subscribe(void *arg, uint32_t session_id, const char *filter, size_t len, uint8_t qos) {
+    broker_ctx *broker = ((recovery *)arg)->broker;
+    session *recovered = session_by_id(broker->shared, session_id);
+    if (!recovered || recovered->topic_count >= broker->config.max_topics) {
+        return;
+    }
+    if (topic_tree_subscribe(&broker->shared->subscriptions, filter, len, recovered, qos) == 1) {
+        recovered->topic_count++;
+    }
+}
+
+static void recover_message(void *arg, uint32_t session_id, uint64_t msg_id, const uint8_t *data, size_t len) {
+    recovery *state = (recovery *)arg;
+    broker_ctx *broker = state->broker;
+    session *recovered = session_by_id(broker->shared, session_id);
+    if (!recovered) {
+        return;
+    }
+    if (state->frame == NULL || state->frame->log_id != msg_id) {
+        pub_frame_release(state->frame);
+        state->frame = NULL;
+
+        //logged frames are QoS 1 PUBLISH as encoded by pub_frame_encode, the packet ID follows the topic
+        uint32_t remaining_length;
+        int offset = 1;
+        if (len < 5 || decode_remaining_length((uint8_t *)data, len, &remaining_length, &offset) != 0 ||
+            offset + 2 + (size_t)((data[offset] << 8) | data[offset + 1]) + 2 > len) {
+            LOG_WARN("Malformed logged message %llu", (unsigned long long)msg_id);
+            return;
+        }
+        pub_frame *frame = pool_alloc(sizeof(pub_frame) + len);
+        if (!frame) {
+            perror("Failed to allocate PUBLISH frame");
+            return;
+        }
+        frame->refcount = 1;
+        frame->len = len;
+        frame->qos = QOS;
+        frame->log_id = msg_id;
+        frame->pck_id_offset = offset + 2 + ((data[offset] << 8) | data[offset + 1]);
+        memcpy(frame->data, data, len);
+        state->frame = frame;
+    }
+    queue_publish(state->frame, recovered, broker); //offline, waits in the in-flight window until the client reconnects
+}
+
+//replays the persistence log into shard 0 before the shards start, then starts its compactor
+int broker_recover(broker_ctx *broker) {
+    broker_shared *shared = broker->shared;
+    if (shared->config.persist_dir[0] == '\0') {
+        return 0;
+    }
+    recovery state = {broker, NULL};
+    persist_replay replay = {recover_session, recover_subscribe, recover_message, &state};
+    int ret = persist_recover(&shared->persist, &replay);
+    pub_frame_release(state.frame);
+    if (ret < 0) {
+        return -1;
+    }
+    return persist_compactor_start(&shared->persist);
+}
+
+//hands out zeroed storage for a new session, NULL when max_clients is reached or memory runs out (sessions_lock held)
+session *session_alloc(broker_ctx *broker) {
+    broker_shared *shared = broker->shared;
+    int session_count = atomic_load_explicit(&shared->session_count, memory_order_relaxed);
+    if (session_count >= broker->config.max_clients) {
+        return NULL;
+    }
+    int chunk = session_count / SESSION_CHUNK;
+    if (chunk == shared->chunk_count) {
+        if (shared->chunk_count == shared->chunk_cap) {
+            int new_cap = shared->chunk_cap ? shared->chunk_cap * 2 : 16;
+            session **chunks = realloc(shared->session_chunks, new_cap * sizeof(session *));
+            if (!chunks) {
+                perror("Failed to grow session chunk list");
+                return NULL;
+            }
+            shared->session_chunks = chunks;
+            shared->chunk_cap = new_cap;
+        }
+        //a small max_clients gets a chunk of its own size
+        int chunk_size = broker->config.max_clients < SESSION_CHUNK ? broker->config.max_clients : SESSION_CHUNK;
+        shared->session_chunks[chunk] = calloc(chunk_size, sizeof(session));
+        if (!shared->session_chunks[chunk]) {
+            perror("Failed to allocate sessions");
+            return NULL;
+        }
+        shared->chunk_count++;
+    }
+    session *new_session = &shared->session_chunks[chunk][session_count % SESSION_CHUNK];
+    new_session->id = session_count;
+    new_session->matches = calloc(shared->shard_count, sizeof(session_match));
+    if (!new_session->matches) {
+        perror("Failed to allocate session match stamps");
+        return NULL;
+    }
+    atomic_store_explicit(&new_session->shard, broker->shard_id, memory_order_relaxed);
+    atomic_store_explicit(&shared->session_count, session_count + 1, memory_order_relaxed);
+    return new_session;
+}
+
+//returns the session bound to a connection, NULL if it hasn't sent CONNECT
+session *find_session(broker_ctx *broker, int conn_fd) {
+    if (conn_fd < 0 || conn_fd >= broker->max_connections || broker->connections[conn_fd] == NULL) {
+        return NULL;
+    }
+    return broker->connections[conn_fd]->session;
+}
+
 //function creates server at local ip and given port
-int create_tcpserver(int *server_fd, struct sockaddr_in *address, int *addrlen) {
+int create_tcpserver(int *server_fd, struct sockaddr_in *address, int *addrlen, const broker_config *config) {
     //create socket
-    if ((*server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) { //IPv4, stream-oriented (TCP)
+    if ((*server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) { //IPv4, stream-oriented (TCP), non-blocking for the event loop
         perror("Socket creation failed");
         return -1;
     }
@@ -15,11 +241,17 @@ int create_tcpserver(int *server_fd, struct sockaddr_in *address, int *addrlen)
         close(*server_fd);
         return -1;
     }
+    //every shard binds its own listening socket to the port, the kernel spreads new connections over them
+    if (config->threads > 1 && setsockopt(*server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        perror("setsockopt SO_REUSEPORT failed");
+        close(*server_fd);
+        return -1;
+    }
 
     //setup address
     address->sin_family = AF_INET;            //address family to IPv4
     address->sin_addr.s_addr = INADDR_ANY;    //accepting connectons on any available interface
-    address->sin_port = htons(BROKER_PORT);   //set port in network byte order
+    address->sin_port = htons(config->port);   //set port in network byte order
 
     //bind the socket to the specified address and port
     if (bind(*server_fd, (struct sockaddr *)address, *addrlen) < 0) { //cast to simple struct sockaddr
@@ -29,83 +261,37 @@ int create_tcpserver(int *server_fd, struct sockaddr_in *address, int *addrlen)
     }
 
     //listen for incoming connections
-    if (listen(*server_fd, MAX_CLIENTS) < 0){ 
+    if (listen(*server_fd, config->listen_backlog) < 0){ 
         perror("Listening failed\n");
         close(*server_fd); //clean up the socket before exiting
         return -1;
     }
-    printf("Server created sucessfully and listening\n");
+    LOG_INFO("Server created sucessfully and listening");
     return 0;
 }
 
-//main loop function, for each thread
-void *client_handler(void *arg) {
-    printf("Thread created\n");
-    thread_data *t_data = (thread_data *)arg; //cast to thread data type again
-    int conn_fd = t_data->conn_fd;
-    session *running_sessions = t_data->running_sessions;
-    free(t_data); //no longer needed, free
-
-    uint8_t buffer[BUFFER_SIZE] = {0};
-
-    // Handle client connection
-    while (1) {
-        ssize_t valread = read(conn_fd, buffer, BUFFER_SIZE);
-        if (valread <= 0) {
-            printf("Client disconnected: conn_fd: %d | forcing connection close\n", conn_fd);
-            //find the running session with matching conn_fd
-            session *current_session = NULL;
-            for (int i = 0; i < MAX_CLIENTS; i++) {
-                if (running_sessions[i].conn_fd == conn_fd) {
-                    current_session = &running_sessions[i];
-                    break;
-                }
-            }
-            if (current_session == NULL) {
-                printf("Session not found || couldn't reset conn_fd\n");
-            }
-            close(conn_fd);
-            current_session->conn_fd = 0;
-            
-            pthread_exit(NULL);
-        }
-
-        mqtt_pck received_pck = {0};
-        received_pck.conn_fd = conn_fd;
-
-        //Process MQTT packet
-        if (mqtt_process_pck(buffer, received_pck, running_sessions) < 0) {
-            printf("MQTT Process Error\n");
-        }
-        printf("|||||||||||||||||||||||\n");
-        usleep(10); //to not overload CPU
-    }
-    return NULL;
-}
-
-//function to decode the remaining length
-int decode_remaining_length(uint8_t *buffer, uint8_t *remaining_length, int *offset) {
-    int multiplier = 1;
+//function to decode the remaining length, returns 1 if more bytes are needed
+int decode_remaining_length(uint8_t *buffer, size_t len, uint32_t *remaining_length, int *offset) {
+    uint32_t multiplier = 1;
     uint8_t encoded_byte;
     *remaining_length = 0;
     *offset = 1;
     for (int i = 0; i < 4; i++) { //remaining Length can take up to 4 bytes
+        if ((size_t)*offset >= len) { //length bytes not fully received yet
+            return 1;
+        }
         encoded_byte = buffer[*offset];
         *remaining_length += (encoded_byte & 127) * multiplier;
         multiplier *= 128;
 
-        if (multiplier > 128 * 128 * 128) { //malformed packet check
-            printf("Malformed Remaining Length\n");
-            return -1;
-        }
-
         (*offset)++;
 
         if ((encoded_byte & 128) == 0) { //MSB = 0 indicates end of length encoding
-            break;
+            return 0;
         }
     }
-    return 0; 
+    LOG_WARN("Malformed Remaining Length"); //continuation bit set on the 4th byte
+    return -1;
 }
 
 //function to encode the remaining length
@@ -126,180 +312,329 @@ int encode_remaining_length(uint8_t *buffer, size_t remaining_len) {
     return bytes_written;
 }
 
-//function to easily made packet(only from a filled variable of type structure mqtt_pck)
-int send_pck(mqtt_pck *packet) {
+//function to easily made packet(only from a filled variable of type structure mqtt_pck), queued on the destination connection
+int send_pck(mqtt_pck *packet, broker_ctx *broker) {
+    connection *conn = broker->connections[packet->conn_fd];
+    if (!conn) {
+        LOG_ERROR("No connection for conn_fd %d", packet->conn_fd);
+        return -1;
+    }
+
     //buffer to encode the Remaining Length (max 4 bytes)
-    uint8_t remaining_length_encoded[4];
-    int remaining_length_size = encode_remaining_length(remaining_length_encoded, packet->remaining_len);
+    uint8_t fixed_header[5];
+    int remaining_length_size = encode_remaining_length(fixed_header + 1, packet->remaining_len);
     if (remaining_length_size < 1 || remaining_length_size > 4) {
-        printf("Failed to encode Remaining Length\n");
+        LOG_ERROR("Failed to encode Remaining Length");
         return -1;
     }
-
-    //calculate total size of the packet
-    size_t total_size = 1 + remaining_length_size; //fixed Header (1 byte for pck_type + flags) + Remaining Length
-    if (packet->variable_header) {
-        total_size += packet->variable_len; //variable Header size
+    fixed_header[0] = (packet->pck_type << 4) | (packet->flag & 0x0F); //packet Type and flags
+
+    //gather fixed header, variable header and payload straight from where they are
+    struct iovec iov[3];
+    int iov_count = 0;
+    iov[iov_count].iov_base = fixed_header;
+    iov[iov_count++].iov_len = 1 + remaining_length_size;
+    if (packet->variable_header && packet->variable_len > 0) {
+        iov[iov_count].iov_base = packet->variable_header;
+        iov[iov_count++].iov_len = packet->variable_len;
     }
-    if (packet->payload) {
-        total_size += packet->payload_len; //payload size
+    if (packet->payload && packet->payload_len > 0) {
+        iov[iov_count].iov_base = packet->payload;
+        iov[iov_count++].iov_len = packet->payload_len;
     }
 
-    // Allocate a buffer for the serialized packet
-    uint8_t *buffer = malloc(total_size);
-    if (!buffer) {
-        perror("Failed to allocate buffer for packet serialization");
+    //copied into the outbound queue, the event loop writes it together with the rest of the batch
+    if (tx_queue_iov(broker, conn, iov, iov_count) < 0) {
         return -1;
     }
+    LOG_DEBUG("Packet queued for conn_fd %d", packet->conn_fd);
+    return 0;
+}
 
-    //get offset
-    size_t offset = 0;
-    buffer[offset++] = (packet->pck_type << 4) | (packet->flag & 0x0F); //packet Type and flags
+//encodes a received PUBLISH once per delivery QoS into a shared frame, with a reference for the caller
+pub_frame *pub_frame_encode(mqtt_pck *received_pck, uint8_t qos) {
+    size_t topic_field_len = 2 + received_pck->topic_len; //topic length and topic, the packet ID isn't copied
+    size_t pck_id_len = qos ? 2 : 0;
+    size_t remaining_len = topic_field_len + pck_id_len + received_pck->payload_len;
 
-    memcpy(&buffer[offset], remaining_length_encoded, remaining_length_size);
-    offset += remaining_length_size;
+    uint8_t remaining_length_encoded[4];
+    int remaining_length_size = encode_remaining_length(remaining_length_encoded, remaining_len);
 
-    //serialize the Variable Header
-    if (packet->variable_header) {
-        memcpy(&buffer[offset], packet->variable_header, packet->variable_len);
-        offset += packet->variable_len;
+    size_t len = 1 + remaining_length_size + remaining_len;
+    pub_frame *frame = pool_alloc(sizeof(pub_frame) + len);
+    if (!frame) {
+        perror("Failed to allocate PUBLISH frame");
+        return NULL;
     }
+    frame->refcount = 1;
+    frame->len = len;
+    frame->qos = qos;
+    frame->log_id = 0;
+
+    size_t offset = 0;
+    frame->data[offset++] = (3 << 4) | (qos << 1); //PUBLISH, flags are patched per recipient
+    memcpy(&frame->data[offset], remaining_length_encoded, remaining_length_size);
+    offset += remaining_length_size;
+
+    //variable header is topic length, topic and (QoS 1 only) a packet ID placeholder
+    memcpy(&frame->data[offset], received_pck->variable_header, topic_field_len);
+    offset += topic_field_len;
+    frame->pck_id_offset = offset;
+    memset(&frame->data[offset], 0, pck_id_len);
+    offset += pck_id_len;
+
+    memcpy(&frame->data[offset], received_pck->payload, received_pck->payload_len);
+    return frame;
+}
 
-    //serialize the Payload
-    if (packet->payload) {
-        memcpy(&buffer[offset], packet->payload, packet->payload_len);
-        offset += packet->payload_len;
+//drops one reference of a frame, freeing it with the last one
+void pub_frame_release(pub_frame *frame) {
+    if (frame && --frame->refcount == 0) {
+        pool_free(frame, sizeof(pub_frame) + frame->len);
     }
+}
 
-    //send the serialized packet
-    ssize_t bytes_sent = send(packet->conn_fd, buffer, offset, 0);
+#if ZEROCOPY_THRESHOLD > 0
+//sends a frame with MSG_ZEROCOPY, the frame and header stay referenced until the kernel reports completion
+//whatever the socket doesn't take is queued like any other output
+static int send_frame_zerocopy(broker_ctx *broker, connection *conn, pub_frame *frame, uint8_t first_byte, int pck_id) {
+    zerocopy_pending *pending = pool_alloc(sizeof(zerocopy_pending));
+    if (!pending) {
+        perror("Failed to allocate zerocopy record");
+        return -1;
+    }
+    pending->header[0] = first_byte;
+    pending->header[1] = (pck_id >> 8) & 0xFF;
+    pending->header[2] = pck_id & 0xFF;
+
+    struct iovec iov[4];
+    iov[0].iov_base = &pending->header[0];
+    iov[0].iov_len = 1;
+    iov[1].iov_base = frame->data + 1;
+    iov[1].iov_len = frame->pck_id_offset - 1;
+    size_t pck_id_len = frame->qos ? 2 : 0;
+    iov[2].iov_base = &pending->header[1];
+    iov[2].iov_len = pck_id_len;
+    iov[3].iov_base = frame->data + frame->pck_id_offset + pck_id_len;
+    iov[3].iov_len = frame->len - frame->pck_id_offset - pck_id_len;
+
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 4;
+    ssize_t bytes_sent = sendmsg(conn->conn_fd, &msg, MSG_ZEROCOPY);
     if (bytes_sent < 0) {
-        perror("Failed to send packet");
-        free(buffer);
+        pool_free(pending, sizeof(zerocopy_pending));
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return tx_queue_frame(broker, conn, frame, first_byte, pck_id, 0);
+        }
+        perror("Failed to send PUBLISH frame");
+        return -1;
+    }
+    broker->tx_writes++; //counted like tx_sent counts queue flushes
+    METRIC_ADD(bytes_out, bytes_sent);
+
+    //every successful MSG_ZEROCOPY send gets the next completion sequence number of the socket
+    pending->seq = conn->zc_next_seq++;
+    pending->frame = frame;
+    pending->next = NULL;
+    frame->refcount++;
+    if (conn->zc_tail) {
+        conn->zc_tail->next = pending;
+    }
+    else {
+        conn->zc_head = pending;
+    }
+    conn->zc_tail = pending;
+    LOG_DEBUG("Packet sent to conn_fd %d (zerocopy seq %u)", conn->conn_fd, pending->seq);
+    if ((size_t)bytes_sent < frame->len) {
+        return tx_queue_frame(broker, conn, frame, first_byte, pck_id, bytes_sent); //counted as a packet there
+    }
+    broker->tx_packets++;
+    METRIC_INC(packets_out[first_byte >> 4]);
+    return 0;
+}
+#endif
+
+//sends a shared frame with this recipient's fixed header flags and packet ID
+int send_frame(int conn_fd, pub_frame *frame, uint8_t flag, int pck_id, broker_ctx *broker) {
+    connection *conn = broker->connections[conn_fd];
+    if (!conn) {
+        LOG_ERROR("No connection for conn_fd %d", conn_fd);
+        return -1;
+    }
+    //per recipient header: first byte and packet ID, everything else comes straight from the shared frame
+    uint8_t first_byte = (frame->data[0] & 0xF0) | (flag & 0x0F);
+
+    //large payloads skip the copy into the socket buffer, only when nothing is queued ahead of them
+#if ZEROCOPY_THRESHOLD > 0
+    size_t payload_len = frame->len - frame->pck_id_offset - (frame->qos ? 2 : 0);
+    if (conn->zerocopy && conn->tx_count == 0 && payload_len >= ZEROCOPY_THRESHOLD) {
+        return send_frame_zerocopy(broker, conn, frame, first_byte, pck_id);
+    }
+#endif
+
+    if (tx_queue_frame(broker, conn, frame, first_byte, pck_id, 0) < 0) {
         return -1;
     }
-    packet->time_sent = clock(); //only truly used in the case of PUBLISH packet, where it might need to retransmit
-    //clean up
-    free(buffer);
-    printf("Packet sent to conn_fd %d\n", packet->conn_fd);
+    LOG_DEBUG("Packet queued for conn_fd %d", conn_fd);
     return 0;
 }
 
+//reads MSG_ZEROCOPY completions from the socket error queue and releases the frames the kernel is done with
+void zerocopy_complete(connection *conn) {
+    while (conn->zc_head) {
+        char control[128];
+        struct msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(conn->conn_fd, &msg, MSG_ERRQUEUE) < 0) {
+            return; //EAGAIN, no more notifications
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            //notification covers the inclusive range [ee_info, ee_data], completions arrive in order
+            uint32_t last = err->ee_data;
+            while (conn->zc_head && (int32_t)(conn->zc_head->seq - last) <= 0) {
+                zerocopy_pending *done = conn->zc_head;
+                conn->zc_head = done->next;
+                pub_frame_release(done->frame);
+                pool_free(done, sizeof(zerocopy_pending));
+            }
+            if (!conn->zc_head) {
+                conn->zc_tail = NULL;
+            }
+        }
+    }
+}
+
+//drops every frame still waiting for a zerocopy completion, used when the connection closes
+void zerocopy_release_all(connection *conn) {
+    while (conn->zc_head) {
+        zerocopy_pending *done = conn->zc_head;
+        conn->zc_head = done->next;
+        pub_frame_release(done->frame);
+        pool_free(done, sizeof(zerocopy_pending));
+    }
+    conn->zc_tail = NULL;
+}
+
 //============================================================================================================================//
 //============================================================================================================================//
 //============================================================================================================================//
 //============================================================================================================================//
 //determine type of packet and process
-int mqtt_process_pck(uint8_t *buffer, mqtt_pck received_pck, session* running_sessions){
+int mqtt_process_pck(uint8_t *buffer, mqtt_pck received_pck, broker_ctx *broker){
     //======================Analise Fixed Header 1st byte=======================================//
     received_pck.flag = buffer[0] & 0x0F;             //0->4 flag
     received_pck.pck_type = (buffer[0] >> 4) & 0x0F;  //4->7 control packet type
     
     //==============================Decode remaining packet length=============================//
+    //buffer holds exactly one complete packet, framed by the event loop, and the parsed fields point into it
     int offset = 1;
-    uint8_t remaining_length;
-    if (decode_remaining_length(buffer, &remaining_length, &offset) < 0) {
+    uint32_t remaining_length;
+    if (decode_remaining_length(buffer, 1 + 4, &remaining_length, &offset) != 0) {
         return -1; //error decoding Remaining Length
     }
     received_pck.remaining_len = remaining_length;
-    printf("Packet Received || conn_fd: %d || ", received_pck.conn_fd);
-    // printf("Flag: %d || packet Type: %d || Remaining Length: %ld || ", received_pck.flag, received_pck.pck_type, received_pck.remaining_len);
+    METRIC_INC(packets_in[received_pck.pck_type]);
+    // LOG_DEBUG("Flag: %d || packet Type: %d || Remaining Length: %ld", received_pck.flag, received_pck.pck_type, received_pck.remaining_len);
 
     //=============Determine packet type received from a Client=================//
-    printf("Packet Type: ");
+    int ret;
     switch (received_pck.pck_type)
     {
     case 1: //CONNECT
-        printf("CONNECT\n");
+        LOG_DEBUG("Packet Received || conn_fd: %d || Packet Type: CONNECT", received_pck.conn_fd);
         if (received_pck.flag != 0){ //flag must be 0 for CONNECT
-            printf("Invalid flag for CONNECT\n");
+            LOG_WARN("Invalid flag for CONNECT");
+            return -1;
+        }
+        if (received_pck.remaining_len < 12) { //10 bytes variable header + 2 bytes client id length
+            LOG_WARN("Malformed CONNECT");
             return -1;
         }
         //fill variable header
         received_pck.variable_len = 10;
-        received_pck.variable_header = malloc(received_pck.variable_len); //allocate 10 bytes (CONNECT variable header)
-        if (received_pck.variable_header == NULL) {
-            perror("Failed to allocate memory for variable header");
-            exit(EXIT_FAILURE);
-        }
-        memcpy(received_pck.variable_header, buffer + offset, received_pck.variable_len); //copy 10 bytes from buffer starting at offset
-        
+        received_pck.variable_header = buffer + offset; //10 bytes (CONNECT variable header)
+
         //compute payload len
         received_pck.payload_len = received_pck.remaining_len - received_pck.variable_len;
 
         //fill payload
-        received_pck.payload = malloc(received_pck.payload_len); //allocate 10 bytes (CONNECT variable header)
-        if (received_pck.payload == NULL) {
-            perror("Failed to allocate memory for payload");
-            exit(EXIT_FAILURE);
-        }
-        memcpy(received_pck.payload, buffer + offset + received_pck.variable_len, received_pck.payload_len); //copy X bytes from buffer starting after variable header
+        received_pck.payload = buffer + offset + received_pck.variable_len; //starts after variable header
 
-        return connect_handler(&received_pck, running_sessions); //interpret connect command
+        ret = connect_handler(&received_pck, broker); //interpret connect command
+        break;
     
     case 3: //PUBLISH
-        printf("PUBLISH\n");
+        LOG_DEBUG("Packet Received || conn_fd: %d || Packet Type: PUBLISH", received_pck.conn_fd);
+        if (received_pck.remaining_len < 2) {
+            LOG_WARN("Malformed PUBLISH");
+            return -1;
+        }
         //fill variable header
         received_pck.topic_len = (buffer[offset] << 8) | buffer[offset + 1];
-        received_pck.variable_len = received_pck.topic_len + 4; //+2 for length MSB and LSB and +2 for Packet ID MSB and LSB
-
-        received_pck.variable_header = malloc(received_pck.variable_len); //allocate bytes (PUBLISH variable header)
-        if (received_pck.variable_header == NULL) {
-            perror("Failed to allocate memory for variable header");
-            exit(EXIT_FAILURE);
+        received_pck.variable_len = received_pck.topic_len + 2; //+2 for length MSB and LSB
+        if (received_pck.flag & 0x06) {
+            received_pck.variable_len += 2; //+2 for Packet ID MSB and LSB, QoS 0 has none
+        }
+        if (received_pck.variable_len > received_pck.remaining_len) {
+            LOG_WARN("Malformed PUBLISH");
+            return -1;
         }
-        memcpy(received_pck.variable_header, buffer + offset, received_pck.variable_len); //copy bytes from buffer starting at offset
-        
+
+        received_pck.variable_header = buffer + offset; //PUBLISH variable header
+
         //compute payload len
         received_pck.payload_len = received_pck.remaining_len - received_pck.variable_len;
 
         //fill payload
-        received_pck.payload = malloc(received_pck.payload_len); //allocate bytes (PUBLISH variable header)
-        if (received_pck.payload == NULL) {
-            perror("Failed to allocate memory for payload");
-            exit(EXIT_FAILURE);
-        }
-        memcpy(received_pck.payload, buffer + offset + received_pck.variable_len, received_pck.payload_len); //copy X bytes from buffer starting after variable header
+        received_pck.payload = buffer + offset + received_pck.variable_len; //starts after variable header
 
-        return publish_handler(&received_pck, running_sessions); //interpret publish command
+        ret = publish_handler(&received_pck, broker); //interpret publish command
+        break;
     
     case 4: //PUBLISH ACKNOWLEDGE
-        printf("PUBACK\n");
+        LOG_DEBUG("Packet Received || conn_fd: %d || Packet Type: PUBACK", received_pck.conn_fd);
+        if (received_pck.remaining_len != 2) {
+            LOG_WARN("Malformed PUBACK");
+            return -1;
+        }
         //fill variable header
         received_pck.variable_len = 2; //variable header only has packet ID MSB and LSB
 
-        received_pck.variable_header = malloc(received_pck.variable_len); //allocate bytes (PUBLISH variable header)
-        if (received_pck.variable_header == NULL) {
-            perror("Failed to allocate memory for variable header");
-            exit(EXIT_FAILURE);
-        }
-        memcpy(received_pck.variable_header, buffer + offset, received_pck.variable_len); //copy bytes from buffer starting at offset
-        
-        //compute payload len
-        received_pck.payload_len = received_pck.remaining_len - received_pck.variable_len;
+        received_pck.variable_header = buffer + offset;
 
         //fill payload
         received_pck.payload_len = 0;
         received_pck.payload = NULL; //no payload on PUBACL
 
-        return puback_handler(&received_pck, running_sessions);
+        ret = puback_handler(&received_pck, broker);
+        break;
 
     case 8: //SUBSCRIBE
-        printf("SUBSCRIBE\n");
+        LOG_DEBUG("Packet Received || conn_fd: %d || Packet Type: SUBSCRIBE", received_pck.conn_fd);
         if (received_pck.flag != 2){ //flag must be 0b1000 for SUBSCRIBE
-            printf("Invalid flag for SUBSCRIBE\n");
+            LOG_WARN("Invalid flag for SUBSCRIBE");
+            return -1;
+        }
+        if (received_pck.remaining_len < 2) {
+            LOG_WARN("Malformed SUBSCRIBE");
             return -1;
         }
         //size of variable header for this packet
         received_pck.variable_len = 2;
         //fill variable header
-        received_pck.variable_header = malloc(received_pck.variable_len); // Allocate var_head bytes (SUBSCRIBE variable header, CONTAINS PACKET ID!!!)
-        if (received_pck.variable_header == NULL) {
-            perror("Failed to allocate memory for variable header");
-            exit(EXIT_FAILURE);
-        }
-        memcpy(received_pck.variable_header, buffer + offset, received_pck.variable_len); //copy var_head bytes from buffer starting at offset
-        
+        received_pck.variable_header = buffer + offset; //SUBSCRIBE variable header, CONTAINS PACKET ID!!!
+
         // Extract Packet ID
         received_pck.pck_id = (buffer[offset] << 8) | buffer[offset + 1]; //copy packet id bytes to mqtt_pck
 
@@ -307,26 +642,48 @@ int mqtt_process_pck(uint8_t *buffer, mqtt_pck received_pck, session* running_se
         received_pck.payload_len = received_pck.remaining_len - received_pck.variable_len;
 
         //fill payload
-        received_pck.payload = malloc(received_pck.payload_len); // Allocate var_head bytes (CONNECT variable header)
-        if (received_pck.payload == NULL) {
-            perror("Failed to allocate memory for payload");
-            exit(EXIT_FAILURE);
+        received_pck.payload = buffer + offset + received_pck.variable_len; //starts after variable header
+
+        ret = subscribe_handler(&received_pck, broker);
+        break;
+
+    case 10: //UNSUBSCRIBE
+        LOG_DEBUG("Packet Received || conn_fd: %d || Packet Type: UNSUBSCRIBE", received_pck.conn_fd);
+        if (received_pck.flag != 2){ //flag must be 0b0010 for UNSUBSCRIBE
+            LOG_WARN("Invalid flag for UNSUBSCRIBE");
+            return -1;
         }
-        memcpy(received_pck.payload, buffer + offset + received_pck.variable_len, received_pck.payload_len); //copy X bytes from buffer starting after variable header
+        if (received_pck.remaining_len < 2) {
+            LOG_WARN("Malformed UNSUBSCRIBE");
+            return -1;
+        }
+        //variable header is only the packet ID
+        received_pck.variable_len = 2;
+        received_pck.variable_header = buffer + offset;
+        received_pck.pck_id = (buffer[offset] << 8) | buffer[offset + 1];
+
+        //payload holds the topic filters
+        received_pck.payload_len = received_pck.remaining_len - received_pck.variable_len;
+        received_pck.payload = buffer + offset + received_pck.variable_len;
 
-        return subscribe_handler(&received_pck, running_sessions);
+        ret = unsubscribe_handler(&received_pck, broker);
+        break;
 
     case 12:
-        printf("PING Request\n");
-        return send_pingresp(&received_pck);
+        LOG_DEBUG("Packet Received || conn_fd: %d || Packet Type: PING Request", received_pck.conn_fd);
+        ret = send_pingresp(&received_pck, broker);
+        break;
 
     case 14:
-        printf("DISCONNECT\n");
-        return disconnect_handler(&received_pck, running_sessions);
+        LOG_DEBUG("Packet Received || conn_fd: %d || Packet Type: DISCONNECT", received_pck.conn_fd);
+        ret = disconnect_handler(&received_pck, broker);
+        break;
     default:
         return -1;
     }
-    return 0;
+
+    //handlers copy what they keep, the fields point into the receive buffer, which holds the packet until it is handled
+    return ret;
 }
 //============================================================================================================================//
 //============================================================================================================================//
@@ -334,81 +691,154 @@ int mqtt_process_pck(uint8_t *buffer, mqtt_pck received_pck, session* running_se
 //============================================================================================================================//
 
 //disconnects client properly
-int disconnect_handler(mqtt_pck *received_pck, session* running_sessions){
-    //find the running session with matching conn_fd
-    session *current_session = NULL;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (running_sessions[i].conn_fd == received_pck->conn_fd) {
-            current_session = &running_sessions[i];
-            break;
-        }
-    }
+int disconnect_handler(mqtt_pck *received_pck, broker_ctx *broker){
+    //find the running session bound to this connection
+    session *current_session = find_session(broker, received_pck->conn_fd);
     if (current_session == NULL) {
-        printf("Session not found for conn_fd: %d\n", received_pck->conn_fd);
-        return -1;
+        LOG_WARN("Session not found for conn_fd: %d", received_pck->conn_fd);
+        return MQTT_PCK_CLOSE;
     }
 
-    printf("DISCONNECTION || conn_fd: %d || Client_ID: '%s'\n", current_session->conn_fd, current_session->client_id);
-    current_session->last_pck_received_id = 0; //reset last packet id
-    close(current_session->conn_fd);
-    current_session->conn_fd = 0;
-    pthread_exit(NULL);
+    LOG_INFO("DISCONNECTION || conn_fd: %d || Client_ID: '%s'", current_session->conn_fd, current_session->client_id);
+    return MQTT_PCK_CLOSE; //event loop closes the socket and detaches the session
 }
 
 //handle(interprets) CONNECT packet
-int connect_handler(mqtt_pck *received_pck, session* running_sessions){
+int connect_handler(mqtt_pck *received_pck, broker_ctx *broker){
     int return_code = 0; 
     int session_present = 0;
 
     //check variable header
     uint8_t expected_protocol[8] = {0x00, 0x04, 0x4D, 0x51, 0x54, 0x54, 0x04, 0x02};
     if (memcmp(received_pck->variable_header, expected_protocol, 8) != 0){
-        printf("Invalid protocol\n");
+        LOG_WARN("Invalid protocol");
         return_code = 1;
     }
-    int keepalive = received_pck->variable_header[9];
+    int keepalive = (received_pck->variable_header[8] << 8) | received_pck->variable_header[9];
     
     //Check payload
     int id_len = (received_pck->payload[0] << 8)  | received_pck->payload[1];
+    if (id_len + 2 > received_pck->payload_len) {
+        LOG_WARN("Malformed CONNECT payload");
+        return -1;
+    }
 
-    char* client_id = malloc(id_len);
+    char* client_id = arena_alloc(&broker->arena, id_len + 1); //+1 for null-terminator, only a lookup key until a session keeps it
     if (client_id == NULL) {
-        perror("Failed to allocate memory for client id");
-        exit(EXIT_FAILURE);
+        return MQTT_PCK_CLOSE; //reported by arena_alloc, only this client is refused
     }
     memcpy(client_id, received_pck->payload + 2, id_len);
+    client_id[id_len] = '\0';
+
+    connection *conn = broker->connections[received_pck->conn_fd];
+    if (conn->session != NULL || conn->adopting != NULL) { //a second CONNECT on the same connection is a protocol violation
+        LOG_WARN("Duplicated CONNECT || conn_fd: %d", received_pck->conn_fd);
+        return MQTT_PCK_CLOSE;
+    }
 
-    //check if client_id exists in any session
-    int session_idx = -1;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (running_sessions[i].client_id != NULL) {
-            //compare existing session client_id with the received client_id
-            if (strcmp(running_sessions[i].client_id, client_id) == 0) {
-                printf("Ongoing session found for Client_ID: %s || conn_fd: %d || index %d\n", running_sessions[i].client_id, running_sessions[i].conn_fd, i);
-                session_idx = i;
-                session_present = 1; // Mark session as present
-                break;
+    //check if client_id exists in any session, or register a new one, under the registry lock
+    broker_shared *shared = broker->shared;
+    pthread_mutex_lock(&shared->sessions_lock);
+    int created = 0;
+    session *current_session = session_table_find(&shared->sessions_by_id, client_id);
+    if (current_session != NULL) {
+        LOG_INFO("Ongoing session found for Client_ID: %s", current_session->client_id);
+        session_present = 1; // Mark session as present
+        client_id = current_session->client_id;
+    }
+    else {
+        //take storage for a new session, chunks grow on demand up to max_clients
+        char *kept_id = strdup(client_id); //the session outlives the arena copy
+        current_session = kept_id ? session_alloc(broker) : NULL;
+        if (current_session == NULL) {
+            free(kept_id);
+        }
+        else {
+            client_id = kept_id;
+            current_session->client_id = client_id;
+            if (session_table_insert(&shared->sessions_by_id, client_id, current_session) < 0) {
+                pthread_mutex_unlock(&shared->sessions_lock);
+                return -1;
             }
-        } 
-        else if (session_idx == -1) {
-            //save first available slot for a new session
-            session_idx = i;
+            created = 1;
         }
     }
-    //associate client info with session
-    running_sessions[session_idx].client_id = client_id;
-    running_sessions[session_idx].conn_fd = received_pck->conn_fd;
-    running_sessions[session_idx].keepalive = keepalive;
+    pthread_mutex_unlock(&shared->sessions_lock);
+    if (created) {
+        persist_session(&broker->log, current_session->id, client_id, id_len);
+    }
 
-    printf("Valid Protocol || Keepalive: %d || Client_ID: %s || SessionIdx: %d\n", keepalive, client_id, session_idx);
+    if (current_session == NULL) {
+        LOG_WARN("Session limit reached || refusing Client_ID: %s", client_id);
+        session refused = {0};
+        refused.conn_fd = received_pck->conn_fd;
+        send_connack(&refused, MQTT_CONN_REFUSED_SERVER_UNAVAILABLE, 0, broker);
+        return MQTT_PCK_CLOSE;
+    }
+
+    //session owned by another shard: ask for it and hold this connection's packets until it arrives
+    int owner = atomic_load_explicit(&current_session->shard, memory_order_acquire);
+    if (owner != broker->shard_id) {
+        shard_msg *msg = pool_alloc(sizeof(shard_msg));
+        if (!msg) {
+            perror("Failed to allocate shard message");
+            return -1;
+        }
+        memset(msg, 0, sizeof(shard_msg)); //cap 0, no sessions array
+        msg->type = SHARD_MSG_TAKEOVER;
+        msg->session = current_session;
+        msg->conn = conn;
+        msg->conn_fd = conn->conn_fd;
+        msg->shard = broker->shard_id;
+        conn->adopting = current_session;
+        conn->connect_keepalive = keepalive;
+        conn->connect_return_code = return_code;
+        LOG_DEBUG("Requesting session of Client_ID: %s from shard %d", client_id, owner);
+        shard_queue_push(&shared->shards[owner]->inbox, &msg->node);
+        return MQTT_PCK_DEFER;
+    }
+
+    //session still bound to another connection of this shard: take it over and let the event loop close the old one
+    if (current_session->conn_fd != 0 && current_session->conn_fd != received_pck->conn_fd) {
+        LOG_INFO("Taking over session from conn_fd: %d", current_session->conn_fd);
+        connection *old_conn = broker->connections[current_session->conn_fd];
+        if (old_conn) {
+            old_conn->session = NULL;
+        }
+        shutdown(current_session->conn_fd, SHUT_RDWR);
+    }
+    return connect_complete(conn, current_session, keepalive, return_code, session_present, broker);
+}
+
+//binds a session to a connection and answers CONNECT, the session must be owned by this shard
+int connect_complete(connection *conn, session *current_session, int keepalive, int return_code, int session_present, broker_ctx *broker) {
+    //associate client info with session, a takeover keeps the client counted as connected
+    if (current_session->conn_fd == 0) {
+        METRIC_INC(clients_connected);
+    }
+    current_session->conn_fd = conn->conn_fd;
+    current_session->keepalive = keepalive;
+    conn->session = current_session;
+    inbound_ids_clear(current_session); //a connection taken over isn't closed through the session, IDs start over anyway
+    connection_set_idle(broker, conn, KEEPALIVE_GRACE(keepalive)); //replaces the CONNECT deadline
+
+    LOG_INFO("Valid Protocol || Keepalive: %d || Client_ID: %s", keepalive, current_session->client_id);
 
     //assign the new connection to the corresponding session
-    return send_connack(&running_sessions[session_idx], return_code, session_present);
+    if (send_connack(current_session, return_code, session_present, broker) < 0) {
+        return -1;
+    }
+    //messages left unacknowledged (or queued) while the client was away are delivered now
+    if (session_present) {
+        resend_inflight(current_session, broker);
+    }
+    return 0;
 }
 
 //Prepares and sends connack packet
-int send_connack(session* current_session, int return_code, int session_present) {
+int send_connack(session* current_session, int return_code, int session_present, broker_ctx *broker) {
     mqtt_pck connack_packet;
+    uint8_t variable_header[2]; //copied into the output queue by send_pck
 
     //fixed Header
     connack_packet.flag = 0;
@@ -417,11 +847,7 @@ int send_connack(session* current_session, int return_code, int session_present)
 
     //variable Header
     connack_packet.variable_len = 2;
-    connack_packet.variable_header = malloc(connack_packet.variable_len); //allocate 7 bytes (PUBLISH variable header)
-    if (!connack_packet.variable_header) {
-        perror("Failed to allocate memory for CONNACK variable header");
-        return -1;
-    }
+    connack_packet.variable_header = variable_header;
     connack_packet.variable_header[0] = session_present & 0x01; // Reserved(0000) || SessionPresent(which is 1 or 0)
     connack_packet.variable_header[1] = return_code; //Connect Return Code (only 0x00 or 0x01)
 
@@ -431,18 +857,17 @@ int send_connack(session* current_session, int return_code, int session_present)
 
     //conn_fd
     connack_packet.conn_fd = current_session->conn_fd;
-    if (send_pck(&connack_packet) < 0){
-        printf("Failed to send CONNACK\n");
-        free(connack_packet.variable_header);
+    if (send_pck(&connack_packet, broker) < 0){
+        LOG_ERROR("Failed to send CONNACK");
         return -1;
     }
-    printf("CONNACK sent successfully\n");
+    LOG_DEBUG("CONNACK sent successfully");
     return 0;
 }
 
 
 //Sends PingResp packet(no need for handler before)
-int send_pingresp(mqtt_pck *received_pck) {
+int send_pingresp(mqtt_pck *received_pck, broker_ctx *broker) {
     mqtt_pck pingresp_packet;
 
     //fixed Header
@@ -460,95 +885,98 @@ int send_pingresp(mqtt_pck *received_pck) {
     //connection file descriptor
     pingresp_packet.conn_fd = received_pck->conn_fd;
 
-    if (send_pck(&pingresp_packet) < 0) {
+    if (send_pck(&pingresp_packet, broker) < 0) {
         perror("Failed to send PING packet");
         return -1;
     }
 
-    printf("PINGRESP sent successfully\n");
+    LOG_DEBUG("PINGRESP sent successfully");
     return 0;
 }
 
 //handle SUBSCRIBE packet
-int subscribe_handler(mqtt_pck *received_pck, session *running_sessions) {
-    //find the running session with matching conn_fd
-    session *current_session = NULL;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (running_sessions[i].conn_fd == received_pck->conn_fd) {
-            current_session = &running_sessions[i];
-            break;
-        }
-    }
+int subscribe_handler(mqtt_pck *received_pck, broker_ctx *broker) {
+    //find the running session bound to this connection
+    session *current_session = find_session(broker, received_pck->conn_fd);
     if (current_session == NULL) {
-        printf("Session not found for conn_fd: %d\n", received_pck->conn_fd);
+        LOG_WARN("Session not found for conn_fd: %d", received_pck->conn_fd);
         return -1;
     }
 
     //print received packet ID
-    printf("Packet ID: %d\n", received_pck->pck_id);
+    LOG_DEBUG("Packet ID: %d", received_pck->pck_id);
 
     //process the payload
     int offset = 0;
     int num_topics = 0;
+    uint8_t *return_codes = arena_alloc(&broker->arena, received_pck->payload_len / 3 + 1); //each topic takes at least 3 bytes (length + 1 char + QoS)
+    if (!return_codes) {
+        return -1;
+    }
 
     while (offset < received_pck->payload_len) {
+        if (received_pck->payload_len - offset < 2) {
+            LOG_WARN("Malformed SUBSCRIBE payload");
+            return -1;
+        }
         //check topic length from the first two bytes of the payload
         uint16_t topic_len = (received_pck->payload[offset] << 8) | received_pck->payload[offset + 1];
         offset += 2;
 
         //ensure topic length is within valid range
-        if (topic_len <= 0 || topic_len > received_pck->payload_len - offset) {
-            printf("Invalid topic length: %d\n", topic_len);
+        if (topic_len <= 0 || topic_len + 1 > received_pck->payload_len - offset) { //+1 for the QoS byte
+            LOG_WARN("Invalid topic length: %d", topic_len);
             return -1;
         }
 
-        //extract topic name
-        char topic[topic_len + 1];  //+1 for null-terminator
-        memcpy(topic, received_pck->payload + offset, topic_len);
-        topic[topic_len] = '\0'; //properly terminate the topic string
+        const char *topic = (const char *)received_pck->payload + offset; //not null-terminated, checked by topic_filter_valid
         offset += topic_len;
 
         //check if the QoS is valid
         uint8_t qos = received_pck->payload[offset];
-        if (qos > 1) { //only QoS 1 or 0
-            printf("Ignoring topic '%s' with unsupported QoS level: %d\n", topic, qos);
-            offset += 1;
+        offset++; //move past the QoS byte
+        if (qos > 2 || !topic_filter_valid(topic, topic_len)) {
+            LOG_WARN("Rejecting topic '%.*s' || QoS level: %d", topic_len, topic, qos);
+            return_codes[num_topics++] = MQTT_SUBACK_FAILURE;
             continue;
         }
-        offset++; //move past the QoS byte
 
-        //check if the topic already exists in the client's session
-        bool topic_exists = false;
-        for (int i = 0; i < MAX_TOPICS; i++) {
-            if (strcmp(current_session->topic[i], topic) == 0) {
-                topic_exists = true;
-                printf("Topic '%s' already exists in the session with conn_fd: %d in topic_id: %d\n", topic, current_session->conn_fd, i);
-                break;
-            }
+        //store the filter in the subscription index, an existing one only has its QoS refreshed
+        uint8_t granted_qos = qos < QOS ? qos : QOS; //QoS 2 is granted as QoS 1
+        pthread_mutex_lock(&broker->shared->subscriptions_lock);
+        int ret = topic_tree_subscribe(&broker->shared->subscriptions, topic, topic_len, current_session, granted_qos);
+        if (ret == 1 && current_session->topic_count >= broker->config.max_topics) {
+            topic_tree_unsubscribe(&broker->shared->subscriptions, topic, topic_len, current_session);
+            ret = -2;
         }
-
-        //store the topic if it's new
-        if (!topic_exists) {
-            for (int i = 0; i < MAX_TOPICS; i++) {
-                if (current_session->topic[i][0] == '\0') { //empty topic slot found
-                    strncpy(current_session->topic[i], topic, sizeof(current_session->topic[i]) - 1);
-                    current_session->topic[i][sizeof(current_session->topic[i]) - 1] = '\0';  //ensure null termination
-                    printf("Stored new topic: '%s' in the session with conn_fd: %d in topic_id: %d\n", topic, current_session->conn_fd, i);
-                    break;
-                }
-            }
+        pthread_mutex_unlock(&broker->shared->subscriptions_lock);
+        if (ret == -2) {
+            LOG_WARN("Topic limit reached for conn_fd: %d || rejecting '%.*s'", current_session->conn_fd, topic_len, topic);
         }
-
-        num_topics++;
+        if (ret < 0) {
+            return_codes[num_topics++] = MQTT_SUBACK_FAILURE;
+            continue;
+        }
+        persist_subscription(&broker->log, current_session->id, topic, topic_len, granted_qos);
+        retained_collect(broker, broker->connections[received_pck->conn_fd], topic, topic_len, granted_qos); //sent after the SUBACK
+        if (ret == 1) {
+            current_session->topic_count++;
+            LOG_DEBUG("Stored new topic: '%.*s' in the session with conn_fd: %d", topic_len, topic, current_session->conn_fd);
+        }
+        else {
+            LOG_DEBUG("Topic '%.*s' already exists in the session with conn_fd: %d", topic_len, topic, current_session->conn_fd);
+        }
+        return_codes[num_topics++] = granted_qos;
     }
 
     //send a SUBACK packet back to the client after processing all topics
-    return send_suback(current_session, received_pck->pck_id, num_topics); //not entire received_pck necessary for acknowledgment, only packet id and number of subscripted topics in this message
+    return send_suback(current_session, received_pck->pck_id, return_codes, num_topics, broker); //not entire received_pck necessary for acknowledgment, only packet id and return code of each topic in this message
 }
 
 //send SUBACK
-int send_suback(session *current_session, int pck_id, int num_topics) {
+int send_suback(session *current_session, int pck_id, uint8_t *return_codes, int num_topics, broker_ctx *broker) {
     mqtt_pck suback_packet;
+    uint8_t variable_header[2]; //copied into the output queue by send_pck
 
     //fixed Header
     suback_packet.flag = 0;
@@ -557,114 +985,519 @@ int send_suback(session *current_session, int pck_id, int num_topics) {
 
     //variable Header (Packet Identifier)
     suback_packet.variable_len = 2;
-    suback_packet.variable_header = malloc(suback_packet.variable_len); 
-    if (!suback_packet.variable_header) {
-        perror("Failed to allocate memory for SUBACK variable header");
-        return -1;
-    }
+    suback_packet.variable_header = variable_header;
     suback_packet.variable_header[0] = (pck_id >> 8) & 0xFF; // MSB of pck_id
     suback_packet.variable_header[1] = pck_id & 0xFF;        // LSB of pck_id
 
     //payload (QoS Levels for each topic)
     suback_packet.payload_len = num_topics;
-    suback_packet.payload = malloc(num_topics);
-    if (!suback_packet.payload) {
-        perror("Failed to allocate memory for SUBACK payload");
-        free(suback_packet.variable_header);
+    suback_packet.payload = return_codes; //granted QoS level (or failure) for each topic, in request order
+
+    //assign the connection file descriptor
+    suback_packet.conn_fd = current_session->conn_fd;
+
+    //Send the SUBACK packet using send_pck
+    if (send_pck(&suback_packet, broker) < 0) {
+        LOG_ERROR("Failed to send SUBACK");
         return -1;
     }
-    
-    //setting QoS level for each topic (set to QoS 1 for all)
-    for (int i = 0; i < num_topics; i++) {
-        suback_packet.payload[i] = 0x01;  // QoS 1 for each topic
+    LOG_DEBUG("SUBACK sent successfully for Packet_ID: %d", pck_id);
+    return 0;
+}
+
+//handle UNSUBSCRIBE packet
+int unsubscribe_handler(mqtt_pck *received_pck, broker_ctx *broker) {
+    //find the running session bound to this connection
+    session *current_session = find_session(broker, received_pck->conn_fd);
+    if (current_session == NULL) {
+        LOG_WARN("Session not found for conn_fd: %d", received_pck->conn_fd);
+        return -1;
     }
 
+    //process the payload, a list of topic filters without QoS bytes
+    int offset = 0;
+    while (offset < received_pck->payload_len) {
+        if (received_pck->payload_len - offset < 2) {
+            LOG_WARN("Malformed UNSUBSCRIBE payload");
+            return -1;
+        }
+        uint16_t topic_len = (received_pck->payload[offset] << 8) | received_pck->payload[offset + 1];
+        offset += 2;
+
+        if (topic_len <= 0 || topic_len > received_pck->payload_len - offset) {
+            LOG_WARN("Invalid topic length: %d", topic_len);
+            return -1;
+        }
+
+        const char *topic = (const char *)received_pck->payload + offset;
+        offset += topic_len;
+
+        pthread_mutex_lock(&broker->shared->subscriptions_lock);
+        int removed = topic_tree_unsubscribe(&broker->shared->subscriptions, topic, topic_len, current_session);
+        pthread_mutex_unlock(&broker->shared->subscriptions_lock);
+        if (removed == 1) {
+            persist_subscription(&broker->log, current_session->id, topic, topic_len, -1);
+            current_session->topic_count--;
+            LOG_DEBUG("Removed topic: '%.*s' from the session with conn_fd: %d", topic_len, topic, current_session->conn_fd);
+        }
+    }
+
+    //UNSUBACK is sent even if no filter matched an existing subscription
+    return send_unsuback(current_session, received_pck->pck_id, broker);
+}
+
+//send UNSUBACK
+int send_unsuback(session *current_session, int pck_id, broker_ctx *broker) {
+    mqtt_pck unsuback_packet;
+    uint8_t variable_header[2]; //copied into the output queue by send_pck
+
+    //fixed Header
+    unsuback_packet.flag = 0;
+    unsuback_packet.pck_type = 11; // UNSUBACK control packet type
+    unsuback_packet.remaining_len = 2; // Packet Identifier only
+
+    //variable Header (Packet Identifier)
+    unsuback_packet.variable_len = 2;
+    unsuback_packet.variable_header = variable_header;
+    unsuback_packet.variable_header[0] = (pck_id >> 8) & 0xFF; // MSB of pck_id
+    unsuback_packet.variable_header[1] = pck_id & 0xFF;        // LSB of pck_id
+
+    //no Payload
+    unsuback_packet.payload_len = 0;
+    unsuback_packet.payload = NULL;
+
     //assign the connection file descriptor
-    suback_packet.conn_fd = current_session->conn_fd;
+    unsuback_packet.conn_fd = current_session->conn_fd;
 
-    //Send the SUBACK packet using send_pck
-    if (send_pck(&suback_packet) < 0) {
-        printf("Failed to send SUBACK\n");
-        free(suback_packet.variable_header);
-        free(suback_packet.payload);
+    if (send_pck(&unsuback_packet, broker) < 0) {
+        LOG_ERROR("Failed to send UNSUBACK");
         return -1;
     }
+    LOG_DEBUG("UNSUBACK sent successfully for Packet_ID: %d", pck_id);
+    return 0;
+}
 
-    //Clean up allocated memory
-    free(suback_packet.variable_header);
-    free(suback_packet.payload);
+//per publish state while walking the subscription index
+typedef struct {
+    mqtt_pck *received_pck;
+    const char *topic;             //not null-terminated
+    const topic_levels *levels;    //found by topic_scan while validating the name
+    uint8_t qos;                   //QoS of the received PUBLISH, no delivery is sent with more
+    unsigned int stamp;
+    broker_ctx *broker;
+    int matched_count;             //sessions collected in broker->matched
+    pub_frame *frame[QOS + 1];     //one per delivery QoS, encoded on first use and shared by every subscriber
+    shard_msg *remote[QOS + 1][MAX_SHARDS]; //subscribers owned by other shards, one message per shard and delivery QoS
+} publish_route;
+
+//gives a shard message back to the pool, on whichever shard handled it last
+void shard_msg_free(shard_msg *msg) {
+    pool_free(msg, sizeof(shard_msg) + msg->cap * sizeof(session *));
+}
 
-    printf("SUBACK sent successfully for Packet_ID: %d\n", pck_id);
+//adds a session to the DELIVER message for its shard, holding a frame reference per message
+static int remote_add(shard_msg **msg, pub_frame *frame, session *target) {
+    if (*msg == NULL || (*msg)->count == (*msg)->cap) {
+        int new_cap = *msg ? (*msg)->cap * 2 : 16;
+        shard_msg *grown = pool_alloc(sizeof(shard_msg) + new_cap * sizeof(session *));
+        if (!grown) {
+            perror("Failed to grow shard message");
+            return -1;
+        }
+        if (*msg == NULL) {
+            memset(grown, 0, sizeof(shard_msg));
+            grown->type = SHARD_MSG_DELIVER;
+            grown->frame = frame;
+            frame->refcount++;
+        }
+        else {
+            memcpy(grown, *msg, sizeof(shard_msg) + (*msg)->count * sizeof(session *));
+            shard_msg_free(*msg);
+        }
+        grown->cap = new_cap;
+        *msg = grown;
+    }
+    (*msg)->sessions[(*msg)->count++] = target;
     return 0;
 }
 
-//handle(interprets) PUBISH packet
-int publish_handler(mqtt_pck *received_pck, session* running_sessions) {
-    //find the running session with matching conn_fd
-    session *current_session = NULL;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (running_sessions[i].conn_fd == received_pck->conn_fd) {
-            current_session = &running_sessions[i];
-            break;
+//collects a session matching a publish, once even if several filters overlap, keeping their highest granted QoS
+static void route_publish(void *subscriber, uint8_t qos, void *arg) {
+    publish_route *route = (publish_route *)arg;
+    session *subscribed_session = (session *)subscriber;
+    broker_ctx *broker = route->broker;
+
+    session_match *match = &subscribed_session->matches[broker->shard_id];
+    if (match->stamp == route->stamp) { //already collected through another matching filter
+        if (qos > match->qos) {
+            match->qos = qos;
+        }
+        return;
+    }
+
+    if (route->matched_count == broker->matched_cap) {
+        int new_cap = broker->matched_cap ? broker->matched_cap * 2 : 64;
+        session **grown = realloc(broker->matched, new_cap * sizeof(session *));
+        if (!grown) {
+            perror("Failed to grow matched sessions");
+            return;
+        }
+        broker->matched = grown;
+        uint32_t *grown_ids = realloc(broker->persist_ids, new_cap * sizeof(uint32_t));
+        if (!grown_ids) {
+            perror("Failed to grow matched sessions");
+            return;
+        }
+        broker->persist_ids = grown_ids;
+        broker->matched_cap = new_cap;
+    }
+    match->stamp = route->stamp;
+    match->qos = qos;
+    broker->matched[route->matched_count++] = subscribed_session;
+}
+
+//shuts down the connection of a subscriber over its limits (overflow-policy disconnect), the event loop closes it
+static void overflow_disconnect(session *target, broker_ctx *broker) {
+    connection *conn = broker->connections[target->conn_fd];
+    if (conn == NULL || conn->overflowed) {
+        return;
+    }
+    LOG_WARN("Slow subscriber over its limits || disconnecting Client_ID: %s || queued bytes: %zu", target->client_id, conn->tx_bytes + target->pending_bytes);
+    conn->overflowed = 1;
+    METRIC_INC(overflow_disconnects);
+    shutdown(target->conn_fd, SHUT_RDWR);
+}
+
+//fire and forget: a QoS 0 PUBLISH goes straight into the subscriber's outbound buffer, offline subscribers miss it
+static void publish_direct(pub_frame *frame, session *target, broker_ctx *broker) {
+    if (target->conn_fd == 0) {
+        return;
+    }
+    //output already queued is never taken back, so only the new message can give way (or the client, with disconnect)
+    connection *conn = broker->connections[target->conn_fd];
+    if (conn && (conn->overflowed || conn->tx_bytes + frame->len > broker->config.max_queued_bytes)) {
+        if (broker->config.overflow_policy == OVERFLOW_DISCONNECT) {
+            overflow_disconnect(target, broker);
+        }
+        else {
+            METRIC_INC(overflow_newest);
+        }
+        METRIC_INC(publish_dropped);
+        return;
+    }
+    METRIC_INC(publish_direct);
+    if (send_frame(target->conn_fd, frame, 0, 0, broker) < 0) {
+        LOG_ERROR("FOWARD FAILURE");
+    }
+}
+
+//delivers a frame to a session owned by this shard, QoS 1 frames through its in-flight window
+static void deliver_publish(pub_frame *frame, session *target, broker_ctx *broker) {
+    if (frame->qos == 0) {
+        publish_direct(frame, target, broker);
+        return;
+    }
+    queue_publish(frame, target, broker);
+}
+
+//matches a publish against the subscription index and delivers it to every subscriber, local ones directly
+static void publish_route_run(publish_route *route) {
+    broker_ctx *broker = route->broker;
+    broker_shared *shared = broker->shared;
+
+    //no lock: writers retire what this walk may still be reading instead of freeing it, queues and sockets are touched after it
+    epoch_enter(&shared->subscription_epochs, &broker->epoch);
+    topic_tree_match_levels(&shared->subscriptions, route->topic, route->levels, route_publish, route);
+    epoch_exit(&broker->epoch);
+
+    int persisted = 0; //QoS 1 deliveries, logged as one record together with the frame
+    for (int i = 0; i < route->matched_count; i++) {
+        session *subscribed_session = broker->matched[i];
+
+        //delivered with the lower of the publish QoS and the granted QoS
+        uint8_t qos = subscribed_session->matches[broker->shard_id].qos;
+        if (qos > route->qos) {
+            qos = route->qos;
+        }
+        if (route->frame[qos] == NULL) {
+            route->frame[qos] = pub_frame_encode(route->received_pck, qos);
+            if (route->frame[qos] == NULL) {
+                continue;
+            }
+            if (qos > 0) {
+                route->frame[qos]->log_id = persist_next_id(&broker->log); //0 without persistence
+            }
+        }
+        if (qos > 0 && route->frame[qos]->log_id) {
+            broker->persist_ids[persisted++] = subscribed_session->id;
+        }
+
+        //sessions of other shards are delivered by their owner
+        int owner = atomic_load_explicit(&subscribed_session->shard, memory_order_acquire);
+        if (owner != broker->shard_id) {
+            remote_add(&route->remote[qos][owner], route->frame[qos], subscribed_session);
+            continue;
+        }
+        LOG_DEBUG("Delivering message to Client_ID '%s' || conn_fd %d || Subscribed to topic '%.*s' || QoS %d", subscribed_session->client_id, subscribed_session->conn_fd, (int)route->received_pck->topic_len, route->topic, qos);
+        deliver_publish(route->frame[qos], subscribed_session, broker);
+    }
+
+    if (persisted > 0) {
+        pub_frame *frame = route->frame[QOS];
+        persist_message(&broker->log, frame->log_id, broker->persist_ids, persisted, frame->data, frame->len);
+    }
+
+    //one message per shard and QoS with subscribers, drained by that shard in a batch
+    for (int qos = 0; qos <= QOS; qos++) {
+        for (int shard = 0; shard < shared->shard_count; shard++) {
+            if (route->remote[qos][shard]) {
+                shard_queue_push(&shared->shards[shard]->inbox, &route->remote[qos][shard]->node);
+            }
+        }
+        pub_frame_release(route->frame[qos]); //queue slots, output queues and shard messages hold their own references
+    }
+}
+
+//hands a session over to the shard whose connection sent CONNECT for it (running on the owner)
+static void session_give_up(shard_msg *msg, broker_ctx *broker) {
+    session *current_session = msg->session;
+
+    //request looped back to a shard that already bound the session to that very connection
+    if (msg->shard == broker->shard_id && current_session->conn_fd == msg->conn_fd) {
+        shard_msg_free(msg);
+        return;
+    }
+
+    //the client goes offline here, the new owner counts it connected again
+    if (current_session->conn_fd != 0) {
+        LOG_INFO("Session of Client_ID: %s taken over by shard %d || closing conn_fd: %d", current_session->client_id, msg->shard, current_session->conn_fd);
+        connection *old_conn = broker->connections[current_session->conn_fd];
+        if (old_conn && old_conn->session == current_session) {
+            old_conn->session = NULL;
+            shutdown(current_session->conn_fd, SHUT_RDWR); //event loop closes it
+        }
+        stop_retransmit(current_session, broker); //timers live in this shard's wheel
+        current_session->conn_fd = 0;
+        METRIC_DEC(clients_connected);
+    }
+
+    //from here on only the new owner touches the session
+    atomic_store_explicit(&current_session->shard, msg->shard, memory_order_release);
+    msg->type = SHARD_MSG_ADOPT;
+    shard_queue_push(&broker->shared->shards[msg->shard]->inbox, &msg->node);
+}
+
+//handles messages other shards pushed into this shard's inbox, except ADOPT which the event loop completes
+void shard_handle_message(shard_msg *msg, broker_ctx *broker) {
+    broker_shared *shared = broker->shared;
+
+    if (msg->type == SHARD_MSG_TAKEOVER) {
+        int owner = atomic_load_explicit(&msg->session->shard, memory_order_acquire);
+        if (owner != broker->shard_id) { //moved on since the request was sent, follow it
+            shard_queue_push(&shared->shards[owner]->inbox, &msg->node);
+            return;
+        }
+        session_give_up(msg, broker);
+        return;
+    }
+
+    //DELIVER: sessions that moved away meanwhile are forwarded one by one to their new owner
+    for (int i = 0; i < msg->count; i++) {
+        session *target = msg->sessions[i];
+        int owner = atomic_load_explicit(&target->shard, memory_order_acquire);
+        if (owner == broker->shard_id) {
+            deliver_publish(msg->frame, target, broker);
+            continue;
+        }
+        shard_msg *forward = NULL;
+        if (remote_add(&forward, msg->frame, target) == 0) {
+            shard_queue_push(&shared->shards[owner]->inbox, &forward->node);
+        }
+    }
+    pub_frame_release(msg->frame);
+    shard_msg_free(msg);
+}
+
+//routes a message originated by the broker itself (e.g. $SYS metrics) to its subscribers
+int broker_publish(broker_ctx *broker, const char *topic, const uint8_t *payload, size_t payload_len) {
+    size_t topic_len = strlen(topic);
+
+    //same layout as a received PUBLISH, so routing and frame encoding are shared
+    uint8_t variable_header[2 + topic_len + 2];
+    variable_header[0] = (topic_len >> 8) & 0xFF;
+    variable_header[1] = topic_len & 0xFF;
+    memcpy(variable_header + 2, topic, topic_len);
+    variable_header[2 + topic_len] = 0; //packet ID placeholder, patched per recipient
+    variable_header[3 + topic_len] = 0;
+
+    mqtt_pck message = {0};
+    message.pck_type = 3;
+    message.flag = QOS << 1;
+    message.topic_len = topic_len;
+    message.variable_len = sizeof(variable_header);
+    message.variable_header = variable_header;
+    message.payload_len = payload_len;
+    message.payload = (uint8_t *)payload;
+    message.remaining_len = message.variable_len + payload_len;
+
+    uint16_t ends[topic_len + 1];
+    topic_levels levels = {ends};
+    topic_scan(topic, topic_len, &levels);
+    publish_route route = {.received_pck = &message, .topic = topic, .levels = &levels, .qos = QOS, .stamp = ++broker->match_stamp, .broker = broker};
+    publish_route_run(&route);
+    return 0;
+}
+
+//whether a QoS 1 packet ID from the client is still outstanding, received and its PUBACK not written yet
+static int inbound_id_seen(session *current_session, uint16_t pck_id) {
+    return current_session->inbound_ids && (current_session->inbound_ids[pck_id >> 6] >> (pck_id & 63)) & 1;
+}
+
+//records a received QoS 1 packet ID until its PUBACK is written
+static int inbound_id_mark(session *current_session, uint16_t pck_id) {
+    if (current_session->inbound_ids == NULL) {
+        current_session->inbound_ids = calloc(PCK_ID_WORDS, sizeof(uint64_t));
+        if (current_session->inbound_ids == NULL) {
+            perror("Failed to allocate packet ID map");
+            return -1;
+        }
+    }
+    current_session->inbound_ids[pck_id >> 6] |= (uint64_t)1 << (pck_id & 63);
+    return 0;
+}
+
+//frees a packet ID once its PUBACK is written, a PUBLISH reusing it from then on is a new message
+static void inbound_id_release(session *current_session, uint16_t pck_id) {
+    current_session->inbound_ids[pck_id >> 6] &= ~((uint64_t)1 << (pck_id & 63));
+}
+
+//remembers where the PUBACK just queued for pck_id ends in the connection's output, its ID is freed once that is written
+static void inbound_ack_queued(session *current_session, uint16_t pck_id, broker_ctx *broker) {
+    connection *conn = broker->connections[current_session->conn_fd];
+    if (conn->ack_count == conn->ack_cap) {
+        uint32_t new_cap = conn->ack_cap ? conn->ack_cap * 2 : 16;
+        inbound_ack *acks = malloc(new_cap * sizeof(inbound_ack));
+        if (!acks) {
+            perror("Failed to grow PUBACK list");
+            inbound_id_release(current_session, pck_id); //freed right away, a retransmission then counts as new
+            return;
         }
+        for (uint32_t i = 0; i < conn->ack_count; i++) { //unwrap the ring into the new array
+            acks[i] = conn->acks[(conn->ack_head + i) % conn->ack_cap];
+        }
+        free(conn->acks);
+        conn->acks = acks;
+        conn->ack_cap = new_cap;
+        conn->ack_head = 0;
     }
+    inbound_ack *ack = &conn->acks[(conn->ack_head + conn->ack_count) % conn->ack_cap];
+    ack->end = conn->tx_written + conn->tx_bytes;
+    ack->pck_id = pck_id;
+    conn->ack_count++;
+}
+
+//frees the packet IDs whose PUBACK the socket took, called as queued output is written
+void inbound_acks_written(connection *conn) {
+    //a connection whose session was taken over no longer speaks for its IDs, the new one started them over
+    session *current_session = conn->session;
+    int owner = current_session && current_session->conn_fd == conn->conn_fd;
+    while (conn->ack_count > 0 && conn->acks[conn->ack_head].end <= conn->tx_written) {
+        if (owner) {
+            inbound_id_release(current_session, conn->acks[conn->ack_head].pck_id);
+        }
+        conn->ack_head = (conn->ack_head + 1) % conn->ack_cap;
+        conn->ack_count--;
+    }
+}
+
+//forgets every outstanding packet ID of a session whose connection closes, the client resends them as new messages
+void inbound_ids_clear(session *current_session) {
+    if (current_session->inbound_ids) {
+        memset(current_session->inbound_ids, 0, PCK_ID_WORDS * sizeof(uint64_t));
+    }
+}
+
+//handle(interprets) PUBISH packet
+int publish_handler(mqtt_pck *received_pck, broker_ctx *broker) {
+    //find the running session bound to this connection
+    session *current_session = find_session(broker, received_pck->conn_fd);
     if (current_session == NULL) {
-        printf("Session not found for conn_fd: %d\n", received_pck->conn_fd);
+        LOG_WARN("Session not found for conn_fd: %d", received_pck->conn_fd);
         return -1;
     }
 
     int Retain = received_pck->flag & 0x01;
-    if (Retain != 0) {
-        printf("Invalid Retain\n");
-    }
     int QOS_lvl = (received_pck->flag >> 1) & 0x03;
-    if (QOS_lvl != 1) {
-        printf("Invalid QOS level\n");
+    if (QOS_lvl == 3) {
+        LOG_WARN("Invalid QOS level");
+        return MQTT_PCK_CLOSE; //malformed, the connection must be closed
+    }
+    if (QOS_lvl > QOS) {
+        LOG_WARN("QOS level %d not supported || handled as QoS %d", QOS_lvl, QOS);
+        QOS_lvl = QOS;
     }
 
     //check if its first time the client sent the message
     int DUP = (received_pck->flag >> 3) & 0x01;
 
-    char topic[received_pck->topic_len + 1];
-
-    memcpy(topic, received_pck->variable_header + 2, received_pck->topic_len);
-    topic[received_pck->topic_len] = '\0';
+    //one pass checks the name and finds its levels for the router: a topic name is UTF-8 without U+0000 and
+    //wildcards and at least one character long, anything else is a protocol violation that closes the connection
+    const char *topic = (const char *)received_pck->variable_header + 2;
+    int topic_len = received_pck->topic_len;
+    topic_levels levels = {arena_alloc(&broker->arena, (topic_len + 1) * sizeof(uint16_t))};
+    if (levels.ends == NULL) {
+        return -1;
+    }
+    if (topic_len == 0 || topic_scan(topic, topic_len, &levels) < 0 || levels.wildcards > 0) {
+        LOG_WARN("Invalid topic name in PUBLISH || conn_fd: %d", received_pck->conn_fd);
+        return MQTT_PCK_CLOSE;
+    }
+    LOG_DEBUG("Topic: %.*s", topic_len, topic);
 
-    printf("Topic: %s\n", topic);
+    //QoS 0 has no packet ID and no PUBACK, the message is routed and forgotten
+    if (QOS_lvl == 0) {
+        if (Retain) {
+            retained_update(broker, received_pck, 0);
+        }
+        publish_route route = {.received_pck = received_pck, .topic = topic, .levels = &levels, .qos = 0, .stamp = ++broker->match_stamp, .broker = broker};
+        publish_route_run(&route);
+        return 0;
+    }
 
     int pck_id_offset = 2 + received_pck->topic_len; //where the pck_id starts, duo to variable topic length
     received_pck->pck_id = (received_pck->variable_header[pck_id_offset] << 8) |
                  received_pck->variable_header[pck_id_offset + 1];
     
-    printf("DUP: %d || Topic: '%s' || pck_id: %d\n", DUP, topic, received_pck->pck_id);
-
-    // verify it wasn't received before
-    if (received_pck->pck_id != current_session->last_pck_received_id) {
-        printf("New message to publish\n");
-        current_session->last_pck_received_id = received_pck->pck_id;
-
-        //Find clients that are subscribed and save message to queue
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (running_sessions[i].client_id != NULL) {
-                for (int j = 0; j < MAX_TOPICS; j++) {
-                    if (strcmp(running_sessions[i].topic[j], topic) == 0) { //comparing topics
-                        printf("Queuing message to Client_ID '%s' || conn_fd %d || Subscribed to topic '%s' || ", running_sessions[i].client_id, running_sessions[i].conn_fd, topic);
-                        queue_publish(received_pck, &running_sessions[i]);
-                    }
-                }
-            }
-        }
-    } 
-    else {
-        printf("Duplicated message\n");
-        return 0;
+    LOG_DEBUG("DUP: %d || Topic: '%.*s' || pck_id: %d", DUP, topic_len, topic, received_pck->pck_id);
+
+    // verify it wasn't received before: a first attempt (DUP clear) is always new, even with an ID used before
+    if (inbound_id_seen(current_session, received_pck->pck_id) && DUP) {
+        LOG_DEBUG("Duplicated message || pck_id: %d", received_pck->pck_id);
+        return send_puback(current_session, received_pck->pck_id, broker); //the ID is freed with the first PUBACK
+    }
+    if (inbound_id_mark(current_session, received_pck->pck_id) < 0) {
+        return -1;
+    }
+
+    LOG_DEBUG("New message to publish");
+    if (Retain) { //current subscribers get it below as a normal message, with RETAIN clear
+        retained_update(broker, received_pck, QOS_lvl);
     }
-    return send_puback(current_session, received_pck->pck_id); //not entire received_pck necessary for acknowledgment, only packet id
+
+    //Find clients that are subscribed and save message to queue
+    publish_route route = {.received_pck = received_pck, .topic = topic, .levels = &levels, .qos = QOS_lvl, .stamp = ++broker->match_stamp, .broker = broker};
+    publish_route_run(&route);
+    if (send_puback(current_session, received_pck->pck_id, broker) < 0) { //not entire received_pck necessary for acknowledgment, only packet id
+        return -1; //ID stays outstanding, a retransmission is acknowledged without being routed again
+    }
+    inbound_ack_queued(current_session, received_pck->pck_id, broker);
+    return 0;
 }
 
-int send_puback(session* current_session, int pck_id){
-    printf("Sending PUBACK to conn_fd %d\n", current_session->conn_fd);
+int send_puback(session* current_session, int pck_id, broker_ctx *broker){
+    LOG_DEBUG("Sending PUBACK to conn_fd %d", current_session->conn_fd);
     mqtt_pck puback_packet;
+    uint8_t variable_header[2]; //copied into the output queue by send_pck
 
     //fixed Header
     puback_packet.flag = 0;
@@ -673,11 +1506,7 @@ int send_puback(session* current_session, int pck_id){
 
     //variable Header
     puback_packet.variable_len = 2;
-    puback_packet.variable_header = malloc(puback_packet.variable_len); //allocate 7 bytes (PUBLISH variable header)
-    if (!puback_packet.variable_header) {
-        perror("Failed to allocate memory for PUBACK variable header");
-        return -1;
-    }
+    puback_packet.variable_header = variable_header;
     puback_packet.variable_header[0] = (pck_id >> 8); // MSB of pck_id(shift right to eliminate LSB) 
     puback_packet.variable_header[1] = pck_id & 0xFF; // LSB of pck_id
 
@@ -687,109 +1516,252 @@ int send_puback(session* current_session, int pck_id){
 
     //conn_fd
     puback_packet.conn_fd = current_session->conn_fd;
-    if (send_pck(&puback_packet) < 0){
-        printf("Failed to send PUBACK\n");
-        free(puback_packet.variable_header);
-        free(puback_packet.payload);
+    if (send_pck(&puback_packet, broker) < 0){
+        LOG_ERROR("Failed to send PUBACK");
         return -1;
     }
-
-    //Clean up allocated memory
-    free(puback_packet.variable_header);
-    free(puback_packet.payload);
-    printf("PUBACK sent successfully\n");
+    LOG_DEBUG("PUBACK sent successfully");
     return 0;
 }
 
-int puback_handler(mqtt_pck *received_pck, session* running_sessions){
-    //find the running session with matching conn_fd
-    session *current_session = NULL;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (running_sessions[i].conn_fd == received_pck->conn_fd) {
-            current_session = &running_sessions[i];
-            break;
-        }
-    }
+int puback_handler(mqtt_pck *received_pck, broker_ctx *broker){
+    //find the running session bound to this connection
+    session *current_session = find_session(broker, received_pck->conn_fd);
     if (current_session == NULL) {
-        printf("Session not found for conn_fd: %d\n", received_pck->conn_fd);
+        LOG_WARN("Session not found for conn_fd: %d", received_pck->conn_fd);
         return -1;
     }
 
     //extract packet id, to find which publish message is this acknowledge refering to
     int puback_pck_id = (received_pck->variable_header[0] << 8) | received_pck->variable_header[1]; //MSB (shift left) and LSB convertion
 
-    for (int i=0; i < MAX_PUB_QUEUE_SIZE; i++){ //for each queue slot   
-        if (current_session->pck_to_send[i].pck_type == 0){ //if slot empty, continue
+    //packet IDs are assigned by the broker, so the ID picks the window slot directly
+    mqtt_pck *packet = current_session->inflight ? &current_session->inflight[puback_pck_id & (broker->config.max_inflight - 1)] : NULL;
+    if (packet == NULL || packet->pck_type == 0 || packet->pck_id != puback_pck_id) {
+        LOG_WARN("ERROR-NO QUEUE FOUND");
+        return -1;
+    }
+    LOG_DEBUG("Clearing In-flight Slot: %d", puback_pck_id & (broker->config.max_inflight - 1));
+    timer_wheel_cancel(&broker->timers, &packet->retransmit_timer);
+    if (packet->frame->log_id) {
+        persist_ack(&broker->log, current_session->id, packet->frame->log_id);
+    }
+    pub_frame_release(packet->frame);
+    memset(packet, 0, sizeof(mqtt_pck)); //clear slot
+    current_session->inflight_count--;
+    METRIC_DEC(inflight);
+
+    //window has room again, move the oldest waiting message in
+    drain_pending(current_session, broker);
+    return 0;
+}
+
+
+//fires when a forwarded PUBLISH got no PUBACK in time, sends it again with DUP set
+static void retransmit_publish(timer_wheel *wheel, timer_entry *timer, void *arg) {
+    session *current_session = (session *)arg;
+    broker_ctx *broker = (broker_ctx *)((char *)wheel - offsetof(broker_ctx, timers)); //wheel is embedded in the broker
+    mqtt_pck *packet = (mqtt_pck *)((char *)timer - offsetof(mqtt_pck, retransmit_timer));
+
+    if (current_session->conn_fd == 0) { //client offline, resent when it reconnects
+        return;
+    }
+    packet->conn_fd = current_session->conn_fd; //in case the reconection got a diferent conn_fd, make sure packet has correct new conn_fd
+    packet->flag |= 0x08; //DUP, this is a redelivery
+    METRIC_INC(retransmits);
+
+    LOG_DEBUG("RETRANSMISSIONING->PUBLISH to Client_ID: '%s' || conn_fd: %d || Packet ID: %d", current_session->client_id, current_session->conn_fd, packet->pck_id);
+    if (send_frame(packet->conn_fd, packet->frame, packet->flag, packet->pck_id, broker) < 0) {
+        LOG_ERROR("RETRANSMISSIONING FAILURE");
+    }
+    timer_wheel_add(wheel, timer, wheel->now + broker->config.retransmit_ms);
+}
+
+//sends again every unacknowledged PUBLISH of a session, used when its client reconnects
+void resend_inflight(session *current_session, broker_ctx *broker) {
+    if (current_session->inflight == NULL) {
+        return;
+    }
+    //IDs are handed out in increasing order, so starting after the newest slot walks the window oldest first
+    for (int i = 0; i < broker->config.max_inflight; i++) {
+        mqtt_pck *packet = &current_session->inflight[(current_session->next_pck_id + i) & (broker->config.max_inflight - 1)];
+        if (packet->pck_type == 0) {
             continue;
         }
-        else if (current_session->pck_to_send[i].pck_id == puback_pck_id){ //slot has message and pck_id equal to the acknowledge
-            printf("Clearing Queue Slot: %d\n", i);
-            memset(&current_session->pck_to_send[i], 0, sizeof(mqtt_pck)); //clear slot
-            return 0;
+        packet->conn_fd = current_session->conn_fd;
+        if (packet->retransmit_timer.callback != NULL) { //sent before, this is a redelivery
+            packet->flag |= 0x08;
+        }
+        else {
+            timer_init(&packet->retransmit_timer, retransmit_publish, current_session);
+        }
+        LOG_DEBUG("RESENDING->PUBLISH to Client_ID: '%s' || conn_fd: %d || Packet ID: %d", current_session->client_id, current_session->conn_fd, packet->pck_id);
+        if (send_frame(packet->conn_fd, packet->frame, packet->flag, packet->pck_id, broker) < 0) {
+            LOG_ERROR("RESEND FAILURE");
+        }
+        timer_wheel_add(&broker->timers, &packet->retransmit_timer, monotonic_ms() + broker->config.retransmit_ms);
+    }
+}
+
+//disarms the retransmission timers of a session whose client went offline
+void stop_retransmit(session *current_session, broker_ctx *broker) {
+    if (current_session->inflight == NULL) {
+        return;
+    }
+    for (int i = 0; i < broker->config.max_inflight; i++) {
+        timer_wheel_cancel(&broker->timers, &current_session->inflight[i].retransmit_timer);
+    }
+}
+
+//hands out the next free packet ID of a session, -1 when every slot of the window is taken
+static int next_pck_id(session *current_session, broker_ctx *broker) {
+    for (int tries = 0; tries <= UINT16_MAX; tries++) { //every slot is reached within the ID space
+        uint16_t pck_id = current_session->next_pck_id++;
+        if (pck_id == 0) { //0 isn't a valid packet ID
+            continue;
+        }
+        if (current_session->inflight[pck_id & (broker->config.max_inflight - 1)].pck_type == 0) { //skip slots still waiting for an older PUBACK
+            return pck_id;
         }
     }
-    printf("ERROR-NO QUEUE FOUND\n");
     return -1;
 }
 
+//puts a frame into the in-flight window (taking over the caller's reference) and sends it if the client is online
+static void inflight_send(session *running_session, pub_frame *frame, broker_ctx *broker) {
+    int pck_id = next_pck_id(running_session, broker);
+    if (pck_id < 0) { //callers check the window has room, this only guards against a broken count
+        LOG_ERROR("No free packet ID || Client_ID: '%s' || message dropped", running_session->client_id);
+        METRIC_INC(publish_dropped);
+        if (frame->log_id) {
+            persist_ack(&broker->log, running_session->id, frame->log_id);
+        }
+        pub_frame_release(frame);
+        return;
+    }
+    mqtt_pck *packet = &running_session->inflight[pck_id & (broker->config.max_inflight - 1)];
+    memset(packet, 0, sizeof(mqtt_pck));
+    packet->pck_type = 3;
+    packet->flag = (QOS << 1) | (frame->data[0] & 0x01); //first delivery to this client, DUP clear, RETAIN only on retained store frames
+    packet->pck_id = pck_id;
+    packet->frame = frame;
+    packet->conn_fd = running_session->conn_fd; //destination of packet associated with found subscribed client's session
+    running_session->inflight_count++;
+    METRIC_INC(inflight);
+
+    LOG_DEBUG("In-flight Packet ID: %d", pck_id);
+    if (running_session->conn_fd == 0) { //client offline, sent when it reconnects
+        LOG_DEBUG("Client offline || PUBLISH kept in queue");
+        return;
+    }
+    timer_init(&packet->retransmit_timer, retransmit_publish, running_session);
 
-int queue_publish(mqtt_pck *received_pck, session* running_session) {
-    //find an available slot in the publish queue
-    for (int i = 0; i < MAX_PUB_QUEUE_SIZE; i++) {
-        if (running_session->pck_to_send[i].pck_type == 0) {  //if slot is empty save the publish into the queue
-            running_session->pck_to_send[i] = *received_pck; //associate pending message with destination client's session
-            running_session->pck_to_send[i].conn_fd = running_session->conn_fd; //destination of packet associated with found subscribed client's session
+    LOG_DEBUG("FOWARDING PUBLISH to Client");
+    if (send_frame(packet->conn_fd, packet->frame, packet->flag, packet->pck_id, broker) < 0) {  //first attempt to send the message; retransmission timer resends if not sucessfull
+        LOG_ERROR("FOWARD FAILURE");
+    }
+    timer_wheel_add(&broker->timers, &packet->retransmit_timer, monotonic_ms() + broker->config.retransmit_ms);
+}
 
-            printf("Queue Slot: %d\n", i);
+//moves waiting messages into the in-flight window while it has room
+void drain_pending(session *current_session, broker_ctx *broker) {
+    while (current_session->pending_count > 0 && current_session->inflight_count < broker->config.max_inflight) {
+        pub_frame *frame = current_session->pending[current_session->pending_head];
+        current_session->pending_head = (current_session->pending_head + 1) % current_session->pending_cap;
+        current_session->pending_count--;
+        current_session->pending_bytes -= frame->len;
+        METRIC_DEC(pending);
+        inflight_send(current_session, frame, broker);
+    }
+}
 
-            printf("FOWARDING PUBLISH to Client\n");
-            if (send_pck(&running_session->pck_to_send[i]) < 0) {  //first attempt to send the message; queue thread will resend if not sucessfull
-                printf("FOWARD FAILURE\n");
-            }
-            running_session->pck_to_send[i].first_forward = 1;
-            return 0;
+//checks one more frame against a session's limits: waiting messages, and their bytes plus output not yet written
+static int pending_fits(session *running_session, size_t len, broker_ctx *broker) {
+    size_t queued_bytes = running_session->pending_bytes + len;
+    if (running_session->conn_fd != 0) {
+        connection *conn = broker->connections[running_session->conn_fd];
+        if (conn && !conn->overflowed) { //a disconnected client's output is discarded anyway
+            queued_bytes += conn->tx_bytes;
         }
     }
-    //if Queue is full
-    printf("Queue ERROR-FULL\n");
-    return -1;
+    return running_session->pending_count < (uint32_t)broker->config.max_pending && queued_bytes <= broker->config.max_queued_bytes;
 }
 
-//queue loop function, 1 for all threads, responsible for fowarding PUBLISH messages
-void *queue_handler(void *arg) {
-    printf("Queue Handling Thread created\n");
-    thread_data *t_data = (thread_data *)arg;             //cast to thread data type again
-    session *running_sessions = t_data->running_sessions; //only running_sessions data is required
-    free(t_data); //no longer needed, free
-
-    double elapsed_time; //to know time between retransmissions
-    clock_t time_now;
-    //Search for unsent queues
-    while (1) {
-        time_now = clock();
-        for (int i=0; i < MAX_CLIENTS; i++){ //for each possible session
-            for (int j=0; j < MAX_PUB_QUEUE_SIZE; j++){ //for each queue slot
-                if (running_sessions[i].pck_to_send[j].first_forward == 0 ){ //if message hasn't been sent first
-                    continue;
-                }
-                else{ //slot has message
-                    if (running_sessions[i].conn_fd != 0){ //if client is connected
-                        running_sessions[i].pck_to_send[j].conn_fd = running_sessions[i].conn_fd; //in case the reconection got a diferent conn_fd, make sure packet has correct new conn_fd
-
-                        elapsed_time = (double)(time_now - running_sessions[i].pck_to_send[j].time_sent) / CLOCKS_PER_SEC;
-                        if (elapsed_time > TIME_TO_RETRANSMIT){ //if retransmition time has passed
-                            printf("RETRANSMISSIONING->PUBLISH to Client_ID: '%s' || conn_fd: %d || Queue Slot: %d\n", running_sessions[i].client_id, running_sessions[i].conn_fd, j);
-                            if (send_pck(&running_sessions[i].pck_to_send[j]) < 0) {  //send the message
-                                printf("RETRANSMISSIONING FAILURE\n");
-                                continue;
-                            }
-                            running_sessions[i].pck_to_send[j].time_sent = time_now;
-                        }
-                    }
-                }
+//drops the oldest waiting message of a session (overflow-policy drop-oldest)
+static void pending_drop_oldest(session *running_session, broker_ctx *broker) {
+    pub_frame *frame = running_session->pending[running_session->pending_head];
+    running_session->pending_head = (running_session->pending_head + 1) % running_session->pending_cap;
+    running_session->pending_count--;
+    running_session->pending_bytes -= frame->len;
+    METRIC_DEC(pending);
+    METRIC_INC(overflow_oldest);
+    METRIC_INC(publish_dropped);
+    if (frame->log_id) { //not to be replayed either
+        persist_ack(&broker->log, running_session->id, frame->log_id);
+    }
+    pub_frame_release(frame);
+}
+
+//queues a forwarded PUBLISH for a client, straight into the in-flight window when it has room
+int queue_publish(pub_frame *frame, session* running_session, broker_ctx *broker) {
+    if (running_session->inflight == NULL) {
+        running_session->inflight = calloc(broker->config.max_inflight, sizeof(mqtt_pck));
+        if (running_session->inflight == NULL) {
+            perror("Failed to allocate in-flight window");
+            return -1;
+        }
+        running_session->next_pck_id = 1;
+    }
+
+    //keep arrival order, nothing overtakes messages already waiting
+    if (running_session->pending_count == 0 && running_session->inflight_count < broker->config.max_inflight) {
+        frame->refcount++;
+        METRIC_INC(publish_enqueued);
+        inflight_send(running_session, frame, broker);
+        return 0;
+    }
+
+    //a subscriber that can't keep up only costs itself, overflow-policy decides what gives way
+    if (!pending_fits(running_session, frame->len, broker)) {
+        if (broker->config.overflow_policy == OVERFLOW_DROP_OLDEST) {
+            while (running_session->pending_count > 0 && !pending_fits(running_session, frame->len, broker)) {
+                pending_drop_oldest(running_session, broker);
             }
         }
-        usleep(10); ////to not overload CPU
+        else if (broker->config.overflow_policy == OVERFLOW_DISCONNECT && running_session->conn_fd != 0) {
+            overflow_disconnect(running_session, broker); //the session keeps what fits, the client gets it after reconnecting
+        }
+    }
+    if (!pending_fits(running_session, frame->len, broker)) {
+        LOG_WARN("Queue ERROR-FULL");
+        METRIC_INC(publish_dropped);
+        METRIC_INC(overflow_newest);
+        if (frame->log_id) { //not to be replayed either
+            persist_ack(&broker->log, running_session->id, frame->log_id);
+        }
+        return -1;
     }
-    return NULL;
-}
\ No newline at end of file
+    if (running_session->pending_count == running_session->pending_cap) {
+        uint32_t new_cap = running_session->pending_cap ? running_session->pending_cap * 2 : 64;
+        pub_frame **pending = malloc(new_cap * sizeof(pub_frame *));
+        if (!pending) {
+            perror("Failed to grow pending queue");
+            return -1;
+        }
+        for (uint32_t i = 0; i < running_session->pending_count; i++) { //unwrap the ring into the new array
+            pending[i] = running_session->pending[(running_session->pending_head + i) % running_session->pending_cap];
+        }
+        free(running_session->pending);
+        running_session->pending = pending;
+        running_session->pending_cap = new_cap;
+        running_session->pending_head = 0;
+    }
+    running_session->pending[(running_session->pending_head + running_session->pending_count) % running_session->pending_cap] = frame;
+    running_session->pending_count++;
+    running_session->pending_bytes += frame->len;
+    frame->refcount++;
+    METRIC_INC(publish_enqueued);
+    METRIC_INC(pending);
+    LOG_DEBUG("In-flight window full || PUBLISH pending: %u", running_session->pending_count);
+    return 0;
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE //accept4, SOCK_NONBLOCK
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,6 +10,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <errno.h>
@@ -15,21 +18,104 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <time.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <linux/errqueue.h>
+#include <sys/resource.h>
+
+#include "epoch.h"
+#include "topic_scan.h"
+#include "topic_tree.h"
+#include "session_table.h"
+#include "timer_wheel.h"
+#include "config.h"
+#include "log.h"
+#include "metrics.h"
+#include "shard_queue.h"
+#include "persist.h"
+#include "pool.h"
+#include "uring.h"
 
 #ifndef _ARPA_INET_H_
 #define _ARPA_INET_H_
 
 #endif
 //=============================================================//
-//most of the limitations to our simplified MQTT broker are from the limits here, which could be dynamic but would take more work and memory allocation
+//most of the limitations to our simplified MQTT broker are from the limits here
+//they are the defaults of broker_config, flags and config files override them at startup (see config.h)
 #define BROKER_PORT 1883
 #define MAX_CLIENTS 10
-#define MAX_TOPICS 5
-#define MAX_PUB_QUEUE_SIZE 10 
-#define TIME_TO_RETRANSMIT 5.0   //time in seconds before retransmission is tried, in case PUBLISH doesnt receive PUBACK
-#define QOS 1
+#define MAX_TOPICS 5             //subscriptions per client
+#define MAX_INFLIGHT 64          //unacknowledged PUBLISH per client, power of two (packet ID & (MAX_INFLIGHT-1) is the window slot)
+#define MAX_PENDING 100000       //PUBLISH waiting per client behind a full in-flight window, more overflow
+#define MAX_QUEUED_BYTES (16 * 1024 * 1024) //waiting PUBLISH plus unwritten output per client, more overflow
+#define OVERFLOW_DROP_NEWEST 0   //overflow policies: the message that doesn't fit is dropped
+#define OVERFLOW_DROP_OLDEST 1   //the oldest waiting QoS 1 messages make room, output already queued stays
+#define OVERFLOW_DISCONNECT 2    //the client is disconnected, its session keeps the waiting messages
+#define OVERFLOW_POLICY OVERFLOW_DROP_NEWEST
+#define TIME_TO_RETRANSMIT 5000  //time in ms before retransmission is tried, in case PUBLISH doesnt receive PUBACK
+#define CONNECT_TIMEOUT 10000    //time in ms a new connection has to send CONNECT before it is closed
+#define KEEPALIVE_GRACE(seconds) ((uint64_t)(seconds) * 1500) //silence in ms tolerated for a keepalive, 1.5 times the interval
+#define QOS 1                    //highest QoS delivered, subscriptions asking for more are granted this
+
+#define BUFFER_SIZE 1024         //initial receive buffer per connection, grows for larger packets
+#define MAX_PACKET_SIZE (1024 * 1024) //largest accepted packet (fixed header included), bigger ones close the connection
+#define LISTEN_BACKLOG 1024      //pending connections the kernel holds before accept
+#define MAX_EVENTS 256           //epoll events handled per event loop iteration
+#define IO_BACKEND_EPOLL 0       //I/O backends: readiness with epoll, then read and writev per connection
+#define IO_BACKEND_URING 1       //completions with io_uring, multishot accept and recv, sends batched per iteration
+#define IO_BACKEND IO_BACKEND_EPOLL
+#define SYS_INTERVAL 10          //seconds between $SYS/broker metric publications
+#define THREADS 1                //event loop shards, one per core scales publish throughput
+#define MAX_SHARDS 64            //upper bound of the threads option
+#define PERSIST_SEGMENT_MB 64     //size of a persistence log segment, a full one is sealed and later compacted
+#define RETAINED_BATCH 256       //retained messages replayed per subscribing connection and event loop iteration
+#define SESSION_CHUNK 256        //sessions allocated together, chunks never move so session pointers stay valid
+#define PCK_ID_WORDS (65536 / 64) //words of a bitmap with one bit per packet ID
+#ifndef ZEROCOPY_THRESHOLD
+#define ZEROCOPY_THRESHOLD 0     //payload bytes from which PUBLISH frames are sent with MSG_ZEROCOPY, 0 disables (worth it from ~10KB)
+#endif
+
+#define MQTT_PCK_CLOSE 1         //returned by a handler when the connection must be closed
+#define MQTT_PCK_DEFER 2         //CONNECT waits for its session to arrive from another shard, later packets stay buffered
+
+//PUBLISH wire frame, encoded once per incoming message and shared by every subscriber queue
+typedef struct {
+    _Atomic int refcount;          //queue slots holding the frame (on any shard), freed when it drops to 0
+    size_t len;                    //whole frame length
+    size_t pck_id_offset;          //where the packet ID sits, patched per recipient when sending (end of topic for QoS 0)
+    uint8_t qos;                   //delivery QoS, QoS 0 frames have no packet ID and are never queued
+    uint64_t log_id;               //message ID in the persistence log, 0 when not logged
+    uint8_t data[];                //fixed header, topic, packet ID placeholder, payload
+} pub_frame;
+
+//last PUBLISH sent with RETAIN on a topic, the entry of its name in the retained tree (whose QoS is the publish QoS)
+typedef struct {
+    pub_frame *frame[QOS + 1];     //RETAIN set, one per delivery QoS up to the publish QoS
+} retained_msg;
 
-#define BUFFER_SIZE 1024
+//PUBLISH sent with MSG_ZEROCOPY, kept until the kernel reports it no longer reads the buffers
+typedef struct zerocopy_pending {
+    struct zerocopy_pending *next;
+    uint32_t seq;                  //completion sequence number of the send on its socket
+    pub_frame *frame;              //reference held until completion
+    uint8_t header[3];             //first byte and packet ID, must stay valid as long as the frame
+} zerocopy_pending;
+
+//PUBACK in a connection's outbound queue, its packet ID stays outstanding until the socket took it
+typedef struct {
+    uint64_t end;                  //tx_written once the PUBACK's last byte is written
+    uint16_t pck_id;
+} inbound_ack;
+
+//one piece of queued output, bytes copied into the connection's tx_buf or a range of a shared frame
+typedef struct {
+    pub_frame *frame;              //NULL when the bytes live in tx_buf
+    size_t offset;
+    size_t len;
+} tx_segment;
 
 //packet structure
 typedef struct {
@@ -51,27 +137,197 @@ typedef struct {
 
     int pck_id;       //if present, represents the packet id
 
-    int first_forward; //used to know if the message was tried to send once before
-    clock_t time_sent; //used to know when to resend publish packet
+    pub_frame *frame;             //encoded PUBLISH shared with other subscribers, only for queued packets
+    timer_entry retransmit_timer; //armed while a forwarded PUBLISH waits for its PUBACK
 
 } mqtt_pck;
 
+//last publish a shard matched against a session, so overlapping filters deliver once
+typedef struct {
+    unsigned int stamp;            //match_stamp of that publish
+    uint8_t qos;                   //highest granted QoS among the filters it matched
+} session_match;
+
 //session required arguments to save
 typedef struct {
+    uint32_t id;                   //index in the session registry, names the session in the persistence log
     int conn_fd;                   //connection file descriptor
-    int keepalive;                //time between finishing 1 packet and next packet, in seconds
-    char topic[MAX_TOPICS][256];  //Client's subscripted topics (at maximum all topics)
+    int keepalive;                //longest silence the client announced in CONNECT, in seconds, 0 disables it
+    int topic_count;              //number of filters this client is subscribed to (at maximum config max_topics)
+    session_match *matches;       //one per shard, written only by that shard while routing
+    _Atomic int shard;            //shard owning the session, the only one touching its queues and timers
 
     char* client_id;
-    int last_pck_received_id;     //pck id of last received message from this session's client
-    mqtt_pck pck_to_send[MAX_PUB_QUEUE_SIZE]; //queue of publish messages to send to this client
+    //QoS 1 packet IDs received from the client whose PUBACK isn't written yet, one bit each, allocated with the first
+    //one and cleared when the connection closes
+    uint64_t *inbound_ids;
+
+    //in-flight window, PUBLISH sent to this client and waiting for PUBACK, slot is pck_id & (max_inflight-1)
+    mqtt_pck *inflight;           //max_inflight slots, allocated with the first forwarded message
+    int inflight_count;
+    uint16_t next_pck_id;         //next packet ID handed out by the broker for this client, never 0
+
+    //ring of frames waiting for room in the window, in arrival order
+    pub_frame **pending;
+    uint32_t pending_head;
+    uint32_t pending_count;
+    uint32_t pending_cap;
+    size_t pending_bytes;         //frame bytes in the ring, counted against max_queued_bytes
 } session;
 
-//for each thread
+//per connection state, owned by the event loop
+typedef struct {
+    int conn_fd;                   //connection file descriptor
+    uint32_t ring_gen;             //io_uring backend: completions tagged with another generation belong to an earlier connection on this fd
+    session *session;              //session bound by CONNECT, NULL before it
+    session *adopting;             //session requested from another shard by CONNECT, reading pauses until it arrives
+    int connect_keepalive;         //keepalive and CONNACK return code of that CONNECT, applied once the session arrives
+    int connect_return_code;
+
+    //closes the connection once nothing was read for idle_ms, re-armed lazily so reads only store a timestamp
+    timer_entry idle_timer;
+    uint64_t last_rx_ms;           //iteration time of the last read
+    uint64_t idle_ms;              //connect-timeout-ms before CONNECT, 1.5 times the keepalive after it, 0 never
+
+    //incremental receive buffer, holds at most one partial packet between reads
+    uint8_t *rx_buf;
+    size_t rx_len;                 //bytes currently buffered
+    size_t rx_cap;                 //allocated size of rx_buf
+
+    //outbound queue, filled while handling a batch and flushed with one writev when it ends
+    uint8_t *tx_buf;               //copied output bytes (control packets, small frames, per recipient headers)
+    size_t tx_len;
+    size_t tx_cap;
+    tx_segment *tx_segs;           //ring of segments in send order
+    uint32_t tx_head;
+    uint32_t tx_count;
+    uint32_t tx_seg_cap;
+    size_t tx_bytes;               //bytes queued and not yet written
+    uint64_t tx_written;           //bytes written since the connection opened
+    int tx_dirty;                  //in the broker's dirty list, flushed when the batch ends
+    int tx_blocked;                //socket full, EPOLLOUT (or an io_uring poll) armed
+    int overflowed;                //shut down by overflow-policy disconnect, nothing more is queued on it
+
+    //MSG_ZEROCOPY sends waiting for completion, in send order
+    int zerocopy;                  //SO_ZEROCOPY enabled on the socket
+    uint32_t zc_next_seq;
+    zerocopy_pending *zc_head;
+    zerocopy_pending *zc_tail;
+
+    //PUBACKs queued and not written yet, ring in queue order
+    inbound_ack *acks;
+    uint32_t ack_head;
+    uint32_t ack_count;
+    uint32_t ack_cap;
+
+    //retained messages matched by new subscriptions, one reference each, sent RETAINED_BATCH per event loop iteration
+    pub_frame **replay;
+    uint32_t replay_next;
+    uint32_t replay_count;
+    uint32_t replay_cap;
+    int replay_queued;             //in the broker's replay list
+} connection;
+
+typedef struct broker_ctx broker_ctx;
+
+//state shared by every shard
+typedef struct {
+    broker_config config;          //limits chosen at startup
+    int max_connections;           //size of each shard's connections table (process fd limit)
+
+    //session registry, locked only by CONNECT (lookup by client ID and creation)
+    pthread_mutex_t sessions_lock;
+    session **session_chunks;      //SESSION_CHUNK sessions each, allocated as sessions are created
+    int chunk_count;
+    int chunk_cap;
+    _Atomic int session_count;     //sessions created so far, sessions are never removed
+    session_table sessions_by_id;  //client ID -> session
+
+    pthread_mutex_t subscriptions_lock; //serializes SUBSCRIBE and UNSUBSCRIBE, publishes read without it
+    epoch_domain subscription_epochs; //memory the subscription writers unlink is freed once no publish can see it
+    topic_tree subscriptions;      //subscription index, filter -> sessions
+
+    pthread_rwlock_t retained_lock; //PUBLISH with RETAIN writes, SUBSCRIBE reads
+    topic_tree retained;           //retained messages, topic name -> retained_msg
+
+    persist_store persist;         //persistence log, used when config persist_dir is set
+
+    broker_ctx *shards[MAX_SHARDS];
+    int shard_count;
+    uint64_t start_ms;             //monotonic start time, for uptime
+} broker_shared;
+
+//cross-shard message types
+#define SHARD_MSG_DELIVER 0        //forwarded PUBLISH for sessions owned by the receiving shard
+#define SHARD_MSG_TAKEOVER 1       //a CONNECT on another shard asks the owner to give the session up
+#define SHARD_MSG_ADOPT 2          //session handed over to the shard holding the CONNECT
+
+//message pushed into another shard's inbox
 typedef struct {
+    shard_node node;               //first, the inbox links messages through it
+    int type;                      //SHARD_MSG_*
+    pub_frame *frame;              //DELIVER: one reference held by the message
+    session *session;              //TAKEOVER, ADOPT: the session moving
+    connection *conn;              //TAKEOVER, ADOPT: connection whose CONNECT wants the session
     int conn_fd;
-    session *running_sessions;
-} thread_data;
+    int shard;                     //TAKEOVER: shard holding that connection
+    int count;                     //DELIVER: sessions to queue the frame for
+    int cap;                       //sessions allocated, 0 for TAKEOVER (decides the pool class when freed)
+    session *sessions[];
+} shard_msg;
+
+//state of one event loop shard, every handler runs on the shard owning the connection
+struct broker_ctx {
+    broker_config config;          //limits chosen at startup
+    broker_shared *shared;
+    int shard_id;
+    shard_queue inbox;             //messages from other shards
+
+    connection **connections;      //this shard's connections indexed by conn_fd, gives the fd -> session map
+    int max_connections;           //size of connections table (process fd limit)
+
+    epoch_reader epoch;            //this shard's reads of the subscription index
+    unsigned int match_stamp;      //incremented for every publish routed by this shard
+    session **matched;             //sessions matched by the publish being routed, reused between publishes
+    int matched_cap;
+    uint32_t *persist_ids;         //IDs of the matched sessions getting a logged QoS 1 delivery, same capacity
+    arena arena;                   //packet fields and lookup keys parsed from the current read, reset by the next one
+
+    persist_log log;               //this shard's persistence log, synced once per event loop iteration
+
+    timer_wheel timers;            //QoS 1 retransmission and keepalive deadlines, advanced by the event loop
+    uint64_t now_ms;               //monotonic time of the current event loop iteration
+
+    int *dirty_fds;                //connections with queued output, flushed when the batch ends
+    int dirty_count;
+    int dirty_cap;
+    int *replay_fds;               //connections with retained messages left to send
+    int replay_count;
+    int replay_cap;
+    uint64_t tx_packets;           //packets queued for sending
+    uint64_t tx_writes;            //write syscalls used to send them (packets per syscall = tx_packets / tx_writes)
+
+    timer_entry sys_timer;         //periodic $SYS publication, shard 0 only
+};
+
+//event loop state, owns the listening socket and every client connection
+typedef struct {
+    int server_fd;                 //listening socket from create_tcpserver
+    int epoll_fd;                  //closed once the io_uring backend took over
+    int stats_fd;                  //Unix socket serving metrics, -1 when disabled (or not shard 0)
+    sig_atomic_t stats_seen;       //last SIGUSR1 request this loop answered
+    broker_ctx *broker;
+
+    //io_uring backend, ring.fd is -1 while the loop runs on epoll
+    uring ring;
+    uint32_t ring_gen;             //generation of the last accepted connection, tags its requests
+    struct io_uring_cqe *deferred; //completions reaped while waiting for sends, handled in the next iteration
+    int deferred_count;
+    int deferred_cap;
+    int sends_inflight;
+    struct msghdr *send_msgs;      //URING_SEND_BATCH messages
+    struct iovec *send_iov;        //URING_SEND_IOV entries per message
+} event_loop;
 
 #ifndef MQTT_RETURN_CODES_H
 #define MQTT_RETURN_CODES_H
@@ -79,40 +335,124 @@ typedef struct {
 //MQTT Connect Return Code Responses
 #define MQTT_CONN_ACCEPTED                  0x00  // Connection accepted
 #define MQTT_CONN_REFUSED_ID_REJECTED       0x02  // Connection Refused, identifier rejected
+#define MQTT_CONN_REFUSED_SERVER_UNAVAILABLE 0x03 // Connection Refused, server unavailable
+
+//MQTT Subscribe Return Code Failure
+#define MQTT_SUBACK_FAILURE                 0x80
 
 #endif // MQTT_RETURN_CODES_H
 
-//function creates server at local ip and given port
-int create_tcpserver(int *server_fd, struct sockaddr_in *address, int *addrlen);
-//main loop function, for each thread
-void *client_handler(void *arg);
-//queue loop function, 1 for all threads, responsible for fowarding PUBLISH messages
-void *queue_handler(void *arg);
-//function to decode the remaining length
-int decode_remaining_length(uint8_t *buffer, uint8_t *remaining_length, int *offset);
+//prepares the state shared by every shard: limits, session registry and subscription index
+int broker_shared_init(broker_shared *shared, const broker_config *config);
+//prepares the state of one shard
+int broker_init(broker_ctx *broker, broker_shared *shared, int shard_id);
+//replays the persistence log into shard 0 before the shards start, then starts its compactor
+int broker_recover(broker_ctx *broker);
+//hands out zeroed storage for a new session, NULL when max_clients is reached or memory runs out (sessions_lock held)
+session *session_alloc(broker_ctx *broker);
+//function creates server at local ip and given port, SO_REUSEPORT lets every shard listen on it
+int create_tcpserver(int *server_fd, struct sockaddr_in *address, int *addrlen, const broker_config *config);
+//handles messages other shards pushed into this shard's inbox, except ADOPT which the event loop completes
+void shard_handle_message(shard_msg *msg, broker_ctx *broker);
+//gives a shard message back to the pool, on whichever shard handled it last
+void shard_msg_free(shard_msg *msg);
+//binds a session to a connection and answers CONNECT, the session must be owned by this shard
+int connect_complete(connection *conn, session *current_session, int keepalive, int return_code, int session_present, broker_ctx *broker);
+//prepares the event loop around an already listening server socket
+int event_loop_init(event_loop *loop, int server_fd, broker_ctx *broker);
+//event loop, accepts connections and dispatches readable sockets into mqtt_process_pck
+int event_loop_run(event_loop *loop);
+//removes a connection from the event loop and closes it
+void close_connection(event_loop *loop, connection *conn);
+//arms the idle deadline of a connection, idle_ms after its last read (0 disarms it)
+void connection_set_idle(broker_ctx *broker, connection *conn, uint64_t idle_ms);
+//function to decode the remaining length, returns 1 if more bytes are needed
+int decode_remaining_length(uint8_t *buffer, size_t len, uint32_t *remaining_length, int *offset);
 //function to encode the remaining length
 int encode_remaining_length(uint8_t *buffer, size_t remaining_len);
-//function to easily made packet(only fill a variable of type structure mqtt_pck)
-int send_pck(mqtt_pck *packet);
+//function to easily made packet(only fill a variable of type structure mqtt_pck), queued on the destination connection
+int send_pck(mqtt_pck *packet, broker_ctx *broker);
+//encodes a received PUBLISH once per delivery QoS into a shared frame, with a reference for the caller
+pub_frame *pub_frame_encode(mqtt_pck *received_pck, uint8_t qos);
+//drops one reference of a frame, freeing it with the last one
+void pub_frame_release(pub_frame *frame);
+//sends a shared frame with this recipient's fixed header flags and packet ID
+int send_frame(int conn_fd, pub_frame *frame, uint8_t flag, int pck_id, broker_ctx *broker);
+//queues a copy of one packet given as pieces, written when the current batch ends
+int tx_queue_iov(broker_ctx *broker, connection *conn, const struct iovec *iov, int iov_count);
+//queues a shared PUBLISH frame with this recipient's first byte and packet ID, skipping bytes already sent
+int tx_queue_frame(broker_ctx *broker, connection *conn, pub_frame *frame, uint8_t first_byte, int pck_id, size_t skip);
+//writes as much of the queue as the socket takes, returns 0 when empty, 1 when the socket is full, -1 on error
+int tx_flush(broker_ctx *broker, connection *conn);
+//remembers the connection so the event loop flushes it when the current batch ends
+void tx_mark_dirty(broker_ctx *broker, connection *conn);
+//points iov at the head of the queue, returns the entries used (at most max)
+int tx_prepare(connection *conn, struct iovec *iov, int max);
+//drops bytes the socket took from the head of the queue
+void tx_sent(broker_ctx *broker, connection *conn, size_t written);
+//moves still queued copied bytes to the front of tx_buf once the consumed prefix is large, used when the socket is full
+void tx_compact(connection *conn);
+//releases everything still queued, used when the connection closes
+void tx_queue_free(connection *conn);
+//stores the message of a PUBLISH with RETAIN as its topic's retained message, an empty payload removes it
+int retained_update(broker_ctx *broker, mqtt_pck *received_pck, uint8_t qos);
+//queues every retained message a new subscription matches for sending, with the lower of its QoS and granted_qos
+int retained_collect(broker_ctx *broker, connection *conn, const char *filter, size_t len, uint8_t granted_qos);
+//sends the next batch of every connection's retained messages, returns 1 when some can continue right away
+int retained_replay_run(broker_ctx *broker);
+//drops the retained messages a connection didn't get to send, used when it closes
+void retained_replay_free(broker_ctx *broker, connection *conn);
+//writes every metric in Prometheus text exposition format, returns the text length
+size_t metrics_format_prometheus(broker_ctx *broker, char *buffer, size_t size);
+//publishes every metric on its $SYS/broker topic
+void metrics_publish_sys(broker_ctx *broker);
+//arms the $SYS publication timer, if enabled (on shard 0, which publishes for the whole broker)
+void metrics_start(broker_ctx *broker);
+//opens the Unix stats socket, -1 on failure
+int metrics_socket_open(const char *path);
+//answers every pending stats connection with the current metrics and closes it
+void metrics_socket_serve(int stats_fd, broker_ctx *broker);
+//reads MSG_ZEROCOPY completions from the socket error queue and releases the frames the kernel is done with
+void zerocopy_complete(connection *conn);
+//drops every frame still waiting for a zerocopy completion, used when the connection closes
+void zerocopy_release_all(connection *conn);
+//returns the session bound to a connection, NULL if it hasn't sent CONNECT
+session *find_session(broker_ctx *broker, int conn_fd);
 //determine type of packet and process
-int mqtt_process_pck(uint8_t *buffer, mqtt_pck received_pck, session* running_sessions);
+int mqtt_process_pck(uint8_t *buffer, mqtt_pck received_pck, broker_ctx *broker);
 //disconnects client properly
-int disconnect_handler(mqtt_pck *received_pck, session* running_sessions);
+int disconnect_handler(mqtt_pck *received_pck, broker_ctx *broker);
 //handle(interprets) CONNECT packet
-int connect_handler(mqtt_pck *received_pck, session* running_sessions);
+int connect_handler(mqtt_pck *received_pck, broker_ctx *broker);
 //Prepares and sends connack packet
-int send_connack(session* current_session, int return_code, int session_present);
+int send_connack(session* current_session, int return_code, int session_present, broker_ctx *broker);
 //Sends PingResp packet(no need for handler before)
-int send_pingresp(mqtt_pck *received_pck);
+int send_pingresp(mqtt_pck *received_pck, broker_ctx *broker);
+//routes a message originated by the broker itself (e.g. $SYS metrics) to its subscribers
+int broker_publish(broker_ctx *broker, const char *topic, const uint8_t *payload, size_t payload_len);
 //handle(interprets) PUBISH packet
-int publish_handler(mqtt_pck *received_pck, session* running_sessions);
+int publish_handler(mqtt_pck *received_pck, broker_ctx *broker);
 //send puback
-int send_puback(session* current_session, int pck_id);
+int send_puback(session* current_session, int pck_id, broker_ctx *broker);
 //handle PUBACK response
-int puback_handler(mqtt_pck *received_pck, session* running_sessions);
+int puback_handler(mqtt_pck *received_pck, broker_ctx *broker);
 //queue publish
-int queue_publish(mqtt_pck *received_pck, session* running_session);
+int queue_publish(pub_frame *frame, session* running_session, broker_ctx *broker);
+//sends again every unacknowledged PUBLISH of a session, used when its client reconnects
+void resend_inflight(session *current_session, broker_ctx *broker);
+//disarms the retransmission timers of a session whose client went offline
+void stop_retransmit(session *current_session, broker_ctx *broker);
+//forgets every outstanding packet ID of a session whose connection closes, the client resends them as new messages
+void inbound_ids_clear(session *current_session);
+//frees the packet IDs whose PUBACK the socket took, called as queued output is written
+void inbound_acks_written(connection *conn);
+//moves waiting messages into the in-flight window while it has room
+void drain_pending(session *current_session, broker_ctx *broker);
 //handle SUBSCRIBE packet
-int subscribe_handler(mqtt_pck *received_pck, session* running_sessions);
-//send SUBACK response
-int send_suback(session *current_session, int pck_id, int num_topics);
\ No newline at end of file
+int subscribe_handler(mqtt_pck *received_pck, broker_ctx *broker);
+//send SUBACK response, one return code per requested topic
+int send_suback(session *current_session, int pck_id, uint8_t *return_codes, int num_topics, broker_ctx *broker);
+//handle UNSUBSCRIBE packet
+int unsubscribe_handler(mqtt_pck *received_pck, broker_ctx *broker);
+//send UNSUBACK response
+int send_unsuback(session *current_session, int pck_id, broker_ctx *broker);
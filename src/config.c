@@ -0,0 +1,230 @@
+#include "broker.h"
+
+#include <getopt.h>
+#include <ctype.h>
+
+#define CONFIG_INT 0
+#define CONFIG_SIZE 1
+#define CONFIG_STRING 2
+#define CONFIG_CHOICE 3
+
+static const char *const overflow_policies[] = {"drop-newest", "drop-oldest", "disconnect", NULL}; //OVERFLOW_* order
+static const char *const io_backends[] = {"epoll", "io_uring", NULL}; //IO_BACKEND_* order
+
+//option table shared by the config file and the command line, the long name is the config file key
+typedef struct {
+    const char *name;
+    char flag;
+    long min;
+    long max;
+    size_t offset;                 //field inside broker_config
+    int type;                      //CONFIG_INT, CONFIG_SIZE, CONFIG_STRING (max is then the buffer size) or CONFIG_CHOICE
+    const char *const *choices;    //CONFIG_CHOICE: accepted names, the field stores the index
+} config_option;
+
+static const config_option config_options[] = {
+    {"port",            'p', 1,    65535,         offsetof(broker_config, port),            CONFIG_INT},
+    {"max-clients",     'n', 1,    INT_MAX,       offsetof(broker_config, max_clients),     CONFIG_INT},
+    {"max-topics",      't', 1,    INT_MAX,       offsetof(broker_config, max_topics),      CONFIG_INT},
+    {"max-inflight",    'i', 1,    32768,         offsetof(broker_config, max_inflight),    CONFIG_INT},
+    {"max-pending",     'q', 0,    INT_MAX,       offsetof(broker_config, max_pending),     CONFIG_INT},
+    {"max-queued-bytes", 'Q', 1,   LONG_MAX,      offsetof(broker_config, max_queued_bytes), CONFIG_SIZE},
+    {"overflow-policy", 'O', 0,    2,             offsetof(broker_config, overflow_policy), CONFIG_CHOICE, overflow_policies},
+    {"retransmit-ms",   'r', 1,    INT_MAX,       offsetof(broker_config, retransmit_ms),   CONFIG_INT},
+    {"connect-timeout-ms", 'k', 0, INT_MAX,       offsetof(broker_config, connect_timeout_ms), CONFIG_INT},
+    {"buffer-size",     'b', 16,   INT_MAX,       offsetof(broker_config, buffer_size),     CONFIG_SIZE},
+    {"max-packet-size", 's', 16,   268435460,     offsetof(broker_config, max_packet_size), CONFIG_SIZE}, //MQTT limit: 256MB remaining length + fixed header
+    {"listen-backlog",  'l', 1,    INT_MAX,       offsetof(broker_config, listen_backlog),  CONFIG_INT},
+    {"log-level",       'v', LOG_LEVEL_ERROR, LOG_LEVEL_DEBUG, offsetof(broker_config, log_level), CONFIG_INT},
+    {"sys-interval",    'y', 0,    86400,         offsetof(broker_config, sys_interval),    CONFIG_INT},
+    {"stats-socket",    'S', 0,    sizeof(((broker_config *)0)->stats_socket), offsetof(broker_config, stats_socket), CONFIG_STRING},
+    {"threads",         'T', 1,    MAX_SHARDS,    offsetof(broker_config, threads),         CONFIG_INT},
+    {"persist-dir",     'D', 0,    sizeof(((broker_config *)0)->persist_dir), offsetof(broker_config, persist_dir), CONFIG_STRING},
+    {"segment-mb",      'G', 1,    4096,          offsetof(broker_config, persist_segment_mb), CONFIG_INT},
+    {"io-backend",      'I', 0,    1,             offsetof(broker_config, io_backend),      CONFIG_CHOICE, io_backends},
+};
+#define CONFIG_OPTION_COUNT (int)(sizeof(config_options) / sizeof(config_options[0]))
+
+//fills a configuration with the compiled-in defaults
+void config_defaults(broker_config *config) {
+    config->port = BROKER_PORT;
+    config->max_clients = MAX_CLIENTS;
+    config->max_topics = MAX_TOPICS;
+    config->max_inflight = MAX_INFLIGHT;
+    config->max_pending = MAX_PENDING;
+    config->max_queued_bytes = MAX_QUEUED_BYTES;
+    config->overflow_policy = OVERFLOW_POLICY;
+    config->retransmit_ms = TIME_TO_RETRANSMIT;
+    config->connect_timeout_ms = CONNECT_TIMEOUT;
+    config->buffer_size = BUFFER_SIZE;
+    config->max_packet_size = MAX_PACKET_SIZE;
+    config->listen_backlog = LISTEN_BACKLOG;
+    config->log_level = LOG_LEVEL_INFO;
+    config->sys_interval = SYS_INTERVAL;
+    config->stats_socket[0] = '\0';
+    config->threads = THREADS;
+    config->persist_dir[0] = '\0';
+    config->persist_segment_mb = PERSIST_SEGMENT_MB;
+    config->io_backend = IO_BACKEND;
+}
+
+static int option_apply(broker_config *config, const config_option *option, const char *value) {
+    if (option->type == CONFIG_STRING) {
+        if (strlen(value) >= (size_t)option->max) {
+            printf("Value for %s too long: '%s' (at most %ld characters)\n", option->name, value, option->max - 1);
+            return -1;
+        }
+        strcpy((char *)config + option->offset, value);
+        return 0;
+    }
+    if (option->type == CONFIG_CHOICE) {
+        for (int i = 0; option->choices[i]; i++) {
+            if (strcmp(option->choices[i], value) == 0) {
+                *(int *)((char *)config + option->offset) = i;
+                return 0;
+            }
+        }
+        printf("Invalid value for %s: '%s' (expected", option->name, value);
+        for (int i = 0; option->choices[i]; i++) {
+            printf(" %s", option->choices[i]);
+        }
+        printf(")\n");
+        return -1;
+    }
+    char *end;
+    errno = 0;
+    long parsed = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || parsed < option->min || parsed > option->max) {
+        printf("Invalid value for %s: '%s' (expected %ld..%ld)\n", option->name, value, option->min, option->max);
+        return -1;
+    }
+    if (option->type == CONFIG_SIZE) {
+        *(size_t *)((char *)config + option->offset) = (size_t)parsed;
+    }
+    else {
+        *(int *)((char *)config + option->offset) = (int)parsed;
+    }
+
+    //the window is indexed with packet ID & (max_inflight - 1), at most half the ID space since ID 0 is never used
+    if (option->offset == offsetof(broker_config, max_inflight)) {
+        int inflight = 1;
+        while (inflight < config->max_inflight) {
+            inflight *= 2;
+        }
+        config->max_inflight = inflight;
+    }
+    return 0;
+}
+
+//sets one option by its long name (e.g. "max-clients"), returns -1 for unknown names or bad values
+int config_set(broker_config *config, const char *key, const char *value) {
+    for (int i = 0; i < CONFIG_OPTION_COUNT; i++) {
+        if (strcmp(config_options[i].name, key) == 0) {
+            return option_apply(config, &config_options[i], value);
+        }
+    }
+    printf("Unknown option: '%s'\n", key);
+    return -1;
+}
+
+//trims leading and trailing whitespace in place
+static char *trim(char *text) {
+    while (isspace((unsigned char)*text)) {
+        text++;
+    }
+    char *end = text + strlen(text);
+    while (end > text && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return text;
+}
+
+//reads "key = value" lines ('#' starts a comment), returns -1 on the first bad line
+int config_load_file(broker_config *config, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("Failed to open config file");
+        return -1;
+    }
+
+    char line[512];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char *key = trim(line);
+        if (*key == '\0') {
+            continue;
+        }
+        char *separator = strchr(key, '=');
+        if (!separator) {
+            printf("%s:%d: expected 'key = value'\n", path, line_number);
+            fclose(file);
+            return -1;
+        }
+        *separator = '\0';
+        if (config_set(config, trim(key), trim(separator + 1)) < 0) {
+            printf("%s:%d: rejected\n", path, line_number);
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+static void print_usage(const char *program) {
+    printf("Usage: %s [-c config_file]", program);
+    for (int i = 0; i < CONFIG_OPTION_COUNT; i++) {
+        printf(" [-%c %s]", config_options[i].flag, config_options[i].name);
+    }
+    printf("\nLong forms --<name>=<value> are accepted too, config files use 'name = value' lines\n");
+}
+
+//applies command line flags, returns -1 after printing usage on bad input
+int config_parse_args(broker_config *config, int argc, char **argv) {
+    struct option long_options[CONFIG_OPTION_COUNT + 2];
+    char short_options[2 * CONFIG_OPTION_COUNT + 4] = "c:h";
+    size_t short_len = strlen(short_options);
+    for (int i = 0; i < CONFIG_OPTION_COUNT; i++) {
+        long_options[i].name = config_options[i].name;
+        long_options[i].has_arg = required_argument;
+        long_options[i].flag = NULL;
+        long_options[i].val = config_options[i].flag;
+        short_options[short_len++] = config_options[i].flag;
+        short_options[short_len++] = ':';
+    }
+    short_options[short_len] = '\0';
+    long_options[CONFIG_OPTION_COUNT] = (struct option){"config", required_argument, NULL, 'c'};
+    long_options[CONFIG_OPTION_COUNT + 1] = (struct option){0};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+        if (opt == 'c') {
+            if (config_load_file(config, optarg) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        int i = 0;
+        while (i < CONFIG_OPTION_COUNT && config_options[i].flag != opt) {
+            i++;
+        }
+        if (i == CONFIG_OPTION_COUNT) { //'h' or unknown flag
+            print_usage(argv[0]);
+            return -1;
+        }
+        if (option_apply(config, &config_options[i], optarg) < 0) {
+            return -1;
+        }
+    }
+    if (optind < argc) {
+        printf("Unexpected argument: '%s'\n", argv[optind]);
+        print_usage(argv[0]);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//=============================================================//
+//broker limits chosen at startup, defaults come from the constants in broker.h
+//set from a config file (-c) and command line flags, applied in the order given so later ones win
+
+typedef struct {
+    int port;
+    int max_clients;               //sessions kept by the broker, new client IDs beyond it are refused
+    int max_topics;                //subscriptions per client
+    int max_inflight;              //unacknowledged PUBLISH per client, rounded up to a power of two
+    int max_pending;               //PUBLISH waiting per client behind a full in-flight window
+    size_t max_queued_bytes;       //bytes of waiting PUBLISH and unwritten output per client
+    int overflow_policy;           //OVERFLOW_* applied when a client goes over max_pending or max_queued_bytes
+    int retransmit_ms;             //time before an unacknowledged PUBLISH is sent again
+    int connect_timeout_ms;        //time a new connection has to send CONNECT, 0 waits forever
+    size_t buffer_size;            //initial receive buffer per connection
+    size_t max_packet_size;        //largest accepted packet, bigger ones close the connection
+    int listen_backlog;
+    int log_level;                 //0 error, 1 warn, 2 info, 3 debug
+    int sys_interval;              //seconds between $SYS publications, 0 disables them
+    char stats_socket[108];        //Unix socket path serving metrics in Prometheus text format, empty disables it
+    int threads;                   //event loop shards, each with its own SO_REUSEPORT listener, pinned to a CPU when more than 1
+    char persist_dir[256];         //directory of the persistence log, empty disables persistence
+    int persist_segment_mb;        //size of a log segment
+    int io_backend;                //IO_BACKEND_* of the event loops, io_uring falls back to epoll where unsupported
+} broker_config;
+
+//fills a configuration with the compiled-in defaults
+void config_defaults(broker_config *config);
+//sets one option by its long name (e.g. "max-clients"), returns -1 for unknown names or bad values
+int config_set(broker_config *config, const char *key, const char *value);
+//reads "key = value" lines ('#' starts a comment), returns -1 on the first bad line
+int config_load_file(broker_config *config, const char *path);
+//applies command line flags, returns -1 after printing usage on bad input
+int config_parse_args(broker_config *config, int argc, char **argv);
+
+#endif // CONFIG_H
@@ -0,0 +1,78 @@
+#include "broker.h"
+
+//initializes a domain without readers
+void epoch_domain_init(epoch_domain *domain) {
+    atomic_init(&domain->epoch, 1);
+    atomic_init(&domain->readers, NULL);
+    domain->retired = NULL;
+    domain->retired_count = 0;
+    domain->retired_cap = 0;
+}
+
+//adds a reader, safe while other readers are active
+void epoch_reader_register(epoch_domain *domain, epoch_reader *reader) {
+    atomic_init(&reader->epoch, 0);
+    epoch_reader *head = atomic_load_explicit(&domain->readers, memory_order_relaxed);
+    do {
+        reader->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&domain->readers, &head, reader, memory_order_release, memory_order_relaxed));
+}
+
+//starts a read-side section, pointers loaded from the structure stay valid until epoch_exit
+void epoch_enter(epoch_domain *domain, epoch_reader *reader) {
+    atomic_store_explicit(&reader->epoch, atomic_load_explicit(&domain->epoch, memory_order_acquire), memory_order_relaxed);
+    //the announcement must be visible before the first pointer is loaded, pairs with the fence in epoch_reclaim
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+//ends a read-side section
+void epoch_exit(epoch_reader *reader) {
+    atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+}
+
+//hands unlinked memory over, free_fn(ptr) runs once no reader can see it (writers only)
+void epoch_retire(epoch_domain *domain, void *ptr, void (*free_fn)(void *)) {
+    if (domain->retired_count == domain->retired_cap) {
+        uint32_t new_cap = domain->retired_cap ? domain->retired_cap * 2 : 64;
+        epoch_retired *grown = realloc(domain->retired, new_cap * sizeof(epoch_retired));
+        if (!grown) {
+            perror("Failed to grow retired list, leaking"); //a reader may still use it, freeing isn't safe
+            return;
+        }
+        domain->retired = grown;
+        domain->retired_cap = new_cap;
+    }
+
+    //readers entering from now on get a later epoch, the memory is already unreachable for them
+    uint64_t epoch = atomic_fetch_add_explicit(&domain->epoch, 1, memory_order_acq_rel);
+    domain->retired[domain->retired_count].ptr = ptr;
+    domain->retired[domain->retired_count].free_fn = free_fn;
+    domain->retired[domain->retired_count].epoch = epoch;
+    domain->retired_count++;
+}
+
+//frees the retired memory no reader can see anymore (writers only)
+void epoch_reclaim(epoch_domain *domain) {
+    if (domain->retired_count == 0) {
+        return;
+    }
+
+    //oldest epoch a reader is still in, pairs with the fence in epoch_enter
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t oldest = UINT64_MAX;
+    for (epoch_reader *reader = atomic_load_explicit(&domain->readers, memory_order_acquire); reader; reader = reader->next) {
+        uint64_t epoch = atomic_load_explicit(&reader->epoch, memory_order_acquire);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    //retired in epoch order, everything retired before the oldest reader entered can go
+    uint32_t freed = 0;
+    while (freed < domain->retired_count && domain->retired[freed].epoch < oldest) {
+        domain->retired[freed].free_fn(domain->retired[freed].ptr);
+        freed++;
+    }
+    domain->retired_count -= freed;
+    memmove(domain->retired, domain->retired + freed, domain->retired_count * sizeof(epoch_retired));
+}
@@ -0,0 +1,47 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+//=============================================================//
+//epoch-based reclamation for structures read without locks: a reader publishes the epoch it entered in and clears
+//it when it leaves, a writer unlinks memory and retires it instead of freeing it, retired memory is freed once every
+//reader still inside entered after the retirement (none of them can hold a pointer to it anymore)
+//writers must be serialized by the caller, readers never wait for anything
+
+//one reading thread, registered once and never removed
+typedef struct epoch_reader {
+    _Atomic uint64_t epoch;        //global epoch when the reader entered, 0 while outside
+    struct epoch_reader *next;
+} epoch_reader;
+
+//memory waiting until no reader can see it
+typedef struct {
+    void *ptr;
+    void (*free_fn)(void *);
+    uint64_t epoch;                //global epoch before it was retired
+} epoch_retired;
+
+typedef struct {
+    _Atomic uint64_t epoch;        //global epoch, advanced by every retirement
+    _Atomic(epoch_reader *) readers;
+    epoch_retired *retired;        //writer side, in retirement order
+    uint32_t retired_count;
+    uint32_t retired_cap;
+} epoch_domain;
+
+//initializes a domain without readers
+void epoch_domain_init(epoch_domain *domain);
+//adds a reader, safe while other readers are active
+void epoch_reader_register(epoch_domain *domain, epoch_reader *reader);
+//starts a read-side section, pointers loaded from the structure stay valid until epoch_exit
+void epoch_enter(epoch_domain *domain, epoch_reader *reader);
+//ends a read-side section
+void epoch_exit(epoch_reader *reader);
+//hands unlinked memory over, free_fn(ptr) runs once no reader can see it (writers only)
+void epoch_retire(epoch_domain *domain, void *ptr, void (*free_fn)(void *));
+//frees the retired memory no reader can see anymore (writers only)
+void epoch_reclaim(epoch_domain *domain);
+
+#endif // EPOCH_H
@@ -0,0 +1,823 @@
+#include "broker.h"
+
+//io_uring requests carry what completed, the fd and the connection generation in user_data
+#define URING_OP_ACCEPT 1
+#define URING_OP_RECV 2
+#define URING_OP_SEND 3
+#define URING_OP_WRITABLE 4
+#define URING_OP_INBOX 5
+#define URING_OP_STATS 6
+#define URING_DATA(op, fd, gen) (((uint64_t)(gen) << 32) | ((uint64_t)(uint32_t)(fd) << 4) | (op))
+
+static volatile sig_atomic_t stats_requested = 0; //bumped per request, every shard prints once per value
+
+//SIGUSR1 asks the loops to print their send statistics
+static void request_stats(int signo) {
+    (void)signo;
+    stats_requested++;
+}
+
+//prepares the event loop around an already listening server socket
+int event_loop_init(event_loop *loop, int server_fd, broker_ctx *broker) {
+    loop->server_fd = server_fd;
+    loop->broker = broker;
+    loop->ring.fd = -1; //event_loop_run switches to io_uring on the shard's thread, if configured
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        return -1;
+    }
+
+    //listening socket is level-triggered, accept loop drains it anyway
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.fd = server_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+        perror("epoll_ctl failed for server socket");
+        close(loop->epoll_fd);
+        return -1;
+    }
+    //messages from other shards wake the loop through the inbox eventfd
+    ev.events = EPOLLIN;
+    ev.data.fd = broker->inbox.wake_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, broker->inbox.wake_fd, &ev) < 0) {
+        perror("epoll_ctl failed for shard inbox");
+        close(loop->epoll_fd);
+        return -1;
+    }
+    //optional metrics endpoint, answered from the first shard's loop like any other socket
+    loop->stats_fd = -1;
+    loop->stats_seen = stats_requested;
+    if (broker->config.stats_socket[0] != '\0' && broker->shard_id == 0) {
+        loop->stats_fd = metrics_socket_open(broker->config.stats_socket);
+        if (loop->stats_fd < 0) {
+            close(loop->epoll_fd);
+            return -1;
+        }
+        ev.events = EPOLLIN;
+        ev.data.fd = loop->stats_fd;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->stats_fd, &ev) < 0) {
+            perror("epoll_ctl failed for stats socket");
+            close(loop->stats_fd);
+            close(loop->epoll_fd);
+            return -1;
+        }
+    }
+
+    signal(SIGUSR1, request_stats);
+    LOG_INFO("Event loop ready || shard: %d || max connections: %d", broker->shard_id, broker->max_connections);
+    return 0;
+}
+
+//fires idle_ms after the last read as of arming, reads since then only moved last_rx_ms, so the deadline is checked again
+static void idle_expired(timer_wheel *wheel, timer_entry *timer, void *arg) {
+    connection *conn = (connection *)arg;
+    uint64_t deadline = conn->last_rx_ms + conn->idle_ms;
+    if (deadline > wheel->now) {
+        timer_wheel_add(wheel, timer, deadline);
+        return;
+    }
+    LOG_INFO("%s expired || closing conn_fd: %d", conn->session ? "Keepalive" : "CONNECT timeout", conn->conn_fd);
+    METRIC_INC(connections_expired);
+    shutdown(conn->conn_fd, SHUT_RDWR); //event loop closes it, marking its session offline
+}
+
+//arms the idle deadline of a connection, idle_ms after its last read (0 disarms it)
+void connection_set_idle(broker_ctx *broker, connection *conn, uint64_t idle_ms) {
+    conn->idle_ms = idle_ms;
+    if (idle_ms == 0) {
+        timer_wheel_cancel(&broker->timers, &conn->idle_timer);
+        return;
+    }
+    timer_wheel_add(&broker->timers, &conn->idle_timer, conn->last_rx_ms + idle_ms);
+}
+
+static int uring_arm_recv(event_loop *loop, connection *conn);
+
+//sets up an accepted socket and registers it with the loop's backend
+static void connection_open(event_loop *loop, int conn_fd) {
+    if (conn_fd >= loop->broker->max_connections) {
+        LOG_WARN("Connection table full || conn_fd: %d", conn_fd);
+        close(conn_fd);
+        return;
+    }
+
+    connection *conn = calloc(1, sizeof(connection));
+    if (!conn) {
+        perror("Failed to allocate connection");
+        close(conn_fd);
+        return;
+    }
+    conn->conn_fd = conn_fd;
+    int nodelay = 1; //writes are already coalesced per batch, Nagle would only hold back the last packet
+    setsockopt(conn_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    if (loop->ring.fd >= 0) {
+        conn->ring_gen = ++loop->ring_gen; //zerocopy completions arrive through EPOLLERR, so io_uring sends copy
+        if (uring_arm_recv(loop, conn) < 0) {
+            free(conn);
+            close(conn_fd);
+            return;
+        }
+    }
+    else {
+#if ZEROCOPY_THRESHOLD > 0
+        int opt = 1;
+        conn->zerocopy = (setsockopt(conn_fd, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt)) == 0); //older kernels fall back to copying sends
+#endif
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = conn_fd;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, conn_fd, &ev) < 0) {
+            perror("epoll_ctl failed for client socket");
+            free(conn);
+            close(conn_fd);
+            return;
+        }
+    }
+    loop->broker->connections[conn_fd] = conn;
+    conn->last_rx_ms = loop->broker->now_ms;
+    timer_init(&conn->idle_timer, idle_expired, conn);
+    connection_set_idle(loop->broker, conn, loop->broker->config.connect_timeout_ms);
+    METRIC_INC(connections_total);
+    METRIC_INC(connections);
+    LOG_INFO("New connection: conn_fd = %d", conn_fd);
+}
+
+//accepts every pending connection and registers it edge-triggered
+static void accept_connections(event_loop *loop) {
+    while (1) {
+        int conn_fd = accept4(loop->server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Connection accept error");
+            }
+            return;
+        }
+        connection_open(loop, conn_fd);
+    }
+}
+
+//removes a connection from the event loop and closes it
+void close_connection(event_loop *loop, connection *conn) {
+    int conn_fd = conn->conn_fd;
+
+    //mark the bound session offline, unless a newer connection already took it over
+    if (conn->session && conn->session->conn_fd == conn_fd) {
+        conn->session->conn_fd = 0;
+        METRIC_DEC(clients_connected);
+        stop_retransmit(conn->session, loop->broker);
+        inbound_ids_clear(conn->session);
+    }
+
+    //last chance for queued output, e.g. a refusing CONNACK, then drop whatever the socket didn't take
+    if (conn->tx_count > 0) {
+        tx_flush(loop->broker, conn);
+    }
+    timer_wheel_cancel(&loop->broker->timers, &conn->idle_timer);
+    if (loop->ring.fd >= 0) {
+        //ends the multishot recv and a pending poll, their last completions carry a generation no connection has
+        shutdown(conn_fd, SHUT_RDWR);
+    }
+    else {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn_fd, NULL);
+    }
+    close(conn_fd);
+    loop->broker->connections[conn_fd] = NULL;
+    METRIC_DEC(connections);
+    free(conn->rx_buf);
+    free(conn->acks);
+    tx_queue_free(conn);
+    zerocopy_release_all(conn);
+    retained_replay_free(loop->broker, conn);
+    free(conn);
+}
+
+//processes every complete packet in the receive buffer, keeping a trailing partial packet for the next read
+static int decode_frames(event_loop *loop, connection *conn) {
+    size_t pos = 0;
+    arena_reset(&loop->broker->arena); //nothing parsed from the previous read is referenced anymore
+
+    while (pos < conn->rx_len) {
+        uint8_t *frame = conn->rx_buf + pos;
+        size_t available = conn->rx_len - pos;
+
+        //framing state: fixed header, then remaining length bytes, then body
+        uint32_t remaining_length;
+        int offset;
+        int ret = decode_remaining_length(frame, available, &remaining_length, &offset);
+        if (ret < 0) {
+            return MQTT_PCK_CLOSE; //stream can't be resynchronised after a malformed length
+        }
+        if (ret > 0) {
+            break; //remaining length bytes incomplete
+        }
+
+        size_t frame_len = offset + remaining_length;
+        if (frame_len > loop->broker->config.max_packet_size) {
+            LOG_WARN("Packet too large: %zu bytes || conn_fd: %d", frame_len, conn->conn_fd);
+            return MQTT_PCK_CLOSE;
+        }
+        if (frame_len > available) {
+            //body incomplete, make sure the whole packet fits once it arrives
+            if (frame_len > conn->rx_cap) {
+                uint8_t *grown = realloc(conn->rx_buf, frame_len);
+                if (!grown) {
+                    perror("Failed to grow receive buffer");
+                    return MQTT_PCK_CLOSE;
+                }
+                conn->rx_buf = grown;
+                conn->rx_cap = frame_len;
+            }
+            break;
+        }
+
+        mqtt_pck received_pck = {0};
+        received_pck.conn_fd = conn->conn_fd;
+
+        //Process MQTT packet
+        ret = mqtt_process_pck(frame, received_pck, loop->broker);
+        if (ret < 0) {
+            LOG_ERROR("MQTT Process Error");
+        }
+        if (ret == MQTT_PCK_CLOSE) {
+            return MQTT_PCK_CLOSE;
+        }
+        pos += frame_len;
+        if (ret == MQTT_PCK_DEFER) {
+            break; //packets behind CONNECT wait for the session from another shard
+        }
+    }
+
+    //move the partial packet, if any, to the front of the buffer
+    if (pos > 0) {
+        conn->rx_len -= pos;
+        memmove(conn->rx_buf, conn->rx_buf + pos, conn->rx_len);
+    }
+    //give memory of an oversized packet back once it was consumed
+    size_t buffer_size = loop->broker->config.buffer_size;
+    if (conn->rx_len == 0 && conn->rx_cap > buffer_size) {
+        uint8_t *shrunk = realloc(conn->rx_buf, buffer_size);
+        if (shrunk) {
+            conn->rx_buf = shrunk;
+            conn->rx_cap = buffer_size;
+        }
+    }
+    return 0;
+}
+
+//drains a readable socket, edge-triggered so it must read until EAGAIN
+static void handle_readable(event_loop *loop, connection *conn) {
+    if (!conn->rx_buf) {
+        conn->rx_buf = malloc(loop->broker->config.buffer_size);
+        if (!conn->rx_buf) {
+            perror("Failed to allocate receive buffer");
+            close_connection(loop, conn);
+            return;
+        }
+        conn->rx_cap = loop->broker->config.buffer_size;
+    }
+
+    while (1) {
+        ssize_t valread = read(conn->conn_fd, conn->rx_buf + conn->rx_len, conn->rx_cap - conn->rx_len);
+        if (valread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return; //drained, wait for next edge
+            }
+        }
+        if (valread <= 0) {
+            LOG_INFO("Client disconnected: conn_fd: %d | forcing connection close", conn->conn_fd);
+            close_connection(loop, conn);
+            return;
+        }
+        conn->rx_len += valread;
+        conn->last_rx_ms = loop->broker->now_ms; //the idle timer looks at it when it fires
+        METRIC_ADD(bytes_in, valread);
+
+        //every complete packet of this read is processed in one pass
+        if (decode_frames(loop, conn) == MQTT_PCK_CLOSE) {
+            close_connection(loop, conn);
+            return;
+        }
+        if (conn->adopting) {
+            return; //reading resumes once the session arrives
+        }
+    }
+}
+
+//finishes a CONNECT whose session another shard handed over, then catches up on the paused input
+static void adopt_session(event_loop *loop, shard_msg *msg) {
+    broker_ctx *broker = loop->broker;
+    session *current_session = msg->session;
+    connection *conn = broker->connections[msg->conn_fd];
+    shard_msg_free(msg);
+
+    //connection closed while waiting, the session stays here offline
+    if (conn == NULL || conn->adopting != current_session) {
+        return;
+    }
+    conn->adopting = NULL;
+
+    //a newer CONNECT on another shard took the session on before this one got to use it
+    if (atomic_load_explicit(&current_session->shard, memory_order_acquire) != broker->shard_id) {
+        LOG_INFO("Session taken over before adoption || closing conn_fd: %d", conn->conn_fd);
+        close_connection(loop, conn);
+        return;
+    }
+    if (connect_complete(conn, current_session, conn->connect_keepalive, conn->connect_return_code, 1, broker) < 0) {
+        LOG_ERROR("MQTT Process Error");
+    }
+
+    //packets buffered behind CONNECT, then whatever reached the socket (its edge was consumed while paused)
+    if (decode_frames(loop, conn) == MQTT_PCK_CLOSE) {
+        close_connection(loop, conn);
+        return;
+    }
+    if (!conn->adopting && loop->ring.fd < 0) { //io_uring kept receiving into rx_buf meanwhile
+        handle_readable(loop, conn);
+    }
+}
+
+//handles every message other shards queued for this one, in arrival order
+static void drain_inbox(event_loop *loop) {
+    shard_node *node = shard_queue_take(&loop->broker->inbox);
+    while (node) {
+        shard_msg *msg = (shard_msg *)node;
+        node = node->next;
+        if (msg->type == SHARD_MSG_ADOPT) {
+            adopt_session(loop, msg);
+        }
+        else {
+            shard_handle_message(msg, loop->broker);
+        }
+    }
+}
+
+//arms or disarms EPOLLOUT for a connection whose socket filled up
+static int set_writable_interest(event_loop *loop, connection *conn, int enable) {
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (enable ? EPOLLOUT : 0);
+    ev.data.fd = conn->conn_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->conn_fd, &ev) < 0) {
+        perror("epoll_ctl failed to update client socket");
+        return -1;
+    }
+    conn->tx_blocked = enable;
+    return 0;
+}
+
+//writes queued output of a connection, waiting for EPOLLOUT when the socket is full
+static void flush_connection(event_loop *loop, connection *conn) {
+    int ret = tx_flush(loop->broker, conn);
+    if (ret < 0) {
+        close_connection(loop, conn);
+        return;
+    }
+    if ((ret == 1) != conn->tx_blocked) {
+        if (set_writable_interest(loop, conn, ret == 1) < 0) {
+            close_connection(loop, conn);
+        }
+    }
+}
+
+//flushes every connection that queued output during the batch, one writev each
+static void flush_dirty(event_loop *loop) {
+    broker_ctx *broker = loop->broker;
+    for (int i = 0; i < broker->dirty_count; i++) {
+        connection *conn = broker->connections[broker->dirty_fds[i]];
+        if (conn == NULL || !conn->tx_dirty) { //closed in this batch
+            continue;
+        }
+        conn->tx_dirty = 0;
+        if (!conn->tx_blocked) { //blocked connections wait for EPOLLOUT instead
+            flush_connection(loop, conn);
+        }
+    }
+    broker->dirty_count = 0;
+}
+
+//SIGUSR1 dumps send statistics
+static void report_stats(event_loop *loop) {
+    if (loop->stats_seen == stats_requested) {
+        return;
+    }
+    loop->stats_seen = stats_requested;
+    broker_ctx *broker = loop->broker;
+    LOG_INFO("Shard %d sent %llu packets in %llu writes (%.2f packets per syscall)", broker->shard_id,
+           (unsigned long long)broker->tx_packets, (unsigned long long)broker->tx_writes,
+           broker->tx_writes ? (double)broker->tx_packets / broker->tx_writes : 0.0);
+    if (loop->ring.fd >= 0) {
+        LOG_INFO("Shard %d entered io_uring %llu times", broker->shard_id, (unsigned long long)loop->ring.enters);
+    }
+}
+
+//end of every iteration: timers, retained replay, group commit, returns whether the replay can continue right away
+static int finish_batch(event_loop *loop) {
+    timer_wheel_advance(&loop->broker->timers, monotonic_ms());
+
+    //a batch of retained messages per new subscription, long replays share the loop with every other connection
+    int replay_busy = retained_replay_run(loop->broker);
+
+    //what the batch logged is made durable before any PUBACK or SUBACK for it leaves (group commit)
+    persist_commit(&loop->broker->log);
+    return replay_busy;
+}
+
+//epoll backend: readiness events, then read and writev per connection
+static int epoll_loop_run(event_loop *loop) {
+    struct epoll_event events[MAX_EVENTS];
+    int replay_busy = 0; //retained messages left to send on connections that can take more
+
+    while (1) {
+        report_stats(loop);
+
+        //sleep until a socket is ready or the next retransmission deadline, only poll while a retained replay is running
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, replay_busy ? 0 : timer_wheel_timeout(&loop->broker->timers));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            return -1;
+        }
+        loop->broker->now_ms = monotonic_ms();
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == loop->server_fd) {
+                accept_connections(loop);
+                continue;
+            }
+            if (fd == loop->stats_fd) {
+                metrics_socket_serve(fd, loop->broker);
+                continue;
+            }
+            if (fd == loop->broker->inbox.wake_fd) {
+                drain_inbox(loop);
+                continue;
+            }
+
+            connection *conn = loop->broker->connections[fd];
+            if (conn == NULL) { //closed earlier in this batch
+                continue;
+            }
+            if ((events[i].events & EPOLLERR) && conn->zc_head) {
+                zerocopy_complete(conn); //error queue holds MSG_ZEROCOPY completions
+            }
+            if ((events[i].events & EPOLLOUT) && conn->tx_blocked) {
+                flush_connection(loop, conn); //socket drained, continue the queued output
+                conn = loop->broker->connections[fd];
+                if (conn == NULL) {
+                    continue;
+                }
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                handle_readable(loop, conn); //read returns 0 or error on hang up, which closes the connection
+            }
+        }
+
+        replay_busy = finish_batch(loop);
+
+        //everything queued by this batch and its timers goes out now, coalesced per connection
+        flush_dirty(loop);
+    }
+    return 0;
+}
+
+//=============================================================//
+//io_uring backend: the listener, the inbox and every socket have a multishot request that keeps completing, reads
+//land in provided buffers and are copied into rx_buf, and the sends of a batch go out with one io_uring_enter
+
+//multishot recv into the provided buffers, completes per chunk until the socket closes or the buffers run out
+static int uring_arm_recv(event_loop *loop, connection *conn) {
+    struct io_uring_sqe *sqe = uring_sqe(&loop->ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->conn_fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = URING_DATA(URING_OP_RECV, conn->conn_fd, conn->ring_gen);
+    return 0;
+}
+
+//multishot accept on the shard's listener
+static int uring_arm_accept(event_loop *loop) {
+    struct io_uring_sqe *sqe = uring_sqe(&loop->ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->server_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_DATA(URING_OP_ACCEPT, loop->server_fd, 0);
+    return 0;
+}
+
+//poll of an fd, multishot for the inbox and stats sockets, once for a full client socket
+static int uring_arm_poll(event_loop *loop, int fd, int op, uint32_t events, uint32_t gen, int multishot) {
+    struct io_uring_sqe *sqe = uring_sqe(&loop->ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = URING_DATA(op, fd, gen);
+    return 0;
+}
+
+//connection a completion belongs to, NULL when it was closed since (its fd may be reused by a newer connection)
+static connection *uring_connection(event_loop *loop, int fd, uint32_t gen) {
+    connection *conn = loop->broker->connections[fd];
+    return (conn && conn->ring_gen == gen) ? conn : NULL;
+}
+
+//appends received bytes to the receive buffer, growing it as needed
+static int rx_append(event_loop *loop, connection *conn, const uint8_t *data, size_t len) {
+    if (conn->rx_len + len > conn->rx_cap) {
+        size_t new_cap = conn->rx_cap ? conn->rx_cap : loop->broker->config.buffer_size;
+        while (new_cap < conn->rx_len + len) {
+            new_cap *= 2;
+        }
+        uint8_t *grown = realloc(conn->rx_buf, new_cap);
+        if (!grown) {
+            perror("Failed to grow receive buffer");
+            return -1;
+        }
+        conn->rx_buf = grown;
+        conn->rx_cap = new_cap;
+    }
+    memcpy(conn->rx_buf + conn->rx_len, data, len);
+    conn->rx_len += len;
+    return 0;
+}
+
+//data, end of stream or error of a multishot recv
+static void uring_handle_recv(event_loop *loop, const struct io_uring_cqe *cqe, connection *conn) {
+    broker_ctx *broker = loop->broker;
+    int failed = 0;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (conn && cqe->res > 0) {
+            failed = rx_append(loop, conn, uring_buffer(&loop->ring, buffer_id), cqe->res) < 0;
+        }
+        uring_buffer_return(&loop->ring, buffer_id);
+    }
+    if (conn == NULL) {
+        return;
+    }
+    if (cqe->res == -ENOBUFS) { //every buffer was in use, received data waits in the socket
+        if (uring_arm_recv(loop, conn) < 0) {
+            close_connection(loop, conn);
+        }
+        return;
+    }
+    if (cqe->res <= 0 || failed) {
+        LOG_INFO("Client disconnected: conn_fd: %d | forcing connection close", conn->conn_fd);
+        close_connection(loop, conn);
+        return;
+    }
+    conn->last_rx_ms = broker->now_ms; //the idle timer looks at it when it fires
+    METRIC_ADD(bytes_in, cqe->res);
+
+    //while adopting, the bytes stay buffered until the session arrives
+    int fd = conn->conn_fd;
+    if (!conn->adopting && decode_frames(loop, conn) == MQTT_PCK_CLOSE) {
+        close_connection(loop, conn);
+        return;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE) && broker->connections[fd] == conn && uring_arm_recv(loop, conn) < 0) {
+        close_connection(loop, conn);
+    }
+}
+
+//result of a sendmsg: bytes the socket took, or full (wait for POLLOUT), or a failed connection
+static void uring_handle_send(event_loop *loop, const struct io_uring_cqe *cqe, connection *conn) {
+    loop->sends_inflight--;
+    if (conn == NULL) {
+        return;
+    }
+    if (cqe->res >= 0) {
+        tx_sent(loop->broker, conn, cqe->res);
+        if (conn->tx_count > 0) {
+            tx_mark_dirty(loop->broker, conn); //short send or more than URING_SEND_IOV segments, another round follows
+        }
+        return;
+    }
+    if (cqe->res == -EAGAIN || cqe->res == -EINTR) {
+        tx_compact(conn);
+        if (uring_arm_poll(loop, conn->conn_fd, URING_OP_WRITABLE, POLLOUT, conn->ring_gen, 0) < 0) {
+            close_connection(loop, conn);
+            return;
+        }
+        conn->tx_blocked = 1;
+        return;
+    }
+    errno = -cqe->res;
+    perror("Failed to send packets");
+    close_connection(loop, conn);
+}
+
+//handles one completion
+static void uring_dispatch(event_loop *loop, const struct io_uring_cqe *cqe) {
+    int op = cqe->user_data & 0xF;
+    int fd = (cqe->user_data >> 4) & 0xFFFFFFF;
+    uint32_t gen = cqe->user_data >> 32;
+    int more = cqe->flags & IORING_CQE_F_MORE;
+
+    switch (op) {
+    case URING_OP_ACCEPT:
+        if (cqe->res >= 0) {
+            connection_open(loop, cqe->res);
+        }
+        else if (cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+            errno = -cqe->res;
+            perror("Connection accept error");
+        }
+        if (!more && uring_arm_accept(loop) < 0) {
+            LOG_ERROR("Failed to re-arm accept || shard: %d", loop->broker->shard_id);
+        }
+        break;
+    case URING_OP_RECV:
+        uring_handle_recv(loop, cqe, uring_connection(loop, fd, gen));
+        break;
+    case URING_OP_SEND:
+        uring_handle_send(loop, cqe, uring_connection(loop, fd, gen));
+        break;
+    case URING_OP_WRITABLE: {
+        connection *conn = uring_connection(loop, fd, gen);
+        if (conn && conn->tx_blocked) { //socket drained, the queued output goes out with this batch
+            conn->tx_blocked = 0;
+            tx_mark_dirty(loop->broker, conn);
+        }
+        break;
+    }
+    case URING_OP_INBOX:
+    case URING_OP_STATS:
+        if (op == URING_OP_INBOX) {
+            drain_inbox(loop);
+        }
+        else {
+            metrics_socket_serve(fd, loop->broker);
+        }
+        if (!more && uring_arm_poll(loop, fd, op, POLLIN, 0, 1) < 0) {
+            LOG_ERROR("Failed to re-arm poll || fd: %d", fd);
+        }
+        break;
+    }
+}
+
+//keeps a completion reaped while waiting for sends for the next iteration, so nothing it queues skips the group commit
+static void uring_defer(event_loop *loop, const struct io_uring_cqe *cqe) {
+    if (loop->deferred_count == loop->deferred_cap) {
+        int new_cap = loop->deferred_cap ? loop->deferred_cap * 2 : 256;
+        struct io_uring_cqe *grown = realloc(loop->deferred, new_cap * sizeof(struct io_uring_cqe));
+        if (!grown) {
+            perror("Failed to grow deferred completions");
+            uring_dispatch(loop, cqe); //handled now rather than lost
+            return;
+        }
+        loop->deferred = grown;
+        loop->deferred_cap = new_cap;
+    }
+    loop->deferred[loop->deferred_count++] = *cqe;
+}
+
+//flushes every connection that queued output during the batch, one sendmsg each and one io_uring_enter per
+//URING_SEND_BATCH connections, MSG_DONTWAIT makes each complete right away, short sends go another round
+static void uring_flush_dirty(event_loop *loop) {
+    broker_ctx *broker = loop->broker;
+    int next = 0;
+    while (next < broker->dirty_count) {
+        int batch = 0;
+        while (next < broker->dirty_count && batch < URING_SEND_BATCH) {
+            connection *conn = broker->connections[broker->dirty_fds[next++]];
+            if (conn == NULL || !conn->tx_dirty) { //closed in this batch
+                continue;
+            }
+            conn->tx_dirty = 0;
+            if (conn->tx_blocked || conn->tx_count == 0) { //blocked connections wait for their poll instead
+                continue;
+            }
+            struct msghdr *msg = &loop->send_msgs[batch];
+            memset(msg, 0, sizeof(*msg));
+            msg->msg_iov = loop->send_iov + batch * URING_SEND_IOV;
+            msg->msg_iovlen = tx_prepare(conn, msg->msg_iov, URING_SEND_IOV);
+
+            struct io_uring_sqe *sqe = uring_sqe(&loop->ring);
+            if (!sqe) {
+                close_connection(loop, conn);
+                continue;
+            }
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = conn->conn_fd;
+            sqe->addr = (uint64_t)(uintptr_t)msg;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+            sqe->user_data = URING_DATA(URING_OP_SEND, conn->conn_fd, conn->ring_gen);
+            loop->sends_inflight++;
+            batch++;
+        }
+
+        //the messages and iovecs are reused by the next batch, so every send of this one completes first
+        while (loop->sends_inflight > 0) {
+            if (uring_submit(&loop->ring, -1) < 0) {
+                break;
+            }
+            struct io_uring_cqe *cqe;
+            while ((cqe = uring_peek(&loop->ring)) != NULL) {
+                struct io_uring_cqe completion = *cqe;
+                uring_advance(&loop->ring);
+                if ((completion.user_data & 0xF) == URING_OP_SEND) {
+                    uring_dispatch(loop, &completion);
+                }
+                else {
+                    uring_defer(loop, &completion);
+                }
+            }
+        }
+    }
+    broker->dirty_count = 0;
+}
+
+//switches the loop to io_uring, on the shard's own thread since the ring only takes submissions from its creator
+static int uring_loop_start(event_loop *loop) {
+    if (uring_init(&loop->ring) < 0) {
+        return -1;
+    }
+    loop->send_msgs = calloc(URING_SEND_BATCH, sizeof(struct msghdr));
+    loop->send_iov = calloc(URING_SEND_BATCH * URING_SEND_IOV, sizeof(struct iovec));
+    if (!loop->send_msgs || !loop->send_iov) {
+        perror("Failed to allocate send batch");
+    }
+    else if (uring_arm_accept(loop) == 0 && uring_arm_poll(loop, loop->broker->inbox.wake_fd, URING_OP_INBOX, POLLIN, 0, 1) == 0 &&
+             (loop->stats_fd < 0 || uring_arm_poll(loop, loop->stats_fd, URING_OP_STATS, POLLIN, 0, 1) == 0) &&
+             uring_submit(&loop->ring, 0) == 0) {
+        close(loop->epoll_fd);
+        loop->epoll_fd = -1;
+        LOG_INFO("Shard %d uses io_uring || %d entries, %d receive buffers of %d bytes", loop->broker->shard_id,
+                 URING_ENTRIES, URING_BUFFERS, URING_BUF_SIZE);
+        return 0;
+    }
+    free(loop->send_msgs);
+    free(loop->send_iov);
+    loop->send_msgs = NULL;
+    loop->send_iov = NULL;
+    uring_free(&loop->ring);
+    return -1;
+}
+
+//io_uring backend: one io_uring_enter submits the previous batch's requests and waits for completions
+static int uring_loop_run(event_loop *loop) {
+    broker_ctx *broker = loop->broker;
+    int replay_busy = 0;
+
+    while (1) {
+        report_stats(loop);
+
+        //completions deferred by the last flush are handled without waiting
+        int wait_ms = (replay_busy || loop->deferred_count > 0) ? 0 : timer_wheel_timeout(&broker->timers);
+        if (uring_submit(&loop->ring, wait_ms) < 0) {
+            return -1;
+        }
+        broker->now_ms = monotonic_ms();
+
+        for (int i = 0; i < loop->deferred_count; i++) {
+            uring_dispatch(loop, &loop->deferred[i]);
+        }
+        loop->deferred_count = 0;
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(&loop->ring)) != NULL) {
+            struct io_uring_cqe completion = *cqe; //consumed first, handling it may submit and reap
+            uring_advance(&loop->ring);
+            uring_dispatch(loop, &completion);
+        }
+
+        replay_busy = finish_batch(loop);
+        uring_flush_dirty(loop);
+    }
+    return 0;
+}
+
+//event loop, accepts connections and dispatches readable sockets into mqtt_process_pck
+int event_loop_run(event_loop *loop) {
+    if (loop->broker->config.io_backend == IO_BACKEND_URING) {
+        if (uring_loop_start(loop) == 0) {
+            return uring_loop_run(loop);
+        }
+        LOG_WARN("io_uring unavailable || shard %d falls back to epoll", loop->broker->shard_id);
+    }
+    return epoll_loop_run(loop);
+}
@@ -0,0 +1,428 @@
+#include "broker.h"
+
+#include <stdarg.h>
+#include <stdatomic.h>
+
+#define LOG_OUT_SIZE 65536          //writer thread output buffer, written with one write() per drain
+#define LOG_IDLE_MAX_MS 100         //longest writer sleep while every ring is empty
+
+int log_runtime_level = LOG_LEVEL_INFO;
+
+//raw argument, formatted later by the writer thread
+typedef union {
+    int64_t i;
+    uint64_t u;
+    double d;
+    const void *p;
+    uint32_t string_offset;        //%s arguments are copied into the record's strings
+} log_arg;
+
+//fixed-size record, the format pointer stays valid because formats are string literals
+typedef struct {
+    uint64_t timestamp_ns;         //CLOCK_REALTIME
+    const char *fmt;
+    uint8_t level;
+    uint8_t arg_count;
+    uint16_t string_len;           //used bytes of strings
+    log_arg args[LOG_MAX_ARGS];
+    char strings[LOG_STRING_SPACE];
+} log_record;
+
+//single producer (owning thread) single consumer (writer thread) ring
+typedef struct log_ring {
+    _Atomic uint64_t head;         //next record the owner writes
+    uint64_t cached_tail;          //owner's last look at tail, saves reading the shared line on every record
+    _Atomic uint64_t dropped;      //records lost to a full ring
+    char pad[64];                  //keep the writer's tail off the owner's cache line
+    _Atomic uint64_t tail;         //next record the writer reads
+    uint64_t reported_drops;
+    struct log_ring *next;
+    log_record records[LOG_RING_SIZE];
+} log_ring;
+
+static _Atomic(log_ring *) ring_list = NULL;     //every thread that ever logged, rings are never freed
+static __thread log_ring *thread_ring = NULL;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER; //writer thread vs log_flush, never taken by producers
+
+//one printf conversion of a format string
+typedef struct {
+    const char *start;             //'%'
+    const char *end;               //one past the conversion character
+    char flags[8];
+    int width;                     //-1 when absent
+    int precision;                 //-1 when absent
+    int star_width;                //width/precision come from an int argument
+    int star_precision;
+    char length;                   //0, 'h' (h, hh), 'l', 'L' (ll, j, z, t, q) or 'D' (long double)
+    char conversion;
+} log_spec;
+
+static const char *parse_number(const char *p, int *value) {
+    *value = 0;
+    while (*p >= '0' && *p <= '9') {
+        *value = *value * 10 + (*p++ - '0');
+    }
+    return p;
+}
+
+//parses the conversion starting at p ('%'), returns 0 for "%%" and malformed specs
+static int parse_spec(const char *p, log_spec *spec) {
+    memset(spec, 0, sizeof(*spec));
+    spec->start = p++;
+    spec->width = -1;
+    spec->precision = -1;
+
+    int flag_count = 0;
+    while (*p && strchr("-+ #0'", *p)) {
+        if (flag_count < (int)sizeof(spec->flags) - 1) {
+            spec->flags[flag_count++] = *p;
+        }
+        p++;
+    }
+    if (*p == '*') {
+        spec->star_width = 1;
+        p++;
+    }
+    else if (*p >= '0' && *p <= '9') {
+        p = parse_number(p, &spec->width);
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->star_precision = 1;
+            p++;
+        }
+        else {
+            p = parse_number(p, &spec->precision);
+        }
+    }
+    switch (*p) {
+    case 'h':
+        spec->length = 'h';
+        p += (p[1] == 'h') ? 2 : 1;
+        break;
+    case 'l':
+        spec->length = (p[1] == 'l') ? 'L' : 'l';
+        p += (p[1] == 'l') ? 2 : 1;
+        break;
+    case 'j': case 'z': case 't': case 'q':
+        spec->length = 'L';
+        p++;
+        break;
+    case 'L':
+        spec->length = 'D';
+        p++;
+        break;
+    }
+    if (*p == '\0' || *p == '%') {
+        return 0;
+    }
+    spec->conversion = *p;
+    spec->end = p + 1;
+    return 1;
+}
+
+//makes the ring of the calling thread, registered once for the writer
+static log_ring *ring_create(void) {
+    log_ring *ring = calloc(1, sizeof(log_ring));
+    if (!ring) {
+        return NULL;
+    }
+    ring->next = atomic_load(&ring_list);
+    while (!atomic_compare_exchange_weak(&ring_list, &ring->next, ring)) {
+    }
+    return ring;
+}
+
+//copies a %s argument into the record, bounded by the precision and the space left
+static uint32_t record_string(log_record *record, const char *text, int precision) {
+    uint32_t offset = record->string_len;
+    if (!text) {
+        text = "(null)";
+    }
+    size_t room = LOG_STRING_SPACE - offset;
+    if (room == 0) {
+        return LOG_STRING_SPACE - 1; //points at the last string's terminator, prints empty
+    }
+    size_t limit = room - 1;
+    if (precision >= 0 && (size_t)precision < limit) {
+        limit = precision;
+    }
+    size_t len = strnlen(text, limit);
+    memcpy(record->strings + offset, text, len);
+    record->strings[offset + len] = '\0';
+    record->string_len += len + 1;
+    return offset;
+}
+
+//records one line, format must be a string literal (only its pointer is kept), no trailing newline needed
+void log_write(int level, const char *fmt, ...) {
+    log_ring *ring = thread_ring;
+    if (!ring) {
+        ring = thread_ring = ring_create();
+        if (!ring) {
+            return;
+        }
+    }
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - ring->cached_tail >= LOG_RING_SIZE) {
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->cached_tail >= LOG_RING_SIZE) {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return; //never wait on the writer
+        }
+    }
+
+    log_record *record = &ring->records[head & (LOG_RING_SIZE - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record->timestamp_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    record->fmt = fmt;
+    record->level = level;
+    record->arg_count = 0;
+    record->string_len = 0;
+
+    //only the raw arguments are captured, the writer thread does the formatting
+    va_list ap;
+    va_start(ap, fmt);
+    log_spec spec;
+    for (const char *p = strchr(fmt, '%'); p && record->arg_count < LOG_MAX_ARGS; p = strchr(p, '%')) {
+        if (!parse_spec(p, &spec)) {
+            p += (p[1] == '%') ? 2 : 1;
+            continue;
+        }
+        p = spec.end;
+        if (spec.star_width) {
+            record->args[record->arg_count++].i = va_arg(ap, int);
+        }
+        int precision = spec.precision;
+        if (spec.star_precision && record->arg_count < LOG_MAX_ARGS) {
+            precision = va_arg(ap, int);
+            record->args[record->arg_count++].i = precision;
+        }
+        if (record->arg_count == LOG_MAX_ARGS) {
+            break;
+        }
+
+        log_arg *arg = &record->args[record->arg_count++];
+        switch (spec.conversion) {
+        case 'd': case 'i':
+            arg->i = spec.length == 'L' ? va_arg(ap, long long) : spec.length == 'l' ? va_arg(ap, long) : va_arg(ap, int);
+            break;
+        case 'u': case 'x': case 'X': case 'o':
+            arg->u = spec.length == 'L' ? va_arg(ap, unsigned long long) : spec.length == 'l' ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+            break;
+        case 'c':
+            arg->i = va_arg(ap, int);
+            break;
+        case 's':
+            arg->string_offset = record_string(record, va_arg(ap, const char *), precision);
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            arg->d = spec.length == 'D' ? (double)va_arg(ap, long double) : va_arg(ap, double);
+            break;
+        default: //%p and anything else pointer sized
+            arg->p = va_arg(ap, const void *);
+            break;
+        }
+    }
+    va_end(ap);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+//appends printf-style output to the writer buffer, truncating at its end
+static void out_printf(char *out, size_t *out_len, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+static void out_printf(char *out, size_t *out_len, const char *fmt, ...) {
+    size_t room = LOG_OUT_SIZE - *out_len;
+    va_list ap;
+    va_start(ap, fmt);
+    int written = vsnprintf(out + *out_len, room, fmt, ap);
+    va_end(ap);
+    if (written > 0) {
+        *out_len += ((size_t)written < room) ? (size_t)written : room - 1;
+    }
+}
+
+static void out_write(char *out, size_t *out_len) {
+    size_t done = 0;
+    while (done < *out_len) {
+        ssize_t written = write(STDOUT_FILENO, out + done, *out_len - done);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break; //nowhere to report it
+        }
+        done += written;
+    }
+    *out_len = 0;
+}
+
+//formats one record as a line, conversions are rebuilt one at a time with their captured argument
+static void format_record(log_record *record, char *out, size_t *out_len) {
+    static const char *level_names[] = {"ERROR", "WARN ", "INFO ", "DEBUG"};
+    static time_t cached_second = -1;
+    static char cached_clock[16];
+
+    time_t second = record->timestamp_ns / 1000000000ull;
+    if (second != cached_second) {
+        struct tm tm;
+        localtime_r(&second, &tm);
+        strftime(cached_clock, sizeof(cached_clock), "%H:%M:%S", &tm);
+        cached_second = second;
+    }
+    out_printf(out, out_len, "%s.%06u %s ", cached_clock, (unsigned)(record->timestamp_ns % 1000000000ull / 1000), level_names[record->level & 3]);
+
+    int next_arg = 0;
+    const char *p = record->fmt;
+    while (*p) {
+        const char *percent = strchr(p, '%');
+        if (!percent) {
+            percent = p + strlen(p);
+        }
+        if (percent > p) {
+            out_printf(out, out_len, "%.*s", (int)(percent - p), p);
+        }
+        if (*percent == '\0') {
+            break;
+        }
+
+        log_spec spec;
+        if (!parse_spec(percent, &spec)) {
+            if (percent[1] == '%') {
+                out_printf(out, out_len, "%%");
+                p = percent + 2;
+            }
+            else {
+                p = percent + 1;
+            }
+            continue;
+        }
+        p = spec.end;
+
+        int width = spec.width;
+        int precision = spec.precision;
+        if (spec.star_width) {
+            width = next_arg < record->arg_count ? (int)record->args[next_arg++].i : -1;
+        }
+        if (spec.star_precision) {
+            precision = next_arg < record->arg_count ? (int)record->args[next_arg++].i : -1;
+        }
+        if (next_arg >= record->arg_count) {
+            out_printf(out, out_len, "?");
+            continue;
+        }
+        log_arg *arg = &record->args[next_arg++];
+
+        //single conversion with the captured value, integers widened to long long
+        char single[48];
+        int n = snprintf(single, sizeof(single), "%%%s", spec.flags);
+        if (width >= 0) {
+            n += snprintf(single + n, sizeof(single) - n, "%d", width);
+        }
+        if (precision >= 0) {
+            n += snprintf(single + n, sizeof(single) - n, ".%d", precision);
+        }
+        switch (spec.conversion) {
+        case 'd': case 'i':
+            snprintf(single + n, sizeof(single) - n, "ll%c", spec.conversion);
+            out_printf(out, out_len, single, (long long)arg->i);
+            break;
+        case 'u': case 'x': case 'X': case 'o':
+            snprintf(single + n, sizeof(single) - n, "ll%c", spec.conversion);
+            out_printf(out, out_len, single, (unsigned long long)arg->u);
+            break;
+        case 'c':
+            snprintf(single + n, sizeof(single) - n, "c");
+            out_printf(out, out_len, single, (int)arg->i);
+            break;
+        case 's':
+            snprintf(single + n, sizeof(single) - n, "s");
+            out_printf(out, out_len, single, record->strings + arg->string_offset);
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            snprintf(single + n, sizeof(single) - n, "%c", spec.conversion);
+            out_printf(out, out_len, single, arg->d);
+            break;
+        default:
+            out_printf(out, out_len, "%p", arg->p);
+            break;
+        }
+    }
+
+    //one record is one line, formats may still carry the old trailing newline
+    if (*out_len > 0 && out[*out_len - 1] == '\n') {
+        (*out_len)--;
+    }
+    out_printf(out, out_len, "\n");
+}
+
+//formats and writes every pending record of every ring, returns how many were written
+static int drain_rings(void) {
+    static char out[LOG_OUT_SIZE];
+    size_t out_len = 0;
+    int drained = 0;
+
+    pthread_mutex_lock(&drain_lock);
+    for (log_ring *ring = atomic_load(&ring_list); ring; ring = ring->next) {
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while (tail != head) {
+            if (out_len > LOG_OUT_SIZE - 1024) { //room for a full record line
+                out_write(out, &out_len);
+            }
+            format_record(&ring->records[tail & (LOG_RING_SIZE - 1)], out, &out_len);
+            tail++;
+            drained++;
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        }
+
+        uint64_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        if (dropped != ring->reported_drops) {
+            out_printf(out, &out_len, "log: %llu records dropped, ring full\n", (unsigned long long)(dropped - ring->reported_drops));
+            ring->reported_drops = dropped;
+        }
+    }
+    out_write(out, &out_len);
+    pthread_mutex_unlock(&drain_lock);
+    return drained;
+}
+
+//background writer, backs off while idle so an idle broker stays asleep
+static void *log_thread(void *arg) {
+    (void)arg;
+    int idle_ms = 1;
+    while (1) {
+        if (drain_rings() > 0) {
+            idle_ms = 1;
+            continue;
+        }
+        struct timespec ts = {0, idle_ms * 1000000L};
+        nanosleep(&ts, NULL);
+        if (idle_ms < LOG_IDLE_MAX_MS) {
+            idle_ms *= 2;
+        }
+    }
+    return NULL;
+}
+
+//starts the background writer thread
+int log_init(int level) {
+    log_runtime_level = level;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, log_thread, NULL) != 0) {
+        perror("Failed to start logger thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    atexit(log_flush); //records of a failing startup still get written
+    return 0;
+}
+
+//writes every pending record, used before exiting
+void log_flush(void) {
+    drain_rings();
+}
@@ -0,0 +1,45 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//=============================================================//
+//asynchronous logger: callers copy the format pointer and raw arguments into a fixed-size record of their
+//thread's lock-free ring, a background thread formats and writes them, so nothing on the hot path touches stdio
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+//levels above this are compiled out (make CFLAGS="-DLOG_COMPILE_LEVEL=LOG_LEVEL_INFO")
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_RING_SIZE 4096           //records per thread, power of two, a full ring drops records
+#define LOG_MAX_ARGS 8               //conversions per format, extra ones print as "?"
+#define LOG_STRING_SPACE 176         //bytes for copied %s arguments per record, longer strings are truncated
+
+extern int log_runtime_level;       //records above this level are skipped at the call site
+
+//records one line, format must be a string literal (only its pointer is kept), no trailing newline needed
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+//starts the background writer thread
+int log_init(int level);
+//writes every pending record, used before exiting
+void log_flush(void);
+
+#define LOG_AT(level, ...) do { \
+        if ((level) <= LOG_COMPILE_LEVEL && (level) <= log_runtime_level) { \
+            log_write((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#endif // LOG_H
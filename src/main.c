@@ -1,65 +1,103 @@
 #include "broker.h"
 
-int main() {
-    int server_fd;
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
-    session running_sessions[MAX_CLIENTS] = {0};
+#include <sched.h>
 
-    if (create_tcpserver(&server_fd, &address, &addrlen) < 0) {
+//one event loop per shard, shard 0 runs on the main thread
+typedef struct {
+    broker_ctx broker;
+    event_loop loop;
+    pthread_t thread;
+} shard;
+
+//pins the calling thread to the index-th CPU the process may run on
+static void pin_to_cpu(int index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity failed");
+        return;
+    }
+    int count = CPU_COUNT(&allowed);
+    int target = index % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+                LOG_WARN("Failed to pin shard %d to CPU %d", index, cpu);
+            }
+            return;
+        }
+    }
+}
+
+static void *shard_run(void *arg) {
+    shard *current = (shard *)arg;
+    pin_to_cpu(current->broker.shard_id);
+    if (event_loop_run(&current->loop) < 0) {
         exit(EXIT_FAILURE);
     }
+    return NULL;
+}
 
-    //allocate memory for queue thread data
-    thread_data *t_q_data = (thread_data *)malloc(sizeof(thread_data)); //memory size, then cast to needed type
-    if (!t_q_data) {
-        perror("Malloc failed");
+int main(int argc, char **argv) {
+    //limits from the compiled-in defaults, then config file and flags in the order given
+    broker_config config;
+    config_defaults(&config);
+    if (config_parse_args(&config, argc, argv) < 0) {
         exit(EXIT_FAILURE);
     }
 
-    t_q_data->conn_fd = 0;
-    t_q_data->running_sessions = running_sessions;
+    //formatting and writing of log lines happens on a background thread
+    if (log_init(config.log_level) < 0) {
+        exit(EXIT_FAILURE);
+    }
 
-    //create a new thread for the client
-    pthread_t queue_thread;
-    if (pthread_create(&queue_thread, NULL, queue_handler, (void *)t_q_data) != 0) { //cast to void type
-        perror("Queue Handling Thread creation failed\n");
-        free(t_q_data);
+    broker_shared shared;
+    if (broker_shared_init(&shared, &config) < 0) {
         exit(EXIT_FAILURE);
     }
 
-    
+    signal(SIGPIPE, SIG_IGN); //a peer closing mid-send must not kill the broker
 
-    while (1) {
-        int conn_fd = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen);
-        if (conn_fd < 0) {
-            perror("Connection accept error");
-            continue;
+    //every shard owns a listening socket on the port (SO_REUSEPORT) and the connections it accepts
+    shard *shards = calloc(config.threads, sizeof(shard));
+    if (!shards) {
+        perror("Failed to allocate shards");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < config.threads; i++) {
+        int server_fd;
+        struct sockaddr_in address;
+        int addrlen = sizeof(address);
+        if (broker_init(&shards[i].broker, &shared, i) < 0) {
+            exit(EXIT_FAILURE);
         }
-        printf("New connection: conn_fd = %d\n", conn_fd);
-
-        //allocate memory for thread data
-        thread_data *t_data = (thread_data *)malloc(sizeof(thread_data)); //memory size, then cast to needed type
-        if (!t_data) {
-            perror("Malloc failed");
-            close(conn_fd);
-            continue;
+        if (create_tcpserver(&server_fd, &address, &addrlen, &config) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        if (event_loop_init(&shards[i].loop, server_fd, &shards[i].broker) < 0) {
+            exit(EXIT_FAILURE);
         }
+    }
 
-        t_data->conn_fd = conn_fd;
-        t_data->running_sessions = running_sessions;
+    //sessions, subscriptions and queued messages of the previous run, before any client connects
+    if (broker_recover(&shards[0].broker) < 0) {
+        exit(EXIT_FAILURE);
+    }
 
-        //create a new thread for the client
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, client_handler, (void *)t_data) != 0) { //cast to void type
-            perror("Thread creation failed");
-            free(t_data);
-            close(conn_fd);
-            continue;
+    //a single shard keeps the classic one-thread broker, unpinned
+    for (int i = 1; i < config.threads; i++) {
+        if (pthread_create(&shards[i].thread, NULL, shard_run, &shards[i]) != 0) {
+            perror("Failed to start shard thread");
+            exit(EXIT_FAILURE);
         }
-
-        // Detach the thread so it cleans up automatically when done
-        pthread_detach(thread_id);
+    }
+    if (config.threads > 1) {
+        pin_to_cpu(0);
+    }
+    if (event_loop_run(&shards[0].loop) < 0) {
+        exit(EXIT_FAILURE);
     }
 
     return 0;
@@ -0,0 +1,251 @@
+#include "broker.h"
+
+#include <sys/un.h>
+
+#define METRICS_TEXT_SIZE 16384     //Prometheus text of one scrape
+
+__thread broker_metrics *thread_metrics = NULL;
+static _Atomic(broker_metrics *) metrics_list = NULL;  //every thread that ever counted, blocks are never freed
+
+static const char *packet_type_names[16] = {
+    "reserved", "connect", "connack", "publish", "puback", "pubrec", "pubrel", "pubcomp",
+    "subscribe", "suback", "unsubscribe", "unsuback", "pingreq", "pingresp", "disconnect", "auth"
+};
+
+//block of the calling thread, registered on first use
+broker_metrics *metrics_register(void) {
+    broker_metrics *metrics = aligned_alloc(64, sizeof(broker_metrics));
+    if (!metrics) {
+        return NULL;
+    }
+    memset(metrics, 0, sizeof(broker_metrics));
+    metrics->next = atomic_load(&metrics_list);
+    while (!atomic_compare_exchange_weak(&metrics_list, &metrics->next, metrics)) {
+    }
+    thread_metrics = metrics;
+    return metrics;
+}
+
+#define SUM(field) atomic_store_explicit(&total->field, atomic_load_explicit(&total->field, memory_order_relaxed) + \
+                                         atomic_load_explicit(&metrics->field, memory_order_relaxed), memory_order_relaxed)
+
+//sum of every thread's block
+void metrics_collect(broker_metrics *total) {
+    memset(total, 0, sizeof(broker_metrics));
+    for (broker_metrics *metrics = atomic_load(&metrics_list); metrics; metrics = metrics->next) {
+        for (int type = 0; type < 16; type++) {
+            SUM(packets_in[type]);
+            SUM(packets_out[type]);
+        }
+        SUM(bytes_in);
+        SUM(bytes_out);
+        SUM(publish_enqueued);
+        SUM(publish_dropped);
+        SUM(overflow_newest);
+        SUM(overflow_oldest);
+        SUM(overflow_disconnects);
+        SUM(publish_direct);
+        SUM(publish_retained);
+        SUM(retransmits);
+        SUM(connections_total);
+        SUM(connections_expired);
+        SUM(connections);
+        SUM(clients_connected);
+        SUM(inflight);
+        SUM(pending);
+    }
+}
+
+//one exported value, shared by the $SYS publisher and the Prometheus text
+typedef struct {
+    const char *name;              //Prometheus name
+    const char *help;
+    int gauge;
+    const char *label;             //label value, NULL when the metric has none
+    const char *label_name;        //"type" (packet type) unless set otherwise
+    char sys_topic[64];
+    int64_t value;
+} metric_value;
+
+#define METRICS_MAX_VALUES 64
+
+//values being gathered, metrics beyond METRICS_MAX_VALUES are left out
+typedef struct {
+    metric_value values[METRICS_MAX_VALUES];
+    int count;
+} metric_list;
+
+//appends a metric, NULL (and a warning, once) when the list is full
+static metric_value *metric_add(metric_list *list, const char *name, const char *help, int gauge, const char *label, const char *sys_topic, int64_t value) {
+    if (list->count == METRICS_MAX_VALUES) {
+        static _Atomic int warned;
+        if (!atomic_exchange(&warned, 1)) {
+            LOG_WARN("More than %d metric values, raise METRICS_MAX_VALUES || %s left out", METRICS_MAX_VALUES, name);
+        }
+        return NULL;
+    }
+    metric_value *metric = &list->values[list->count++];
+    metric->name = name;
+    metric->help = help;
+    metric->gauge = gauge;
+    metric->label = label;
+    metric->label_name = "type";
+    snprintf(metric->sys_topic, sizeof(metric->sys_topic), "$SYS/broker/%s", sys_topic);
+    metric->value = value;
+    return metric;
+}
+
+static int64_t retained_count(broker_shared *shared) {
+    pthread_rwlock_rdlock(&shared->retained_lock);
+    int64_t count = (int64_t)shared->retained.filter_count;
+    pthread_rwlock_unlock(&shared->retained_lock);
+    return count;
+}
+
+//current values of every metric
+static void metrics_values(broker_ctx *broker, metric_list *list) {
+    broker_metrics total;
+    metrics_collect(&total);
+    list->count = 0;
+    char topic[64];
+
+    for (int type = 1; type < 15; type++) {
+        snprintf(topic, sizeof(topic), "packets/received/%s", packet_type_names[type]);
+        metric_add(list, "mqtt_packets_received_total", "MQTT packets received by type", 0, packet_type_names[type], topic,
+                           atomic_load_explicit(&total.packets_in[type], memory_order_relaxed));
+    }
+    for (int type = 1; type < 15; type++) {
+        snprintf(topic, sizeof(topic), "packets/sent/%s", packet_type_names[type]);
+        metric_add(list, "mqtt_packets_sent_total", "MQTT packets sent by type", 0, packet_type_names[type], topic,
+                           atomic_load_explicit(&total.packets_out[type], memory_order_relaxed));
+    }
+    metric_add(list, "mqtt_bytes_received_total", "Bytes read from client sockets", 0, NULL, "bytes/received", total.bytes_in);
+    metric_add(list, "mqtt_bytes_sent_total", "Bytes written to client sockets", 0, NULL, "bytes/sent", total.bytes_out);
+    metric_add(list, "mqtt_publish_enqueued_total", "Forwarded PUBLISH accepted by subscriber queues", 0, NULL, "messages/enqueued", total.publish_enqueued);
+    metric_add(list, "mqtt_publish_dropped_total", "Forwarded PUBLISH dropped by subscriber limits", 0, NULL, "messages/dropped", total.publish_dropped);
+    metric_add(list, "mqtt_overflow_dropped_newest_total", "Subscriber overflows resolved by dropping the new message", 0, NULL, "overflow/dropped_newest", total.overflow_newest);
+    metric_add(list, "mqtt_overflow_dropped_oldest_total", "Waiting messages dropped to make room (drop-oldest)", 0, NULL, "overflow/dropped_oldest", total.overflow_oldest);
+    metric_add(list, "mqtt_overflow_disconnects_total", "Slow subscribers disconnected (disconnect)", 0, NULL, "overflow/disconnects", total.overflow_disconnects);
+    metric_add(list, "mqtt_publish_direct_total", "QoS 0 PUBLISH written straight to subscribers", 0, NULL, "messages/direct", total.publish_direct);
+    metric_add(list, "mqtt_publish_retained_total", "Retained messages replayed to new subscriptions", 0, NULL, "messages/retained/sent", total.publish_retained);
+    metric_add(list, "mqtt_retained_messages", "Topics holding a retained message", 1, NULL, "retained messages/count", retained_count(broker->shared));
+    metric_add(list, "mqtt_retransmits_total", "PUBLISH sent again after the retransmission timeout", 0, NULL, "messages/retransmitted", total.retransmits);
+    metric_add(list, "mqtt_connections_total", "Accepted connections", 0, NULL, "connections/total", total.connections_total);
+    metric_add(list, "mqtt_connections_expired_total", "Connections closed for exceeding their keepalive or the CONNECT timeout", 0, NULL, "connections/expired", total.connections_expired);
+    metric_add(list, "mqtt_connections", "Open connections", 1, NULL, "connections/current", total.connections);
+    metric_add(list, "mqtt_clients_connected", "Connections bound to a session", 1, NULL, "clients/connected", total.clients_connected);
+    metric_add(list, "mqtt_sessions", "Sessions kept by the broker", 1, NULL, "clients/total", atomic_load(&broker->shared->session_count));
+    metric_add(list, "mqtt_inflight_messages", "Messages waiting for PUBACK", 1, NULL, "messages/inflight", total.inflight);
+    metric_add(list, "mqtt_pending_messages", "Messages waiting for room in an in-flight window", 1, NULL, "messages/pending", total.pending);
+    pool_stats pools;
+    pool_collect(&pools);
+    for (int cls = 0; cls <= POOL_CLASSES; cls++) {
+        snprintf(topic, sizeof(topic), "memory/pool/%s/live", pool_class_name(cls));
+        metric_value *live = metric_add(list, "mqtt_pool_live_objects", "Pool blocks allocated and not freed, by size class", 1, pool_class_name(cls), topic, pools.live[cls]);
+        if (live) {
+            live->label_name = "class";
+        }
+    }
+    metric_add(list, "mqtt_pool_slab_bytes", "Memory carved into pool blocks", 1, NULL, "memory/pool/slab_bytes", (int64_t)pools.slab_bytes);
+    metric_add(list, "mqtt_uptime_seconds", "Seconds since the broker started", 1, NULL, "uptime", (int64_t)((monotonic_ms() - broker->shared->start_ms) / 1000));
+}
+
+//writes every metric in Prometheus text exposition format, returns the text length
+size_t metrics_format_prometheus(broker_ctx *broker, char *buffer, size_t size) {
+    metric_list list;
+    metrics_values(broker, &list);
+    metric_value *values = list.values;
+    int count = list.count;
+    size_t len = 0;
+
+    for (int i = 0; i < count && len < size; i++) {
+        if (i == 0 || strcmp(values[i].name, values[i - 1].name) != 0) { //HELP and TYPE once per family
+            len += snprintf(buffer + len, size - len, "# HELP %s %s\n# TYPE %s %s\n", values[i].name, values[i].help, values[i].name, values[i].gauge ? "gauge" : "counter");
+            if (len >= size) {
+                break;
+            }
+        }
+        if (values[i].label) {
+            len += snprintf(buffer + len, size - len, "%s{%s=\"%s\"} %lld\n", values[i].name, values[i].label_name, values[i].label, (long long)values[i].value);
+        }
+        else {
+            len += snprintf(buffer + len, size - len, "%s %lld\n", values[i].name, (long long)values[i].value);
+        }
+    }
+    return len < size ? len : size - 1;
+}
+
+//publishes every metric on its $SYS/broker topic
+void metrics_publish_sys(broker_ctx *broker) {
+    metric_list list;
+    metrics_values(broker, &list);
+    metric_value *values = list.values;
+    for (int i = 0; i < list.count; i++) {
+        char payload[24];
+        int len = snprintf(payload, sizeof(payload), "%lld", (long long)values[i].value);
+        broker_publish(broker, values[i].sys_topic, (uint8_t *)payload, len);
+    }
+}
+
+//periodic $SYS publication
+static void sys_timer_fire(timer_wheel *wheel, timer_entry *timer, void *arg) {
+    broker_ctx *broker = (broker_ctx *)arg;
+    metrics_publish_sys(broker);
+    timer_wheel_add(wheel, timer, wheel->now + (uint64_t)broker->config.sys_interval * 1000);
+}
+
+//arms the $SYS publication timer, if enabled (on shard 0, which publishes for the whole broker)
+void metrics_start(broker_ctx *broker) {
+    if (broker->config.sys_interval > 0) {
+        timer_init(&broker->sys_timer, sys_timer_fire, broker);
+        timer_wheel_add(&broker->timers, &broker->sys_timer, monotonic_ms() + (uint64_t)broker->config.sys_interval * 1000);
+    }
+}
+
+//opens the Unix stats socket, -1 on failure
+int metrics_socket_open(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Stats socket creation failed");
+        return -1;
+    }
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    unlink(path); //left over by a previous run
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, 16) < 0) {
+        perror("Stats socket binding failed");
+        close(fd);
+        return -1;
+    }
+    LOG_INFO("Stats socket listening on %s", path);
+    return fd;
+}
+
+//answers every pending stats connection with the current metrics and closes it
+void metrics_socket_serve(int stats_fd, broker_ctx *broker) {
+    while (1) {
+        int fd = accept4(stats_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return; //EAGAIN, nothing left
+        }
+        char text[METRICS_TEXT_SIZE];
+        size_t len = metrics_format_prometheus(broker, text, sizeof(text));
+        size_t done = 0;
+        while (done < len) { //a few KB, fits the socket buffer of a fresh connection
+            ssize_t written = write(fd, text + done, len - done);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                break;
+            }
+            done += written;
+        }
+        close(fd);
+    }
+}
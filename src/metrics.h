@@ -0,0 +1,55 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+//=============================================================//
+//broker metrics: every thread updates its own block without atomic read-modify-write or shared cache lines,
+//readers ($SYS publisher, stats socket) sum the blocks of all threads
+
+typedef struct broker_metrics {
+    //counters
+    _Atomic uint64_t packets_in[16];   //by MQTT control packet type
+    _Atomic uint64_t packets_out[16];
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t publish_enqueued;  //forwarded PUBLISH accepted by a subscriber queue
+    _Atomic uint64_t publish_dropped;   //forwarded PUBLISH lost to a subscriber's limits, by either drop policy
+    _Atomic uint64_t overflow_newest;   //overflows resolved by dropping the message that didn't fit
+    _Atomic uint64_t overflow_oldest;   //waiting messages dropped to make room (overflow-policy drop-oldest)
+    _Atomic uint64_t overflow_disconnects; //slow clients disconnected (overflow-policy disconnect)
+    _Atomic uint64_t publish_direct;    //QoS 0 PUBLISH written straight to a subscriber, without queueing
+    _Atomic uint64_t publish_retained;  //retained messages replayed to new subscriptions
+    _Atomic uint64_t retransmits;       //PUBLISH sent again after the retransmission timeout
+    _Atomic uint64_t connections_total;
+    _Atomic uint64_t connections_expired; //closed for exceeding their keepalive or the CONNECT timeout
+
+    //gauges, a thread's share may go negative, only the sum is meaningful
+    _Atomic int64_t connections;
+    _Atomic int64_t clients_connected;  //connections bound to a session
+    _Atomic int64_t inflight;           //messages waiting for PUBACK
+    _Atomic int64_t pending;            //messages waiting for room in an in-flight window
+
+    struct broker_metrics *next;
+} __attribute__((aligned(64))) broker_metrics;
+
+extern __thread broker_metrics *thread_metrics;
+//block of the calling thread, registered on first use
+broker_metrics *metrics_register(void);
+
+//adds to a field of the calling thread's block, plain load and store since only the owner writes it
+#define METRIC_ADD(field, n) do { \
+        broker_metrics *metrics_ = thread_metrics ? thread_metrics : metrics_register(); \
+        if (metrics_) { \
+            atomic_store_explicit(&metrics_->field, atomic_load_explicit(&metrics_->field, memory_order_relaxed) + (n), memory_order_relaxed); \
+        } \
+    } while (0)
+#define METRIC_INC(field) METRIC_ADD(field, 1)
+#define METRIC_DEC(field) METRIC_ADD(field, -1)
+
+//sum of every thread's block
+void metrics_collect(broker_metrics *total);
+
+#endif // METRICS_H
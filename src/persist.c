@@ -0,0 +1,913 @@
+#include "broker.h"
+
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FILE_SEGMENT 0
+#define FILE_BASE 1
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static size_t page_size;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? 0xEDB88320u ^ (crc >> 1) : crc >> 1;
+        }
+        crc_table[i] = crc;
+    }
+    page_size = sysconf(_SC_PAGESIZE);
+}
+
+//CRC-32 (IEEE), chained by passing the previous result
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len) {
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static size_t record_size(uint32_t count, uint32_t data_len) {
+    return (sizeof(persist_record) + (size_t)count * sizeof(uint32_t) + data_len + 7) & ~(size_t)7;
+}
+
+static const uint32_t *record_ids(const persist_record *record) {
+    return (const uint32_t *)(record + 1);
+}
+
+static const uint8_t *record_data(const persist_record *record) {
+    return (const uint8_t *)(record + 1) + record->count * sizeof(uint32_t);
+}
+
+//returns the record at offset if it is complete and intact, NULL where the written data ends
+static const persist_record *record_at(const uint8_t *map, size_t size, size_t offset) {
+    if (size - offset < sizeof(persist_record)) {
+        return NULL;
+    }
+    const persist_record *record = (const persist_record *)(map + offset);
+    if (record->len < sizeof(persist_record) || record->len % 8 != 0 || record->len > size - offset ||
+        record_size(record->count, record->data_len) != record->len) {
+        return NULL;
+    }
+    if (crc32_update(0, map + offset + 8, record->len - 8) != record->crc) {
+        return NULL;
+    }
+    return record;
+}
+
+//recognises segment and base file names, -1 for anything else
+static int parse_name(const char *name, int *shard, uint64_t *number) {
+    unsigned long long parsed;
+    int end = 0;
+    if (sscanf(name, "shard%d-%llu.log%n", shard, &parsed, &end) == 2 && end > 0 && name[end] == '\0') {
+        *number = parsed;
+        return FILE_SEGMENT;
+    }
+    end = 0;
+    if (sscanf(name, "base-%llu.log%n", &parsed, &end) == 1 && end > 0 && name[end] == '\0') {
+        *shard = -1;
+        *number = parsed;
+        return FILE_BASE;
+    }
+    return -1;
+}
+
+//raises covered to the segment numbers a PERSIST_COVER record lists
+static void cover_merge(uint64_t covered[MAX_SHARDS], const persist_record *record) {
+    const uint64_t *numbers = (const uint64_t *)record_data(record);
+    for (uint32_t shard = 0; shard < record->data_len / sizeof(uint64_t) && shard < MAX_SHARDS; shard++) {
+        if (numbers[shard] > covered[shard]) {
+            covered[shard] = numbers[shard];
+        }
+    }
+}
+
+//reads which segments a base file covers, covered is left alone if the file has no cover record
+static void base_cover(int dir_fd, const char *name, uint64_t covered[MAX_SHARDS]) {
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("Failed to open base file");
+        return;
+    }
+    uint64_t buf[(sizeof(persist_record) + MAX_SHARDS * sizeof(uint64_t)) / sizeof(uint64_t)];
+    ssize_t len = pread(fd, buf, sizeof(buf), 0);
+    close(fd);
+    const persist_record *record = len > 0 ? record_at((const uint8_t *)buf, len, 0) : NULL;
+    if (record && record->type == PERSIST_COVER) {
+        cover_merge(covered, record);
+    }
+}
+
+//makes file creations, renames and removals in the directory durable
+static void sync_dir(persist_store *store) {
+    int fd = open(store->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+//creates the directory if needed and prepares the store, -1 on failure
+int persist_store_open(persist_store *store, const char *dir, size_t segment_size, int shard_count) {
+    pthread_once(&crc_once, crc_init);
+    memset(store, 0, sizeof(persist_store));
+    snprintf(store->dir, sizeof(store->dir), "%s", dir);
+    store->segment_size = (segment_size + page_size - 1) & ~(page_size - 1);
+    store->shard_count = shard_count;
+    atomic_init(&store->next_id, 1);
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_cond_init(&store->wake, NULL);
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror("Failed to create persistence directory");
+        return -1;
+    }
+    store->active_segment = calloc(shard_count, sizeof(uint64_t));
+    store->active_first_id = calloc(shard_count, sizeof(uint64_t));
+    if (!store->active_segment || !store->active_first_id) {
+        perror("Failed to allocate persistence state");
+        return -1;
+    }
+
+    //numbering continues after existing files, leftovers of an interrupted compaction are dropped
+    DIR *listing = opendir(dir);
+    if (!listing) {
+        perror("Failed to open persistence directory");
+        return -1;
+    }
+    char base_name[256] = "";
+    struct dirent *entry;
+    while ((entry = readdir(listing)) != NULL) {
+        size_t name_len = strlen(entry->d_name);
+        if (name_len > 4 && strcmp(entry->d_name + name_len - 4, ".tmp") == 0) {
+            unlinkat(dirfd(listing), entry->d_name, 0);
+            continue;
+        }
+        int shard;
+        uint64_t number;
+        int type = parse_name(entry->d_name, &shard, &number);
+        if (type == FILE_BASE && number > store->base_gen) {
+            store->base_gen = number;
+            snprintf(base_name, sizeof(base_name), "%s", entry->d_name);
+        }
+        else if (type == FILE_SEGMENT && shard >= 0 && shard < shard_count && number > store->active_segment[shard]) {
+            store->active_segment[shard] = number;
+        }
+    }
+    //segments the newest base covers may be gone already, their numbers must not come back
+    if (base_name[0] != '\0') {
+        uint64_t covered[MAX_SHARDS] = {0};
+        base_cover(dirfd(listing), base_name, covered);
+        for (int shard = 0; shard < shard_count; shard++) {
+            if (covered[shard] > store->active_segment[shard]) {
+                store->active_segment[shard] = covered[shard];
+            }
+        }
+    }
+    closedir(listing);
+    return 0;
+}
+
+//=============================================================//
+//writer
+
+//maps a new segment, at least min_size bytes, whose records all carry IDs from first_id on
+static int segment_open(persist_log *log, size_t min_size, uint64_t first_id) {
+    persist_store *store = log->store;
+    size_t size = store->segment_size;
+    if (min_size > size) {
+        size = (min_size + page_size - 1) & ~(page_size - 1);
+    }
+
+    pthread_mutex_lock(&store->lock);
+    uint64_t segment = store->active_segment[log->shard_id] + 1;
+    pthread_mutex_unlock(&store->lock);
+
+    char path[sizeof(store->dir) + 32];
+    snprintf(path, sizeof(path), "%s/shard%02d-%08llu.log", store->dir, log->shard_id, (unsigned long long)segment);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Failed to create log segment");
+        return -1;
+    }
+    //blocks are reserved up front, a full disk fails here instead of faulting on a store into the mapping
+    int err = posix_fallocate(fd, 0, size);
+    if (err != 0) {
+        errno = err;
+        perror("Failed to reserve log segment");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    uint8_t *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to map log segment");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    sync_dir(store);
+
+    log->fd = fd;
+    log->map = map;
+    log->size = size;
+    log->len = 0;
+    log->synced = 0;
+
+    pthread_mutex_lock(&store->lock);
+    store->active_segment[log->shard_id] = segment;
+    store->active_first_id[log->shard_id] = first_id;
+    pthread_mutex_unlock(&store->lock);
+    return 0;
+}
+
+//syncs and closes a full segment, trimmed to its records, and wakes the compactor when enough have piled up
+static void segment_seal(persist_log *log) {
+    persist_commit(log);
+    munmap(log->map, log->size);
+    if (ftruncate(log->fd, log->len) < 0 || fsync(log->fd) < 0) {
+        perror("Failed to trim log segment");
+    }
+    close(log->fd);
+    log->map = NULL;
+    log->fd = -1;
+
+    persist_store *store = log->store;
+    pthread_mutex_lock(&store->lock);
+    if (++store->sealed >= PERSIST_COMPACT_SEGMENTS) {
+        pthread_cond_signal(&store->wake);
+    }
+    pthread_mutex_unlock(&store->lock);
+}
+
+//copies a record into the mapped segment, moving to a new segment when it doesn't fit
+static int log_append(persist_log *log, persist_record *record, const struct iovec *data, int data_count) {
+    if (log->store == NULL) {
+        return 0;
+    }
+    record->len = record_size(record->count, record->data_len);
+    if (log->map == NULL || record->len > log->size - log->len) {
+        //the record may carry an ID handed out before the new segment opens
+        uint64_t first_id = atomic_load_explicit(&log->store->next_id, memory_order_relaxed);
+        if ((record->type == PERSIST_SUBSCRIBE || record->type == PERSIST_UNSUBSCRIBE || record->type == PERSIST_MESSAGE) && record->id < first_id) {
+            first_id = record->id;
+        }
+        if (log->map) {
+            segment_seal(log);
+        }
+        if (segment_open(log, record->len, first_id) < 0) {
+            return -1;
+        }
+    }
+
+    //segments start zeroed, so the padding already is
+    uint8_t *dst = log->map + log->len;
+    memcpy(dst, record, sizeof(persist_record));
+    size_t offset = sizeof(persist_record);
+    for (int i = 0; i < data_count; i++) {
+        memcpy(dst + offset, data[i].iov_base, data[i].iov_len);
+        offset += data[i].iov_len;
+    }
+    ((persist_record *)dst)->crc = crc32_update(0, dst + 8, record->len - 8);
+    log->len += record->len;
+    log->records++;
+    return 0;
+}
+
+//opens a fresh segment for a shard, -1 on failure
+int persist_log_open(persist_log *log, persist_store *store, int shard_id) {
+    memset(log, 0, sizeof(persist_log));
+    log->store = store;
+    log->shard_id = shard_id;
+    log->fd = -1;
+    return segment_open(log, 0, atomic_load(&store->next_id));
+}
+
+//hands out the next message ID or subscription change sequence number
+uint64_t persist_next_id(persist_log *log) {
+    if (log->store == NULL) {
+        return 0;
+    }
+    return atomic_fetch_add_explicit(&log->store->next_id, 1, memory_order_relaxed);
+}
+
+//records a new session
+int persist_session(persist_log *log, uint32_t session_id, const char *client_id, size_t len) {
+    persist_record record = {.type = PERSIST_SESSION, .session_id = session_id, .data_len = len};
+    struct iovec data = {(void *)client_id, len};
+    return log_append(log, &record, &data, 1);
+}
+
+//records a subscription (qos 0 or 1) or, with qos -1, an unsubscription
+int persist_subscription(persist_log *log, uint32_t session_id, const char *filter, size_t len, int qos) {
+    persist_record record = {.type = qos < 0 ? PERSIST_UNSUBSCRIBE : PERSIST_SUBSCRIBE, .qos = qos < 0 ? 0 : qos,
+                             .session_id = session_id, .id = persist_next_id(log), .data_len = len};
+    struct iovec data = {(void *)filter, len};
+    return log_append(log, &record, &data, 1);
+}
+
+//records a QoS 1 message queued for every listed session
+int persist_message(persist_log *log, uint64_t msg_id, const uint32_t *session_ids, uint32_t count, const uint8_t *frame, size_t len) {
+    persist_record record = {.type = PERSIST_MESSAGE, .id = msg_id, .count = count, .data_len = len};
+    struct iovec data[2] = {{(void *)session_ids, count * sizeof(uint32_t)}, {(void *)frame, len}};
+    return log_append(log, &record, data, 2);
+}
+
+//records that a delivery no longer needs to survive a restart
+int persist_ack(persist_log *log, uint32_t session_id, uint64_t msg_id) {
+    persist_record record = {.type = PERSIST_ACK, .session_id = session_id, .id = msg_id};
+    return log_append(log, &record, NULL, 0);
+}
+
+//makes everything appended so far durable, called once per event loop iteration before output is written
+int persist_commit(persist_log *log) {
+    if (log->store == NULL || log->map == NULL || log->len == log->synced) {
+        return 0;
+    }
+    size_t start = log->synced & ~(page_size - 1);
+    if (msync(log->map + start, log->len - start, MS_SYNC) < 0) {
+        perror("Failed to sync log segment");
+        return -1;
+    }
+    log->synced = log->len;
+    return 0;
+}
+
+//=============================================================//
+//compaction and recovery
+
+//input file, mapped while its records are referenced
+typedef struct {
+    char name[64];
+    uint8_t *map;
+    size_t size;
+} input_file;
+
+typedef struct {
+    uint64_t msg_id;
+    uint32_t session_id;
+} ack_key;
+
+//growable array of record pointers
+typedef struct {
+    const persist_record **items;
+    size_t count;
+    size_t cap;
+} record_list;
+
+//every record of the input files, sorted by key once all are read
+typedef struct {
+    input_file *files;
+    int file_count;
+    int file_cap;
+    size_t bytes;
+    record_list sessions;
+    record_list subscriptions;
+    record_list messages;
+    ack_key *acks;
+    size_t ack_count;
+    size_t ack_cap;
+    uint64_t max_id;
+    uint64_t covered[MAX_SHARDS];  //per shard, the last segment number the output replaces
+} live_state;
+
+static int list_push(record_list *list, const persist_record *record) {
+    if (list->count == list->cap) {
+        size_t new_cap = list->cap ? list->cap * 2 : 1024;
+        const persist_record **grown = realloc(list->items, new_cap * sizeof(persist_record *));
+        if (!grown) {
+            perror("Failed to grow record list");
+            return -1;
+        }
+        list->items = grown;
+        list->cap = new_cap;
+    }
+    list->items[list->count++] = record;
+    return 0;
+}
+
+static int ack_push(live_state *state, uint32_t session_id, uint64_t msg_id) {
+    if (state->ack_count == state->ack_cap) {
+        size_t new_cap = state->ack_cap ? state->ack_cap * 2 : 1024;
+        ack_key *grown = realloc(state->acks, new_cap * sizeof(ack_key));
+        if (!grown) {
+            perror("Failed to grow acknowledgement list");
+            return -1;
+        }
+        state->acks = grown;
+        state->ack_cap = new_cap;
+    }
+    state->acks[state->ack_count].msg_id = msg_id;
+    state->acks[state->ack_count].session_id = session_id;
+    state->ack_count++;
+    return 0;
+}
+
+//maps one input file and sorts its records by type
+static int state_read_file(live_state *state, int dir_fd, const char *name) {
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("Failed to open log file");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("Failed to stat log file");
+        close(fd);
+        return -1;
+    }
+    uint8_t *map = NULL;
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("Failed to map log file");
+            close(fd);
+            return -1;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    if (state->file_count == state->file_cap) {
+        int new_cap = state->file_cap ? state->file_cap * 2 : 16;
+        input_file *grown = realloc(state->files, new_cap * sizeof(input_file));
+        if (!grown) {
+            perror("Failed to grow input file list");
+            if (map) {
+                munmap(map, st.st_size);
+            }
+            return -1;
+        }
+        state->files = grown;
+        state->file_cap = new_cap;
+    }
+    input_file *file = &state->files[state->file_count++];
+    snprintf(file->name, sizeof(file->name), "%s", name);
+    file->map = map;
+    file->size = st.st_size;
+    state->bytes += st.st_size;
+
+    size_t offset = 0;
+    const persist_record *record;
+    while (map && (record = record_at(map, file->size, offset)) != NULL) {
+        int ret = 0;
+        switch (record->type) {
+        case PERSIST_SESSION:
+            ret = list_push(&state->sessions, record);
+            break;
+        case PERSIST_SUBSCRIBE:
+        case PERSIST_UNSUBSCRIBE:
+            ret = list_push(&state->subscriptions, record);
+            break;
+        case PERSIST_MESSAGE:
+            ret = list_push(&state->messages, record);
+            break;
+        case PERSIST_ACK:
+            ret = ack_push(state, record->session_id, record->id);
+            break;
+        case PERSIST_COVER:
+            cover_merge(state->covered, record);
+            break;
+        }
+        if (ret < 0) {
+            return -1;
+        }
+        if (record->type != PERSIST_SESSION && record->id > state->max_id) {
+            state->max_id = record->id;
+        }
+        offset += record->len;
+    }
+    //a segment is preallocated with zeros, anything else where the records stop was torn by a crash
+    if (map && file->size - offset >= sizeof(uint32_t) && *(const uint32_t *)(map + offset) != 0) {
+        LOG_WARN("Damaged record in %s at offset %zu || ignoring the rest of the file", name, offset);
+    }
+    return 0;
+}
+
+static int compare_session_id(const void *a, const void *b) {
+    const persist_record *x = *(const persist_record **)a, *y = *(const persist_record **)b;
+    return (x->session_id > y->session_id) - (x->session_id < y->session_id);
+}
+
+//by session, then client ID so only copies of the same record count as repeats
+static int compare_session(const void *a, const void *b) {
+    int cmp = compare_session_id(a, b);
+    if (cmp != 0) {
+        return cmp;
+    }
+    const persist_record *x = *(const persist_record **)a, *y = *(const persist_record **)b;
+    if (x->data_len != y->data_len) {
+        return x->data_len < y->data_len ? -1 : 1;
+    }
+    return memcmp(record_data(x), record_data(y), x->data_len);
+}
+
+//by session and filter, then sequence so the latest change of a subscription comes last
+static int compare_subscription(const void *a, const void *b) {
+    const persist_record *x = *(const persist_record **)a, *y = *(const persist_record **)b;
+    if (x->session_id != y->session_id) {
+        return x->session_id < y->session_id ? -1 : 1;
+    }
+    if (x->data_len != y->data_len) {
+        return x->data_len < y->data_len ? -1 : 1;
+    }
+    int cmp = memcmp(record_data(x), record_data(y), x->data_len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+static int compare_message(const void *a, const void *b) {
+    const persist_record *x = *(const persist_record **)a, *y = *(const persist_record **)b;
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+static int compare_ack(const void *a, const void *b) {
+    const ack_key *x = a, *y = b;
+    if (x->msg_id != y->msg_id) {
+        return x->msg_id < y->msg_id ? -1 : 1;
+    }
+    return (x->session_id > y->session_id) - (x->session_id < y->session_id);
+}
+
+//sorts a list and drops records whose key repeats (files left behind by an interrupted compaction)
+static void list_sort_unique(record_list *list, int (*compare)(const void *, const void *)) {
+    if (list->count == 0) {
+        return;
+    }
+    qsort(list->items, list->count, sizeof(persist_record *), compare);
+    size_t kept = 1;
+    for (size_t i = 1; i < list->count; i++) {
+        if (compare(&list->items[i], &list->items[kept - 1]) != 0) {
+            list->items[kept++] = list->items[i];
+        }
+    }
+    list->count = kept;
+}
+
+//one client per session ID, a second one means files from different numberings got mixed up
+static void sessions_unique(record_list *sessions) {
+    size_t kept = 0;
+    for (size_t i = 0; i < sessions->count; i++) {
+        if (kept > 0 && compare_session_id(&sessions->items[i], &sessions->items[kept - 1]) == 0) {
+            LOG_WARN("Session %u names more than one client in the log || keeping the first", sessions->items[i]->session_id);
+            continue;
+        }
+        sessions->items[kept++] = sessions->items[i];
+    }
+    sessions->count = kept;
+}
+
+static int ack_find(const live_state *state, uint64_t msg_id, uint32_t session_id) {
+    ack_key key = {msg_id, session_id};
+    return bsearch(&key, state->acks, state->ack_count, sizeof(ack_key), compare_ack) != NULL;
+}
+
+static int message_find(const live_state *state, uint64_t msg_id) {
+    persist_record key = {.id = msg_id};
+    const persist_record *key_ptr = &key;
+    return bsearch(&key_ptr, state->messages.items, state->messages.count, sizeof(persist_record *), compare_message) != NULL;
+}
+
+//position of a session in the sorted list, which becomes its ID after recovery, -1 if unknown
+static int64_t session_rank(const live_state *state, uint32_t session_id) {
+    persist_record key = {.session_id = session_id};
+    const persist_record *key_ptr = &key;
+    const persist_record **found = bsearch(&key_ptr, state->sessions.items, state->sessions.count, sizeof(persist_record *), compare_session_id);
+    return found ? found - state->sessions.items : -1;
+}
+
+static void state_free(live_state *state) {
+    for (int i = 0; i < state->file_count; i++) {
+        if (state->files[i].map) {
+            munmap(state->files[i].map, state->files[i].size);
+        }
+    }
+    free(state->files);
+    free(state->sessions.items);
+    free(state->subscriptions.items);
+    free(state->messages.items);
+    free(state->acks);
+}
+
+//buffered writer of the base file
+typedef struct {
+    FILE *file;
+    uint8_t *buf;
+    size_t cap;
+    size_t bytes;
+} base_writer;
+
+static int base_write(base_writer *out, const persist_record *header, const uint32_t *ids, const uint8_t *data) {
+    size_t len = record_size(header->count, header->data_len);
+    if (len > out->cap) {
+        uint8_t *grown = realloc(out->buf, len);
+        if (!grown) {
+            perror("Failed to grow compaction buffer");
+            return -1;
+        }
+        out->buf = grown;
+        out->cap = len;
+    }
+    memset(out->buf, 0, len);
+    memcpy(out->buf, header, sizeof(persist_record));
+    ((persist_record *)out->buf)->len = len;
+    memcpy(out->buf + sizeof(persist_record), ids, header->count * sizeof(uint32_t));
+    memcpy(out->buf + sizeof(persist_record) + header->count * sizeof(uint32_t), data, header->data_len);
+    ((persist_record *)out->buf)->crc = crc32_update(0, out->buf + 8, len - 8);
+    if (fwrite(out->buf, 1, len, out->file) != len) {
+        perror("Failed to write base file");
+        return -1;
+    }
+    out->bytes += len;
+    return 0;
+}
+
+//writes the live state, renumbering sessions when recovering, and replays it if asked
+static int state_write(live_state *state, base_writer *out, const persist_replay *replay, uint64_t min_active_id, size_t counts[3]) {
+    //the segments this file replaces, up to the last shard that had any
+    uint32_t shards = MAX_SHARDS;
+    while (shards > 0 && state->covered[shards - 1] == 0) {
+        shards--;
+    }
+    persist_record cover = {.type = PERSIST_COVER, .data_len = shards * sizeof(uint64_t)};
+    if (base_write(out, &cover, NULL, (const uint8_t *)state->covered) < 0) {
+        return -1;
+    }
+
+    //sessions, kept for ever
+    for (size_t i = 0; i < state->sessions.count; i++) {
+        persist_record header = *state->sessions.items[i];
+        if (replay) {
+            header.session_id = i;
+        }
+        if (base_write(out, &header, NULL, record_data(state->sessions.items[i])) < 0) {
+            return -1;
+        }
+        if (replay && replay->session(replay->arg, i, (const char *)record_data(state->sessions.items[i]), header.data_len) == 0) {
+            counts[0]++;
+        }
+    }
+
+    //latest change of each subscription, an unsubscription is dropped once no older record can be outside the inputs
+    for (size_t i = 0; i < state->subscriptions.count; i++) {
+        const persist_record *record = state->subscriptions.items[i];
+        if (i + 1 < state->subscriptions.count) {
+            const persist_record *next = state->subscriptions.items[i + 1];
+            if (next->session_id == record->session_id && next->data_len == record->data_len &&
+                memcmp(record_data(next), record_data(record), record->data_len) == 0) {
+                continue; //superseded
+            }
+        }
+        persist_record header = *record;
+        if (replay) {
+            int64_t rank = session_rank(state, record->session_id);
+            if (record->type != PERSIST_SUBSCRIBE || rank < 0) {
+                continue;
+            }
+            header.session_id = rank;
+        }
+        else if (record->type == PERSIST_UNSUBSCRIBE && record->id < min_active_id) {
+            continue;
+        }
+        if (base_write(out, &header, NULL, record_data(record)) < 0) {
+            return -1;
+        }
+        if (replay) {
+            replay->subscribe(replay->arg, header.session_id, (const char *)record_data(record), record->data_len, record->qos);
+            counts[1]++;
+        }
+    }
+
+    //messages with the sessions that still wait for them, in message order so every queue is rebuilt in order
+    uint32_t *live = NULL;
+    size_t live_cap = 0;
+    for (size_t i = 0; i < state->messages.count; i++) {
+        const persist_record *record = state->messages.items[i];
+        if (record->count > live_cap) {
+            uint32_t *grown = realloc(live, record->count * sizeof(uint32_t));
+            if (!grown) {
+                perror("Failed to grow session list");
+                free(live);
+                return -1;
+            }
+            live = grown;
+            live_cap = record->count;
+        }
+        persist_record header = *record;
+        header.count = 0;
+        const uint32_t *ids = record_ids(record);
+        for (uint32_t j = 0; j < record->count; j++) {
+            if (ack_find(state, record->id, ids[j])) {
+                continue;
+            }
+            if (replay) {
+                int64_t rank = session_rank(state, ids[j]);
+                if (rank >= 0) {
+                    live[header.count++] = rank;
+                }
+            }
+            else {
+                live[header.count++] = ids[j];
+            }
+        }
+        if (header.count == 0) {
+            continue;
+        }
+        if (base_write(out, &header, live, record_data(record)) < 0) {
+            free(live);
+            return -1;
+        }
+        for (uint32_t j = 0; replay && j < header.count; j++) {
+            replay->message(replay->arg, live[j], record->id, record_data(record), record->data_len);
+            counts[2]++;
+        }
+    }
+    free(live);
+
+    //acknowledgements of messages outside the inputs, those may still sit in an active segment
+    for (size_t i = 0; !replay && i < state->ack_count; i++) {
+        ack_key *ack = &state->acks[i];
+        if (message_find(state, ack->msg_id) || ack->msg_id < min_active_id) {
+            continue;
+        }
+        persist_record header = {.type = PERSIST_ACK, .session_id = ack->session_id, .id = ack->msg_id};
+        if (base_write(out, &header, NULL, NULL) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//folds every base file and sealed segment into a new base file, then removes them
+//with replay (startup) the result is also replayed, sessions renumbered and acknowledged deliveries forgotten
+static int compact(persist_store *store, const persist_replay *replay) {
+    uint64_t start = monotonic_ms();
+
+    //which segments are sealed, and the lowest ID a record outside the inputs can carry
+    uint64_t active[MAX_SHARDS];
+    uint64_t min_active_id = UINT64_MAX;
+    pthread_mutex_lock(&store->lock);
+    for (int shard = 0; shard < store->shard_count; shard++) {
+        active[shard] = store->active_segment[shard];
+        if (store->active_first_id[shard] < min_active_id) {
+            min_active_id = store->active_first_id[shard];
+        }
+    }
+    store->sealed = 0;
+    pthread_mutex_unlock(&store->lock);
+
+    live_state state = {0};
+    DIR *listing = opendir(store->dir);
+    if (!listing) {
+        perror("Failed to open persistence directory");
+        return -1;
+    }
+    //the newest base file is read first, it says which segments are already folded in
+    char base_name[256] = "";
+    uint64_t newest = 0;
+    struct dirent *entry;
+    while ((entry = readdir(listing)) != NULL) {
+        int shard;
+        uint64_t number;
+        if (parse_name(entry->d_name, &shard, &number) == FILE_BASE && number > newest) {
+            newest = number;
+            snprintf(base_name, sizeof(base_name), "%s", entry->d_name);
+        }
+    }
+    int ret = newest > 0 ? state_read_file(&state, dirfd(listing), base_name) : 0;
+    uint64_t covered[MAX_SHARDS];
+    memcpy(covered, state.covered, sizeof(covered));
+
+    //older bases and covered segments are leftovers of a compaction cut short after its base was installed
+    rewinddir(listing);
+    while (ret == 0 && (entry = readdir(listing)) != NULL) {
+        int shard;
+        uint64_t number;
+        int type = parse_name(entry->d_name, &shard, &number);
+        int tracked = type == FILE_SEGMENT && shard >= 0 && shard < MAX_SHARDS;
+        if (type < 0 || (type == FILE_BASE && number == newest) ||
+            (type == FILE_SEGMENT && shard >= 0 && shard < store->shard_count && number >= active[shard])) {
+            continue;
+        }
+        if ((type == FILE_BASE && number < newest) || (tracked && number <= covered[shard])) {
+            LOG_WARN("%s is covered by %s || removing it", entry->d_name, base_name);
+            unlinkat(dirfd(listing), entry->d_name, 0);
+            continue;
+        }
+        ret = state_read_file(&state, dirfd(listing), entry->d_name);
+        if (tracked && number > state.covered[shard]) {
+            state.covered[shard] = number;
+        }
+    }
+    closedir(listing);
+    if (ret < 0 || (!replay && state.file_count < 2)) { //a lone base file is already compact
+        state_free(&state);
+        return ret;
+    }
+
+    list_sort_unique(&state.sessions, compare_session);
+    sessions_unique(&state.sessions);
+    list_sort_unique(&state.subscriptions, compare_subscription);
+    list_sort_unique(&state.messages, compare_message);
+    if (state.ack_count > 0) {
+        qsort(state.acks, state.ack_count, sizeof(ack_key), compare_ack);
+    }
+    if (replay) {
+        //IDs handed out from now on must not collide with recovered ones
+        uint64_t next_id = atomic_load(&store->next_id);
+        if (state.max_id + 1 > next_id) {
+            atomic_store(&store->next_id, state.max_id + 1);
+        }
+    }
+
+    //new base file, only visible under its final name once complete and on disk
+    uint64_t gen = ++store->base_gen;
+    char path[sizeof(store->dir) + 32];
+    char tmp_path[sizeof(path) + 4];
+    snprintf(path, sizeof(path), "%s/base-%08llu.log", store->dir, (unsigned long long)gen);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    base_writer out = {0};
+    out.file = fopen(tmp_path, "w");
+    if (!out.file) {
+        perror("Failed to create base file");
+        state_free(&state);
+        return -1;
+    }
+    size_t counts[3] = {0};
+    ret = state_write(&state, &out, replay, min_active_id, counts);
+    if (fflush(out.file) != 0 || fsync(fileno(out.file)) < 0) {
+        perror("Failed to sync base file");
+        ret = -1;
+    }
+    fclose(out.file);
+    free(out.buf);
+    if (ret == 0 && rename(tmp_path, path) < 0) {
+        perror("Failed to install base file");
+        ret = -1;
+    }
+    if (ret < 0) {
+        unlink(tmp_path);
+        state_free(&state);
+        return -1;
+    }
+    sync_dir(store);
+
+    //inputs are covered by the new base file now
+    for (int i = 0; i < state.file_count; i++) {
+        char input_path[sizeof(store->dir) + 80];
+        snprintf(input_path, sizeof(input_path), "%s/%s", store->dir, state.files[i].name);
+        if (strcmp(input_path, path) != 0) {
+            unlink(input_path);
+        }
+    }
+    sync_dir(store);
+
+    double seconds = (monotonic_ms() - start) / 1000.0;
+    if (replay) {
+        LOG_INFO("Recovered %zu sessions, %zu subscriptions and %zu queued messages from %d files (%.1f MB) in %.3f s",
+                 counts[0], counts[1], counts[2], state.file_count, state.bytes / 1e6, seconds);
+    }
+    else {
+        LOG_INFO("Compacted %d log files (%.1f MB) into base-%08llu.log (%.1f MB) in %.3f s",
+                 state.file_count, state.bytes / 1e6, (unsigned long long)gen, out.bytes / 1e6, seconds);
+    }
+    state_free(&state);
+    return 0;
+}
+
+//reads every file written before the logs were opened, replays the live state and replaces the files with one base file
+//session IDs are renumbered from 0 in client order, so they match the order replay creates the sessions in
+int persist_recover(persist_store *store, const persist_replay *replay) {
+    return compact(store, replay);
+}
+
+static void *compactor_run(void *arg) {
+    persist_store *store = (persist_store *)arg;
+    pthread_mutex_lock(&store->lock);
+    while (1) {
+        while (store->sealed < PERSIST_COMPACT_SEGMENTS) {
+            pthread_cond_wait(&store->wake, &store->lock);
+        }
+        pthread_mutex_unlock(&store->lock);
+        if (compact(store, NULL) < 0) {
+            LOG_ERROR("Log compaction failed");
+        }
+        pthread_mutex_lock(&store->lock);
+    }
+    return NULL;
+}
+
+//starts the background compactor thread
+int persist_compactor_start(persist_store *store) {
+    if (pthread_create(&store->compactor, NULL, compactor_run, store) != 0) {
+        perror("Failed to start log compactor");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,103 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+//=============================================================//
+//optional persistence: an append-only log of sessions, subscription changes, QoS 1 deliveries and their PUBACKs
+//every shard appends to its own memory-mapped segment file and syncs it once per event loop iteration (group commit),
+//full segments are sealed and a background compactor folds sealed segments into one base file holding only live state
+//at startup every file is read back and replayed, which rebuilds sessions, subscriptions and in-flight queues
+//
+//files in the directory: shardNN-SSSSSSSS.log (segments, numbered per shard) and base-GGGGGGGG.log (compactor output)
+//records are only ever added, replaying is order independent: subscription changes carry a sequence number (latest
+//wins) and a delivery is live while its message names the session and no PUBACK record names the pair
+//a base file starts with the segments it replaces, the newest base is authoritative: older bases and segments it covers
+//(left behind when a crash cuts a compaction short) are removed unread, their session IDs may predate a renumbering
+
+#define PERSIST_SESSION 1          //session_id got client ID (data)
+#define PERSIST_SUBSCRIBE 2        //session_id subscribed to filter (data) with qos, id is the change sequence
+#define PERSIST_UNSUBSCRIBE 3      //session_id unsubscribed from filter (data), id is the change sequence
+#define PERSIST_MESSAGE 4          //PUBLISH frame (data) with message id, queued for count session IDs
+#define PERSIST_ACK 5              //delivery of message id to session_id is done (PUBACK, or dropped)
+#define PERSIST_COVER 6            //first record of a base file, data holds per shard the last segment number folded in
+
+#define PERSIST_COMPACT_SEGMENTS 4 //sealed segments that wake the compactor
+
+//record header, followed by count session IDs and data_len bytes, padded to 8 bytes
+typedef struct {
+    uint32_t len;                  //whole record, 0 where written data ends
+    uint32_t crc;                  //CRC-32 of everything after this field, torn records fail it
+    uint8_t type;                  //PERSIST_*
+    uint8_t qos;
+    uint16_t reserved;
+    uint32_t session_id;
+    uint64_t id;
+    uint32_t count;
+    uint32_t data_len;
+} persist_record;
+
+//shared by every shard's log
+typedef struct {
+    char dir[256];
+    size_t segment_size;
+    int shard_count;
+    _Atomic uint64_t next_id;      //message IDs and subscription change sequence numbers, continues after a restart
+
+    pthread_mutex_t lock;          //active segments, sealed count and compactor wake-up
+    pthread_cond_t wake;
+    uint64_t *active_segment;      //per shard, its files numbered below this one are sealed
+    uint64_t *active_first_id;     //per shard, no record of the active segment carries a lower ID
+    int sealed;                    //segments sealed since the last compaction
+    uint64_t base_gen;             //number of the newest base file
+    pthread_t compactor;
+} persist_store;
+
+//one shard's writer, the current segment is mapped and appended to in place
+typedef struct {
+    persist_store *store;          //NULL when persistence is disabled, every call is then a no-op
+    int shard_id;
+    int fd;
+    uint8_t *map;
+    size_t size;                   //mapped segment size
+    size_t len;                    //bytes appended
+    size_t synced;                 //bytes known to be on disk
+    uint64_t records;              //appended since start, for the log
+} persist_log;
+
+//callbacks of persist_recover, sessions come first, in ID order, then subscriptions, then deliveries by message ID
+typedef struct {
+    int (*session)(void *arg, uint32_t session_id, const char *client_id, size_t len); //-1 skips the session
+    void (*subscribe)(void *arg, uint32_t session_id, const char *filter, size_t len, uint8_t qos);
+    void (*message)(void *arg, uint32_t session_id, uint64_t msg_id, const uint8_t *frame, size_t len);
+    void *arg;
+} persist_replay;
+
+//creates the directory if needed and prepares the store, -1 on failure
+int persist_store_open(persist_store *store, const char *dir, size_t segment_size, int shard_count);
+//starts the background compactor thread
+int persist_compactor_start(persist_store *store);
+//opens a fresh segment for a shard, -1 on failure
+int persist_log_open(persist_log *log, persist_store *store, int shard_id);
+//reads every file written before the logs were opened, replays the live state and replaces the files with one base file
+//session IDs are renumbered from 0 in client order, so they match the order replay creates the sessions in
+int persist_recover(persist_store *store, const persist_replay *replay);
+
+//hands out the next message ID or subscription change sequence number
+uint64_t persist_next_id(persist_log *log);
+//records a new session
+int persist_session(persist_log *log, uint32_t session_id, const char *client_id, size_t len);
+//records a subscription (qos 0 or 1) or, with qos -1, an unsubscription
+int persist_subscription(persist_log *log, uint32_t session_id, const char *filter, size_t len, int qos);
+//records a QoS 1 message queued for every listed session
+int persist_message(persist_log *log, uint64_t msg_id, const uint32_t *session_ids, uint32_t count, const uint8_t *frame, size_t len);
+//records that a delivery no longer needs to survive a restart
+int persist_ack(persist_log *log, uint32_t session_id, uint64_t msg_id);
+//makes everything appended so far durable, called once per event loop iteration before output is written
+int persist_commit(persist_log *log);
+
+#endif // PERSIST_H
@@ -0,0 +1,235 @@
+#include "broker.h"
+
+//blocks handed back by threads holding too many, shared by every thread
+static struct {
+    pthread_mutex_t lock;
+    pool_block *free[POOL_CLASSES];
+    uint32_t count[POOL_CLASSES];
+} depot = {PTHREAD_MUTEX_INITIALIZER};
+
+static _Atomic uint64_t slab_bytes = 0;
+static __thread pool_cache *thread_pool = NULL;
+static _Atomic(pool_cache *) pool_list = NULL; //every thread that ever used a pool
+
+static const char *class_names[POOL_CLASSES + 1] = {"16", "32", "64", "128", "256", "512", "1024", "2048", "4096", "large"};
+
+//adds one to a counter of the calling thread, plain load and store since only the owner writes it
+#define POOL_COUNT(counter) atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + 1, memory_order_relaxed)
+
+//class of a request, POOL_CLASSES when it is above POOL_MAX_SIZE
+static int size_class(size_t size) {
+    if (size <= ((size_t)1 << POOL_MIN_SHIFT)) {
+        return 0;
+    }
+    if (size > POOL_MAX_SIZE) {
+        return POOL_CLASSES;
+    }
+    return (int)(sizeof(unsigned long) * 8 - __builtin_clzl(size - 1)) - POOL_MIN_SHIFT;
+}
+
+//lists of the calling thread, registered on first use
+static pool_cache *pool_register(void) {
+    pool_cache *cache = calloc(1, sizeof(pool_cache));
+    if (!cache) {
+        perror("Failed to allocate pool cache");
+        return NULL;
+    }
+    cache->next = atomic_load(&pool_list);
+    while (!atomic_compare_exchange_weak(&pool_list, &cache->next, cache)) {
+    }
+    thread_pool = cache;
+    return cache;
+}
+
+//fills an empty list from the depot, or from a new slab when the depot has none of the class
+static int pool_refill(pool_cache *cache, int cls) {
+    pthread_mutex_lock(&depot.lock);
+    pool_block *head = depot.free[cls];
+    uint32_t taken = 0;
+    pool_block *last = NULL;
+    for (pool_block *block = head; block && taken < POOL_BATCH; block = block->next) {
+        last = block;
+        taken++;
+    }
+    if (last) {
+        depot.free[cls] = last->next;
+        depot.count[cls] -= taken;
+        last->next = NULL;
+    }
+    pthread_mutex_unlock(&depot.lock);
+    if (taken > 0) {
+        cache->free[cls] = head;
+        cache->count[cls] = taken;
+        return 0;
+    }
+
+    uint8_t *slab = malloc(POOL_SLAB_SIZE);
+    if (!slab) {
+        perror("Failed to allocate pool slab");
+        return -1;
+    }
+    atomic_fetch_add_explicit(&slab_bytes, POOL_SLAB_SIZE, memory_order_relaxed);
+    size_t block_size = (size_t)1 << (cls + POOL_MIN_SHIFT);
+    for (size_t offset = POOL_SLAB_SIZE; offset >= block_size; offset -= block_size) { //first block ends up in front
+        pool_block *block = (pool_block *)(slab + offset - block_size);
+        block->next = cache->free[cls];
+        cache->free[cls] = block;
+        cache->count[cls]++;
+    }
+    return 0;
+}
+
+//block of at least size bytes, NULL on failure
+void *pool_alloc(size_t size) {
+    pool_cache *cache = thread_pool ? thread_pool : pool_register();
+    if (!cache) {
+        return NULL;
+    }
+    int cls = size_class(size);
+    if (cls == POOL_CLASSES) {
+        void *ptr = malloc(size);
+        if (ptr) {
+            POOL_COUNT(cache->allocs[cls]);
+        }
+        return ptr;
+    }
+
+    if (!cache->free[cls] && pool_refill(cache, cls) < 0) {
+        return NULL;
+    }
+    pool_block *block = cache->free[cls];
+    cache->free[cls] = block->next;
+    cache->count[cls]--;
+    POOL_COUNT(cache->allocs[cls]);
+    return block;
+}
+
+//gives a block back, size must be the one it was allocated with
+void pool_free(void *ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    pool_cache *cache = thread_pool ? thread_pool : pool_register();
+    int cls = size_class(size);
+    if (cls == POOL_CLASSES) {
+        free(ptr);
+        if (cache) {
+            POOL_COUNT(cache->frees[cls]);
+        }
+        return;
+    }
+    if (!cache) { //no list to put it on, the depot takes it (uncounted)
+        pool_block *block = (pool_block *)ptr;
+        pthread_mutex_lock(&depot.lock);
+        block->next = depot.free[cls];
+        depot.free[cls] = block;
+        depot.count[cls]++;
+        pthread_mutex_unlock(&depot.lock);
+        return;
+    }
+
+    pool_block *block = (pool_block *)ptr;
+    block->next = cache->free[cls];
+    cache->free[cls] = block;
+    cache->count[cls]++;
+    POOL_COUNT(cache->frees[cls]);
+
+    //blocks pile up on threads freeing more than they allocate, the surplus goes where it is needed
+    if (cache->count[cls] > POOL_CACHE_MAX) {
+        pool_block *head = cache->free[cls];
+        pool_block *last = head;
+        for (int i = 1; i < POOL_BATCH; i++) {
+            last = last->next;
+        }
+        cache->free[cls] = last->next;
+        cache->count[cls] -= POOL_BATCH;
+
+        pthread_mutex_lock(&depot.lock);
+        last->next = depot.free[cls];
+        depot.free[cls] = head;
+        depot.count[cls] += POOL_BATCH;
+        pthread_mutex_unlock(&depot.lock);
+    }
+}
+
+//name of a class for the metrics, "large" for the malloc class
+const char *pool_class_name(int cls) {
+    return class_names[cls];
+}
+
+//counters of every thread
+void pool_collect(pool_stats *stats) {
+    memset(stats, 0, sizeof(pool_stats));
+    for (pool_cache *cache = atomic_load(&pool_list); cache; cache = cache->next) {
+        for (int cls = 0; cls <= POOL_CLASSES; cls++) {
+            uint64_t allocs = atomic_load_explicit(&cache->allocs[cls], memory_order_relaxed);
+            uint64_t frees = atomic_load_explicit(&cache->frees[cls], memory_order_relaxed);
+            stats->allocs[cls] += allocs;
+            stats->live[cls] += (int64_t)(allocs - frees);
+        }
+    }
+    stats->slab_bytes = atomic_load_explicit(&slab_bytes, memory_order_relaxed);
+}
+
+//size bytes (8-byte aligned) valid until the next arena_reset, NULL on failure
+void *arena_alloc(arena *scratch, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    arena_chunk *chunk = scratch->head;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = scratch->total ? scratch->total : ARENA_CHUNK_SIZE;
+        if (chunk_size < size) {
+            chunk_size = size;
+        }
+        chunk = malloc(sizeof(arena_chunk) + chunk_size);
+        if (!chunk) {
+            perror("Failed to grow arena");
+            return NULL;
+        }
+        chunk->next = scratch->head;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        scratch->head = chunk;
+        scratch->total += chunk_size;
+    }
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+//takes back everything allocated since the last reset
+void arena_reset(arena *scratch) {
+    arena_chunk *chunk = scratch->head;
+    if (!chunk) {
+        return;
+    }
+    if (chunk->next == NULL && chunk->size <= ARENA_KEEP_MAX) {
+        chunk->used = 0;
+        return;
+    }
+
+    //the batch spilled over, one chunk as large as all of them replaces them, up to ARENA_KEEP_MAX so that one huge
+    //packet doesn't pin its size for good
+    size_t total = scratch->total < ARENA_KEEP_MAX ? scratch->total : ARENA_KEEP_MAX;
+    arena_free(scratch);
+    chunk = malloc(sizeof(arena_chunk) + total);
+    if (!chunk) {
+        return; //next allocation starts over
+    }
+    chunk->next = NULL;
+    chunk->size = total;
+    chunk->used = 0;
+    scratch->head = chunk;
+    scratch->total = total;
+}
+
+//frees every chunk
+void arena_free(arena *scratch) {
+    arena_chunk *chunk = scratch->head;
+    while (chunk) {
+        arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    scratch->head = NULL;
+    scratch->total = 0;
+}
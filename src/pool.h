@@ -0,0 +1,78 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+//=============================================================//
+//size-classed pools for frames, cross-shard messages and other short-lived blocks: every thread keeps a free list
+//per class and allocates and frees without locks, blocks are carved from slabs that are never given back
+//blocks freed on another thread (a frame released by the last shard delivering it) join that thread's list, a list
+//grown past POOL_CACHE_MAX returns POOL_BATCH blocks to a shared depot, which refills lists that ran dry before
+//another slab is carved; requests above POOL_MAX_SIZE go to malloc and are only counted
+
+#define POOL_MIN_SHIFT 4           //smallest class, 16 bytes
+#define POOL_CLASSES 9             //16 bytes to POOL_MAX_SIZE, powers of two
+#define POOL_MAX_SIZE 4096
+#define POOL_SLAB_SIZE (64 * 1024) //carved per refill of an empty class
+#define POOL_CACHE_MAX 512         //free blocks a thread keeps per class
+#define POOL_BATCH 128             //blocks moved between a thread and the depot at once
+
+typedef struct pool_block {
+    struct pool_block *next;
+} pool_block;
+
+//one thread's free lists and counters, registered on first use and never freed
+typedef struct pool_cache {
+    pool_block *free[POOL_CLASSES];
+    uint32_t count[POOL_CLASSES];
+    _Atomic uint64_t allocs[POOL_CLASSES + 1]; //last entry: blocks above POOL_MAX_SIZE
+    _Atomic uint64_t frees[POOL_CLASSES + 1];  //blocks freed by this thread, whichever thread allocated them
+    struct pool_cache *next;
+} pool_cache;
+
+//sum over every thread
+typedef struct {
+    int64_t live[POOL_CLASSES + 1]; //allocated and not freed yet, steady growth points at a leak
+    uint64_t allocs[POOL_CLASSES + 1];
+    uint64_t slab_bytes;           //carved from the system for the classes
+} pool_stats;
+
+//block of at least size bytes, NULL on failure
+void *pool_alloc(size_t size);
+//gives a block back, size must be the one it was allocated with
+void pool_free(void *ptr, size_t size);
+//name of a class for the metrics, "large" for the malloc class
+const char *pool_class_name(int cls);
+//counters of every thread
+void pool_collect(pool_stats *stats);
+
+//=============================================================//
+//bump arena for data that only lives while one read batch is handled (parsed packet fields, client IDs being
+//looked up): allocation moves a pointer, a reset takes everything back at once
+//a batch that doesn't fit spills into extra chunks, the next reset merges them so the arena fits such batches
+
+#define ARENA_CHUNK_SIZE (64 * 1024) //initial size
+#define ARENA_KEEP_MAX (4 * ARENA_CHUNK_SIZE) //largest chunk kept by a reset, larger batches allocate again
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    uint8_t data[];
+} arena_chunk;
+
+typedef struct {
+    arena_chunk *head;             //chunk being filled, older ones follow
+    size_t total;                  //bytes of every chunk
+} arena;
+
+//size bytes (8-byte aligned) valid until the next arena_reset, NULL on failure
+void *arena_alloc(arena *scratch, size_t size);
+//takes back everything allocated since the last reset
+void arena_reset(arena *scratch);
+//frees every chunk
+void arena_free(arena *scratch);
+
+#endif // POOL_H
@@ -0,0 +1,208 @@
+#include "broker.h"
+
+//drops the frames of a retained message and the message
+static void retained_msg_free(retained_msg *msg) {
+    if (!msg) {
+        return;
+    }
+    for (int qos = 0; qos <= QOS; qos++) {
+        pub_frame_release(msg->frame[qos]);
+    }
+    free(msg);
+}
+
+static void retained_find(void *entry, uint8_t qos, void *arg) {
+    (void)qos;
+    *(retained_msg **)arg = (retained_msg *)entry;
+}
+
+//stores the message of a PUBLISH with RETAIN as its topic's retained message, an empty payload removes it
+int retained_update(broker_ctx *broker, mqtt_pck *received_pck, uint8_t qos) {
+    broker_shared *shared = broker->shared;
+    const char *topic = (const char *)received_pck->variable_header + 2;
+    size_t topic_len = received_pck->topic_len;
+
+    //the tree treats '+' and '#' levels as wildcards, such names would replace the wrong entries
+    if (topic_len == 0 || memchr(topic, '+', topic_len) || memchr(topic, '#', topic_len)) {
+        LOG_WARN("Invalid retained topic name: '%.*s'", (int)topic_len, topic);
+        return -1;
+    }
+
+    //frames are encoded before taking the lock, subscribers replaying the old message keep their own references
+    retained_msg *msg = NULL;
+    if (received_pck->payload_len > 0) {
+        msg = calloc(1, sizeof(retained_msg));
+        if (!msg) {
+            perror("Failed to allocate retained message");
+            return -1;
+        }
+        for (int delivery_qos = 0; delivery_qos <= qos; delivery_qos++) {
+            msg->frame[delivery_qos] = pub_frame_encode(received_pck, delivery_qos);
+            if (!msg->frame[delivery_qos]) {
+                retained_msg_free(msg);
+                return -1;
+            }
+            msg->frame[delivery_qos]->data[0] |= 0x01; //RETAIN, these frames only go to new subscriptions
+        }
+    }
+
+    retained_msg *old = NULL;
+    pthread_rwlock_wrlock(&shared->retained_lock);
+    topic_tree_match(&shared->retained, topic, topic_len, retained_find, &old); //names have no wildcards, only the exact entry matches
+    if (old) {
+        topic_tree_unsubscribe(&shared->retained, topic, topic_len, old);
+    }
+    if (msg && topic_tree_subscribe(&shared->retained, topic, topic_len, msg, qos) < 0) {
+        retained_msg_free(msg);
+        msg = NULL;
+    }
+    pthread_rwlock_unlock(&shared->retained_lock);
+
+    retained_msg_free(old);
+    LOG_DEBUG("Retained message %s for topic '%.*s'", msg ? "stored" : "removed", (int)topic_len, topic);
+    return 0;
+}
+
+//state of collecting the retained messages one filter matches
+typedef struct {
+    connection *conn;
+    uint8_t granted_qos;
+    int failed;
+} retained_scan;
+
+//appends a reference to the matched message's frame for the granted QoS
+static void retained_match(void *entry, uint8_t qos, void *arg) {
+    retained_scan *scan = (retained_scan *)arg;
+    connection *conn = scan->conn;
+    retained_msg *msg = (retained_msg *)entry;
+    if (scan->failed) {
+        return;
+    }
+
+    if (conn->replay_count == conn->replay_cap) {
+        if (conn->replay_next > 0) { //reuse the part already sent
+            conn->replay_count -= conn->replay_next;
+            memmove(conn->replay, conn->replay + conn->replay_next, conn->replay_count * sizeof(pub_frame *));
+            conn->replay_next = 0;
+        }
+        else {
+            uint32_t new_cap = conn->replay_cap ? conn->replay_cap * 2 : 64;
+            pub_frame **grown = realloc(conn->replay, new_cap * sizeof(pub_frame *));
+            if (!grown) {
+                perror("Failed to grow retained replay");
+                scan->failed = 1;
+                return;
+            }
+            conn->replay = grown;
+            conn->replay_cap = new_cap;
+        }
+    }
+
+    pub_frame *frame = msg->frame[qos < scan->granted_qos ? qos : scan->granted_qos];
+    frame->refcount++;
+    conn->replay[conn->replay_count++] = frame;
+}
+
+//queues every retained message a new subscription matches for sending, with the lower of its QoS and granted_qos
+int retained_collect(broker_ctx *broker, connection *conn, const char *filter, size_t len, uint8_t granted_qos) {
+    broker_shared *shared = broker->shared;
+    uint32_t queued = conn->replay_count - conn->replay_next;
+
+    //only references are taken under the lock, the frames go out over the next event loop iterations
+    retained_scan scan = {conn, granted_qos, 0};
+    pthread_rwlock_rdlock(&shared->retained_lock);
+    topic_tree_scan(&shared->retained, filter, len, retained_match, &scan);
+    pthread_rwlock_unlock(&shared->retained_lock);
+
+    LOG_DEBUG("Replaying %u retained messages for '%.*s' || conn_fd: %d", conn->replay_count - conn->replay_next - queued, (int)len, filter, conn->conn_fd);
+    if (conn->replay_count > conn->replay_next && !conn->replay_queued) {
+        if (broker->replay_count == broker->replay_cap) {
+            int new_cap = broker->replay_cap ? broker->replay_cap * 2 : 16;
+            int *grown = realloc(broker->replay_fds, new_cap * sizeof(int));
+            if (!grown) {
+                perror("Failed to grow replay list");
+                retained_replay_free(broker, conn);
+                return -1;
+            }
+            broker->replay_fds = grown;
+            broker->replay_cap = new_cap;
+        }
+        broker->replay_fds[broker->replay_count++] = conn->conn_fd;
+        conn->replay_queued = 1;
+    }
+    return scan.failed ? -1 : 0;
+}
+
+//releases the frames a connection has left to replay
+static void replay_clear(connection *conn) {
+    for (uint32_t i = conn->replay_next; i < conn->replay_count; i++) {
+        pub_frame_release(conn->replay[i]);
+    }
+    free(conn->replay);
+    conn->replay = NULL;
+    conn->replay_next = 0;
+    conn->replay_count = 0;
+    conn->replay_cap = 0;
+}
+
+//sends the next batch of every connection's retained messages, returns 1 when some can continue right away
+//a full socket or in-flight window pauses a connection until EPOLLOUT or PUBACK wake the loop again
+int retained_replay_run(broker_ctx *broker) {
+    int busy = 0;
+    int kept = 0;
+    for (int i = 0; i < broker->replay_count; i++) {
+        int conn_fd = broker->replay_fds[i];
+        connection *conn = broker->connections[conn_fd];
+        session *current_session = conn->session;
+        if (current_session == NULL || current_session->conn_fd != conn_fd) { //session taken over by a newer connection
+            replay_clear(conn);
+            conn->replay_queued = 0;
+            continue;
+        }
+
+        int sent = 0;
+        while (conn->replay_next < conn->replay_count && sent < RETAINED_BATCH && !conn->tx_blocked) {
+            pub_frame *frame = conn->replay[conn->replay_next];
+            if (frame->qos > 0) {
+                //nothing waits behind the window, so live messages of the session aren't held up by the replay
+                if (current_session->pending_count > 0 || (current_session->inflight && current_session->inflight_count >= broker->config.max_inflight)) {
+                    break;
+                }
+                queue_publish(frame, current_session, broker);
+            }
+            else if (send_frame(conn_fd, frame, frame->data[0] & 0x0F, 0, broker) < 0) {
+                LOG_ERROR("FOWARD FAILURE");
+            }
+            pub_frame_release(frame); //queues hold their own references
+            conn->replay_next++;
+            sent++;
+        }
+        METRIC_ADD(publish_retained, sent);
+
+        if (conn->replay_next == conn->replay_count) {
+            replay_clear(conn);
+            conn->replay_queued = 0;
+            continue;
+        }
+        if (sent == RETAINED_BATCH) {
+            busy = 1;
+        }
+        broker->replay_fds[kept++] = conn_fd;
+    }
+    broker->replay_count = kept;
+    return busy;
+}
+
+//drops the retained messages a connection didn't get to send, used when it closes
+void retained_replay_free(broker_ctx *broker, connection *conn) {
+    if (conn->replay_queued) {
+        for (int i = 0; i < broker->replay_count; i++) {
+            if (broker->replay_fds[i] == conn->conn_fd) {
+                broker->replay_fds[i] = broker->replay_fds[--broker->replay_count];
+                break;
+            }
+        }
+        conn->replay_queued = 0;
+    }
+    replay_clear(conn);
+}
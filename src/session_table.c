@@ -0,0 +1,106 @@
+#include "broker.h"
+
+//FNV-1a over a client ID, never returns 0 (reserved for empty slots)
+static uint32_t client_id_hash(const char *client_id) {
+    uint32_t hash = 2166136261u;
+    for (const uint8_t *c = (const uint8_t *)client_id; *c; c++) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+//allocates a table sized for at least expected entries
+int session_table_init(session_table *table, uint32_t expected) {
+    uint32_t cap = 16;
+    while (cap < expected * 2) { //keep load factor at most 1/2
+        cap *= 2;
+    }
+    table->entries = calloc(cap, sizeof(session_table_entry));
+    if (!table->entries) {
+        perror("Failed to allocate session table");
+        return -1;
+    }
+    table->cap = cap;
+    table->count = 0;
+    return 0;
+}
+
+//places an entry into a table known to have room
+static void entry_place(session_table_entry *entries, uint32_t cap, session_table_entry *entry) {
+    uint32_t mask = cap - 1;
+    uint32_t i = entry->hash & mask;
+    while (entries[i].hash != 0) {
+        i = (i + 1) & mask;
+    }
+    entries[i] = *entry;
+}
+
+//returns the slot holding client_id, or the empty slot ending its probe sequence
+static uint32_t entry_slot(session_table *table, const char *client_id, uint32_t hash) {
+    uint32_t mask = table->cap - 1;
+    uint32_t i = hash & mask;
+    while (table->entries[i].hash != 0) {
+        if (table->entries[i].hash == hash && strcmp(table->entries[i].client_id, client_id) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+//returns the session registered under client_id, NULL if none
+void *session_table_find(session_table *table, const char *client_id) {
+    uint32_t hash = client_id_hash(client_id);
+    uint32_t i = entry_slot(table, client_id, hash);
+    return table->entries[i].hash != 0 ? table->entries[i].session : NULL;
+}
+
+//registers a session under client_id (key must stay valid while stored), grows the table as needed
+int session_table_insert(session_table *table, const char *client_id, void *session) {
+    if ((table->count + 1) * 2 > table->cap) {
+        uint32_t new_cap = table->cap * 2;
+        session_table_entry *entries = calloc(new_cap, sizeof(session_table_entry));
+        if (!entries) {
+            perror("Failed to grow session table");
+            return -1;
+        }
+        for (uint32_t i = 0; i < table->cap; i++) {
+            if (table->entries[i].hash != 0) {
+                entry_place(entries, new_cap, &table->entries[i]);
+            }
+        }
+        free(table->entries);
+        table->entries = entries;
+        table->cap = new_cap;
+    }
+
+    uint32_t hash = client_id_hash(client_id);
+    uint32_t i = entry_slot(table, client_id, hash);
+    if (table->entries[i].hash == 0) {
+        table->count++;
+    }
+    table->entries[i].hash = hash;
+    table->entries[i].client_id = client_id;
+    table->entries[i].session = session;
+    return 0;
+}
+
+//removes client_id from the table, returns 1 if it was present
+int session_table_remove(session_table *table, const char *client_id) {
+    uint32_t mask = table->cap - 1;
+    uint32_t i = entry_slot(table, client_id, client_id_hash(client_id));
+    if (table->entries[i].hash == 0) {
+        return 0;
+    }
+    table->entries[i].hash = 0;
+    table->count--;
+
+    //re-place the rest of the probe cluster so lookups don't stop at the hole
+    for (i = (i + 1) & mask; table->entries[i].hash != 0; i = (i + 1) & mask) {
+        session_table_entry moved = table->entries[i];
+        table->entries[i].hash = 0;
+        entry_place(table->entries, table->cap, &moved);
+    }
+    return 1;
+}
@@ -0,0 +1,31 @@
+#ifndef SESSION_TABLE_H
+#define SESSION_TABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//=============================================================//
+//open-addressing (linear probing) hash table from client ID to session
+
+typedef struct {
+    uint32_t hash;                 //cached hash of client_id, 0 marks an empty slot
+    const char *client_id;         //borrowed from the session, lives as long as the session
+    void *session;
+} session_table_entry;
+
+typedef struct {
+    session_table_entry *entries;
+    uint32_t cap;                  //power of two
+    uint32_t count;
+} session_table;
+
+//allocates a table sized for at least expected entries
+int session_table_init(session_table *table, uint32_t expected);
+//returns the session registered under client_id, NULL if none
+void *session_table_find(session_table *table, const char *client_id);
+//registers a session under client_id (key must stay valid while stored), grows the table as needed
+int session_table_insert(session_table *table, const char *client_id, void *session);
+//removes client_id from the table, returns 1 if it was present
+int session_table_remove(session_table *table, const char *client_id);
+
+#endif // SESSION_TABLE_H
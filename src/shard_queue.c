@@ -0,0 +1,50 @@
+#include "broker.h"
+
+#include <sys/eventfd.h>
+
+//creates the wake-up eventfd of an empty queue, -1 on failure
+int shard_queue_init(shard_queue *queue) {
+    atomic_init(&queue->head, NULL);
+    queue->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->wake_fd < 0) {
+        perror("eventfd failed");
+        return -1;
+    }
+    return 0;
+}
+
+//appends a node, wakes the consumer when the queue was empty
+void shard_queue_push(shard_queue *queue, shard_node *node) {
+    shard_node *head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    do {
+        node->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&queue->head, &head, node, memory_order_release, memory_order_relaxed));
+
+    //a non-empty queue already has a wake-up pending, the consumer takes everything at once
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(queue->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("Failed to wake shard");
+        }
+    }
+}
+
+//takes every queued node, oldest first, NULL when empty (called by the owner when wake_fd is readable)
+shard_node *shard_queue_take(shard_queue *queue) {
+    uint64_t count;
+    if (read(queue->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("Failed to read shard wake-up");
+    }
+
+    shard_node *node = atomic_exchange_explicit(&queue->head, NULL, memory_order_acquire);
+
+    //pushes prepend, reverse into arrival order
+    shard_node *oldest = NULL;
+    while (node) {
+        shard_node *next = node->next;
+        node->next = oldest;
+        oldest = node;
+        node = next;
+    }
+    return oldest;
+}
@@ -0,0 +1,26 @@
+#ifndef SHARD_QUEUE_H
+#define SHARD_QUEUE_H
+
+#include <stdatomic.h>
+
+//=============================================================//
+//inbox of an event loop shard: any thread pushes without locks (multi-producer), the owning shard takes the
+//whole list at once (single consumer) and handles it in push order, an eventfd wakes it when the list was empty
+
+typedef struct shard_node {
+    struct shard_node *next;
+} shard_node;
+
+typedef struct {
+    _Atomic(shard_node *) head;    //last pushed node, the list runs backwards to the oldest
+    int wake_fd;                   //eventfd, registered in the owner's epoll set
+} shard_queue;
+
+//creates the wake-up eventfd of an empty queue, -1 on failure
+int shard_queue_init(shard_queue *queue);
+//appends a node, wakes the consumer when the queue was empty
+void shard_queue_push(shard_queue *queue, shard_node *node);
+//takes every queued node, oldest first, NULL when empty (called by the owner when wake_fd is readable)
+shard_node *shard_queue_take(shard_queue *queue);
+
+#endif // SHARD_QUEUE_H
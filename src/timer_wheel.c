@@ -0,0 +1,183 @@
+#include "broker.h"
+
+#define LEVEL_SHIFT(level) ((level) * TIMER_WHEEL_BITS)
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+//milliseconds of the monotonic clock
+uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//initializes an empty wheel at the current time
+void timer_wheel_init(timer_wheel *wheel, uint64_t now) {
+    wheel->now = now;
+    wheel->count = 0;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            timer_entry *head = &wheel->slots[level][slot];
+            head->next = head;
+            head->prev = head;
+        }
+    }
+}
+
+//sets callback and argument of a timer, before arming it the first time
+void timer_init(timer_entry *timer, timer_cb callback, void *arg) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+static void list_unlink(timer_entry *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+static void list_append(timer_entry *head, timer_entry *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+//places an armed timer in the slot matching its distance from now, due timers go to the slot of earliest
+static void wheel_place(timer_wheel *wheel, timer_entry *timer, uint64_t earliest) {
+    uint64_t expires = timer->expires;
+    if (expires < earliest) {
+        expires = earliest;
+    }
+    uint64_t delta = expires - wheel->now;
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= ((uint64_t)1 << LEVEL_SHIFT(level + 1))) {
+        level++;
+    }
+    if (delta >= ((uint64_t)1 << LEVEL_SHIFT(TIMER_WHEEL_LEVELS))) {
+        //beyond the wheel range, park it at the far end of the top level, it is re-cascaded from there
+        expires = wheel->now + ((uint64_t)1 << LEVEL_SHIFT(TIMER_WHEEL_LEVELS)) - 1;
+    }
+    list_append(&wheel->slots[level][(expires >> LEVEL_SHIFT(level)) & SLOT_MASK], timer);
+}
+
+//arms (or re-arms) a timer to fire at expires
+void timer_wheel_add(timer_wheel *wheel, timer_entry *timer, uint64_t expires) {
+    if (timer->next) {
+        list_unlink(timer);
+    }
+    else {
+        wheel->count++;
+    }
+    timer->expires = expires;
+    wheel_place(wheel, timer, wheel->now + 1); //already due timers fire on next tick
+}
+
+//disarms a timer in O(1), harmless if it isn't armed
+void timer_wheel_cancel(timer_wheel *wheel, timer_entry *timer) {
+    if (timer->next) {
+        list_unlink(timer);
+        wheel->count--;
+    }
+}
+
+//moves every timer of a higher level slot down towards level 0, wheel->now is the tick being processed
+static void cascade(timer_wheel *wheel, int level, int slot) {
+    timer_entry *head = &wheel->slots[level][slot];
+    while (head->next != head) {
+        timer_entry *timer = head->next;
+        list_unlink(timer);
+        wheel_place(wheel, timer, wheel->now); //timers due on this tick land in the slot fired next
+    }
+}
+
+//next tick that has level 0 timers to fire or a non-empty slot to cascade, 0 if nothing is armed
+static uint64_t next_event_tick(timer_wheel *wheel) {
+    if (wheel->count == 0) {
+        return 0;
+    }
+    uint64_t next = UINT64_MAX;
+
+    for (uint64_t i = 1; i <= TIMER_WHEEL_SLOTS; i++) {
+        timer_entry *head = &wheel->slots[0][(wheel->now + i) & SLOT_MASK];
+        if (head->next != head) {
+            next = wheel->now + i;
+            break;
+        }
+    }
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t base = (wheel->now >> LEVEL_SHIFT(level)) + 1; //next boundary of this level
+        for (uint64_t slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            timer_entry *head = &wheel->slots[level][slot];
+            if (head->next == head) {
+                continue;
+            }
+            uint64_t tick = (base + ((slot - base) & SLOT_MASK)) << LEVEL_SHIFT(level);
+            if (tick < next) {
+                next = tick;
+            }
+        }
+    }
+    return next;
+}
+
+//fires every timer expiring at or before now, returns how many fired
+int timer_wheel_advance(timer_wheel *wheel, uint64_t now) {
+    int fired = 0;
+
+    while (wheel->now < now) {
+        //jump over ticks where nothing is armed, so cost follows expirations and not elapsed time
+        uint64_t tick = next_event_tick(wheel);
+        if (tick == 0 || tick > now) {
+            wheel->now = now;
+            break;
+        }
+
+        //cascade higher levels down before firing, highest first
+        wheel->now = tick;
+        for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+            if ((tick & (((uint64_t)1 << LEVEL_SHIFT(level)) - 1)) == 0) {
+                cascade(wheel, level, (tick >> LEVEL_SHIFT(level)) & SLOT_MASK);
+            }
+        }
+
+        //detach the slot first, callbacks may re-arm their own timer
+        timer_entry expired;
+        timer_entry *head = &wheel->slots[0][tick & SLOT_MASK];
+        if (head->next == head) {
+            continue;
+        }
+        expired.next = head->next;
+        expired.prev = head->prev;
+        expired.next->prev = &expired;
+        expired.prev->next = &expired;
+        head->next = head;
+        head->prev = head;
+
+        while (expired.next != &expired) {
+            timer_entry *timer = expired.next;
+            list_unlink(timer);
+            wheel->count--;
+            timer->callback(wheel, timer, timer->arg);
+            fired++;
+        }
+    }
+    return fired;
+}
+
+//ms until the wheel next needs to advance, -1 if no timer is armed (usable as epoll_wait timeout)
+int timer_wheel_timeout(timer_wheel *wheel) {
+    uint64_t tick = next_event_tick(wheel);
+    if (tick == 0) {
+        return -1;
+    }
+    uint64_t now = monotonic_ms();
+    if (tick <= now) {
+        return 0;
+    }
+    return (tick - now > INT32_MAX) ? INT32_MAX : (int)(tick - now);
+}
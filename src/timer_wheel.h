@@ -0,0 +1,49 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//=============================================================//
+//hierarchical timing wheel, 1 ms ticks on the monotonic clock
+//level L slot covers 64^L ticks, so 4 levels reach ~4.6 hours (longer deadlines are re-cascaded)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+typedef struct timer_entry timer_entry;
+typedef struct timer_wheel timer_wheel;
+//called with the timer already disarmed, so it can re-arm itself
+typedef void (*timer_cb)(timer_wheel *wheel, timer_entry *timer, void *arg);
+
+//intrusive timer, embedded in the structure it belongs to
+struct timer_entry {
+    timer_entry *next;             //NULL while not armed
+    timer_entry *prev;
+    uint64_t expires;              //deadline in ms of the monotonic clock
+    timer_cb callback;
+    void *arg;
+};
+
+struct timer_wheel {
+    uint64_t now;                  //last processed tick, every timer expiring at or before it has fired
+    timer_entry slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; //list heads
+    size_t count;                  //armed timers
+};
+
+//milliseconds of the monotonic clock
+uint64_t monotonic_ms(void);
+//initializes an empty wheel at the current time
+void timer_wheel_init(timer_wheel *wheel, uint64_t now);
+//sets callback and argument of a timer, before arming it the first time
+void timer_init(timer_entry *timer, timer_cb callback, void *arg);
+//arms (or re-arms) a timer to fire at expires
+void timer_wheel_add(timer_wheel *wheel, timer_entry *timer, uint64_t expires);
+//disarms a timer in O(1), harmless if it isn't armed
+void timer_wheel_cancel(timer_wheel *wheel, timer_entry *timer);
+//fires every timer expiring at or before now, returns how many fired
+int timer_wheel_advance(timer_wheel *wheel, uint64_t now);
+//ms until the wheel next needs to advance, -1 if no timer is armed (usable as epoll_wait timeout)
+int timer_wheel_timeout(timer_wheel *wheel);
+
+#endif // TIMER_WHEEL_H
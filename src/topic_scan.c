@@ -0,0 +1,166 @@
+#include "topic_scan.h"
+
+#if !defined(TOPIC_SCAN_SCALAR) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define TOPIC_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+//what the pass found besides the levels
+typedef struct {
+    uint32_t nul;                  //nonzero once a NUL byte was seen
+    size_t first_high;             //first byte with the high bit set, len when there is none
+} scan_state;
+
+//records the separators of a block, bit i of mask is the byte at base + i
+static inline void levels_mark(topic_levels *levels, size_t base, uint32_t mask) {
+    if (!levels->ends) {
+        levels->count += __builtin_popcount(mask);
+        return;
+    }
+    while (mask) {
+        levels->ends[levels->count - 1] = (uint16_t)(base + __builtin_ctz(mask));
+        levels->count++;
+        mask &= mask - 1;
+    }
+}
+
+//tail of the topic, or all of it without vector support
+static void scan_bytes(const uint8_t *s, size_t start, size_t len, topic_levels *levels, scan_state *state) {
+    for (size_t i = start; i < len; i++) {
+        uint8_t c = s[i];
+        if (c == '/') {
+            levels_mark(levels, i, 1);
+        }
+        else if (c == '+' || c == '#') {
+            levels->wildcards++;
+        }
+        else if (c == 0) {
+            state->nul = 1;
+        }
+        else if ((c & 0x80) && state->first_high == len) {
+            state->first_high = i;
+        }
+    }
+}
+
+#ifdef TOPIC_SCAN_X86
+//16 bytes per step, returns where the remaining bytes start
+static size_t scan_sse2(const uint8_t *s, size_t start, size_t len, topic_levels *levels, scan_state *state) {
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i plus = _mm_set1_epi8('+');
+    const __m128i hash = _mm_set1_epi8('#');
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = start;
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(s + i));
+        uint32_t seps = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, slash));
+        uint32_t wild = (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, plus), _mm_cmpeq_epi8(block, hash)));
+        uint32_t high = (uint32_t)_mm_movemask_epi8(block);
+        state->nul |= (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, zero));
+        if (seps) {
+            levels_mark(levels, i, seps);
+        }
+        if (wild) {
+            levels->wildcards += __builtin_popcount(wild);
+        }
+        if (high && state->first_high == len) {
+            state->first_high = i + __builtin_ctz(high);
+        }
+    }
+    return i;
+}
+
+//32 bytes per step, same as scan_sse2
+__attribute__((target("avx2,popcnt")))
+static size_t scan_avx2(const uint8_t *s, size_t start, size_t len, topic_levels *levels, scan_state *state) {
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i plus = _mm256_set1_epi8('+');
+    const __m256i hash = _mm256_set1_epi8('#');
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = start;
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(s + i));
+        uint32_t seps = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, slash));
+        uint32_t wild = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(block, plus), _mm256_cmpeq_epi8(block, hash)));
+        uint32_t high = (uint32_t)_mm256_movemask_epi8(block);
+        state->nul |= (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero));
+        if (seps) {
+            levels_mark(levels, i, seps);
+        }
+        if (wild) {
+            levels->wildcards += __builtin_popcount(wild);
+        }
+        if (high && state->first_high == len) {
+            state->first_high = i + __builtin_ctz(high);
+        }
+    }
+    return i;
+}
+#endif
+
+//checks well-formed UTF-8 (RFC 3629): no overlong forms, no surrogates, nothing above U+10FFFF
+static int utf8_valid(const uint8_t *s, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        uint8_t c = s[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+        size_t follow;
+        uint8_t low = 0x80, high = 0xBF; //allowed range of the second byte
+        if (c >= 0xC2 && c <= 0xDF) {
+            follow = 1;
+        }
+        else if (c >= 0xE0 && c <= 0xEF) {
+            follow = 2;
+            low = (c == 0xE0) ? 0xA0 : 0x80;
+            high = (c == 0xED) ? 0x9F : 0xBF;
+        }
+        else if (c >= 0xF0 && c <= 0xF4) {
+            follow = 3;
+            low = (c == 0xF0) ? 0x90 : 0x80;
+            high = (c == 0xF4) ? 0x8F : 0xBF;
+        }
+        else {
+            return 0;
+        }
+        if (len - i <= follow || s[i + 1] < low || s[i + 1] > high) {
+            return 0;
+        }
+        for (size_t k = 2; k <= follow; k++) {
+            if ((s[i + k] & 0xC0) != 0x80) {
+                return 0;
+            }
+        }
+        i += follow + 1;
+    }
+    return 1;
+}
+
+//fills levels for a topic of at most 65535 bytes, returns -1 when it isn't well-formed UTF-8 or contains U+0000
+//(levels are filled either way)
+int topic_scan(const char *topic, size_t len, topic_levels *levels) {
+    const uint8_t *s = (const uint8_t *)topic;
+    scan_state state = {0, len};
+    levels->count = 1;
+    levels->wildcards = 0;
+
+    size_t i = 0;
+#ifdef TOPIC_SCAN_X86
+    if (__builtin_cpu_supports("avx2")) {
+        i = scan_avx2(s, i, len, levels, &state);
+    }
+    i = scan_sse2(s, i, len, levels, &state);
+#endif
+    scan_bytes(s, i, len, levels, &state);
+    if (levels->ends) {
+        levels->ends[levels->count - 1] = (uint16_t)len;
+    }
+
+    //bytes before the first non-ASCII one are plain ASCII, so decoding starts on a character boundary
+    if (state.nul || (state.first_high < len && !utf8_valid(s + state.first_high, len - state.first_high))) {
+        return -1;
+    }
+    return 0;
+}
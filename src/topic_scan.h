@@ -0,0 +1,24 @@
+#ifndef TOPIC_SCAN_H
+#define TOPIC_SCAN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//=============================================================//
+//one pass over a topic name or filter that checks its encoding and finds its level separators and wildcards
+//x86 scans 32 bytes at a time with AVX2 when the CPU has it, 16 with SSE2 otherwise, other targets (or builds with
+//-DTOPIC_SCAN_SCALAR) a byte at a time; '/', '+' and '#' never occur inside a multi-byte UTF-8 sequence, so the
+//vector pass finds them without decoding, and only the part from the first non-ASCII byte on is decoded to check it
+
+//levels of a topic, level i spans [i ? ends[i - 1] + 1 : 0, ends[i])
+typedef struct {
+    uint16_t *ends;                //len + 1 entries provided by the caller, NULL to only count
+    uint32_t count;                //levels, one more than the separators
+    uint32_t wildcards;            //'+' and '#' characters anywhere
+} topic_levels;
+
+//fills levels for a topic of at most 65535 bytes, returns -1 when it isn't well-formed UTF-8 or contains U+0000
+//(levels are filled either way)
+int topic_scan(const char *topic, size_t len, topic_levels *levels);
+
+#endif // TOPIC_SCAN_H
@@ -0,0 +1,454 @@
+#include "broker.h"
+
+#define TOPIC_TREE_MIN_CHILDREN 4   //initial child table size of a node
+
+//FNV-1a over a level name
+static uint32_t level_hash(const char *level, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)level[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+#define WILDCARD_HASH(c) ((2166136261u ^ (uint8_t)(c)) * 16777619u) //level_hash of a one character level
+
+//marks the slot of a removed child, readers and writers probe past it
+static topic_node removed_child;
+
+//initializes an empty tree, epochs (may be NULL) is the domain lock-free readers enter
+void topic_tree_init(topic_tree *tree, epoch_domain *epochs) {
+    memset(tree, 0, sizeof(*tree));
+    tree->epochs = epochs;
+}
+
+//frees memory a writer unlinked, after the readers that may still see it are done
+static void tree_release(topic_tree *tree, void *ptr, void (*free_fn)(void *)) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (tree->epochs) {
+        epoch_retire(tree->epochs, ptr, free_fn);
+    }
+    else {
+        free_fn(ptr);
+    }
+}
+
+//frees a node unlinked from its parent together with its tables
+static void node_free(void *ptr) {
+    topic_node *node = (topic_node *)ptr;
+    free(atomic_load_explicit(&node->children, memory_order_relaxed));
+    free(atomic_load_explicit(&node->subscribers, memory_order_relaxed));
+    free(node->level);
+    free(node);
+}
+
+//checks a SUBSCRIBE/UNSUBSCRIBE filter: UTF-8 without U+0000, '+' and '#' must fill a whole level and '#' must be last
+int topic_filter_valid(const char *filter, size_t len) {
+    topic_levels levels = {NULL};
+    if (len == 0 || topic_scan(filter, len, &levels) < 0) {
+        return 0;
+    }
+    if (levels.wildcards == 0) {
+        return 1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (filter[i] == '+' || filter[i] == '#') {
+            int starts_level = (i == 0 || filter[i - 1] == '/');
+            int ends_level = (i + 1 == len || filter[i + 1] == '/');
+            if (!starts_level || !ends_level) {
+                return 0;
+            }
+            if (filter[i] == '#' && i + 1 != len) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+//child in a table slot, NULL for empty and removed slots
+static topic_node *slot_child(topic_children *table, uint32_t i) {
+    topic_node *child = atomic_load_explicit(&table->slots[i], memory_order_acquire);
+    return child == &removed_child ? NULL : child;
+}
+
+//finds the child of node holding a level whose level_hash is known, NULL if absent
+static topic_node *child_find_hashed(topic_node *node, const char *level, size_t len, uint32_t hash) {
+    topic_children *table = atomic_load_explicit(&node->children, memory_order_acquire);
+    if (table == NULL) {
+        return NULL;
+    }
+    uint32_t mask = table->cap - 1;
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        topic_node *child = atomic_load_explicit(&table->slots[i], memory_order_acquire);
+        if (child == NULL) {
+            return NULL;
+        }
+        if (child != &removed_child && child->level_len == len && memcmp(child->level, level, len) == 0) {
+            return child;
+        }
+    }
+}
+
+//finds the child of node holding a level, NULL if absent
+static topic_node *child_find(topic_node *node, const char *level, size_t len) {
+    return child_find_hashed(node, level, len, level_hash(level, len));
+}
+
+//replaces the child table of node with a clean one, at most a quarter full after the next insert
+static int children_rebuild(topic_tree *tree, topic_node *node) {
+    uint32_t new_cap = TOPIC_TREE_MIN_CHILDREN;
+    while ((node->children_count + 1) * 4 > new_cap) {
+        new_cap *= 2;
+    }
+    topic_children *table = calloc(1, sizeof(topic_children) + new_cap * sizeof(topic_node *));
+    if (!table) {
+        return -1;
+    }
+    table->cap = new_cap;
+
+    //not visible to readers yet, the children are copied without their tombstones
+    topic_children *old = atomic_load_explicit(&node->children, memory_order_relaxed);
+    for (uint32_t i = 0; old && i < old->cap; i++) {
+        topic_node *child = slot_child(old, i);
+        if (child) {
+            uint32_t j = level_hash(child->level, child->level_len) & (new_cap - 1);
+            while (atomic_load_explicit(&table->slots[j], memory_order_relaxed) != NULL) {
+                j = (j + 1) & (new_cap - 1);
+            }
+            atomic_store_explicit(&table->slots[j], child, memory_order_relaxed);
+        }
+    }
+    atomic_store_explicit(&node->children, table, memory_order_release);
+    node->children_used = node->children_count;
+    tree_release(tree, old, free);
+    return 0;
+}
+
+//adds a child for a level, rebuilding the table when children and tombstones would fill more than half of it
+static topic_node *child_insert(topic_tree *tree, topic_node *node, const char *level, size_t len) {
+    topic_children *table = atomic_load_explicit(&node->children, memory_order_relaxed);
+    if (table == NULL || (node->children_used + 1) * 2 > table->cap) {
+        if (children_rebuild(tree, node) < 0) {
+            return NULL;
+        }
+        table = atomic_load_explicit(&node->children, memory_order_relaxed);
+    }
+
+    topic_node *child = calloc(1, sizeof(topic_node));
+    if (!child) {
+        return NULL;
+    }
+    child->level = malloc(len ? len : 1);
+    if (!child->level) {
+        free(child);
+        return NULL;
+    }
+    memcpy(child->level, level, len);
+    child->level_len = len;
+    child->parent = node;
+
+    //the level isn't stored yet, so the first empty or removed slot of its probe sequence can take it
+    uint32_t mask = table->cap - 1;
+    uint32_t i = level_hash(level, len) & mask;
+    topic_node *slot;
+    while ((slot = atomic_load_explicit(&table->slots[i], memory_order_relaxed)) != NULL && slot != &removed_child) {
+        i = (i + 1) & mask;
+    }
+    if (slot == NULL) {
+        node->children_used++;
+    }
+    atomic_store_explicit(&table->slots[i], child, memory_order_release); //publishes the initialized child
+    node->children_count++;
+    return child;
+}
+
+//removes a child from its parent's table, its slot keeps a tombstone until the table is rebuilt
+static void child_remove(topic_node *node, topic_node *child) {
+    topic_children *table = atomic_load_explicit(&node->children, memory_order_relaxed);
+    uint32_t mask = table->cap - 1;
+    uint32_t i = level_hash(child->level, child->level_len) & mask;
+    while (atomic_load_explicit(&table->slots[i], memory_order_relaxed) != child) {
+        i = (i + 1) & mask;
+    }
+    atomic_store_explicit(&table->slots[i], &removed_child, memory_order_release);
+    node->children_count--;
+}
+
+//allocates a subscriber list holding the first count entries of old (may be NULL) and room for cap
+static topic_subscribers *subscribers_copy(const topic_subscribers *old, uint32_t count, uint32_t cap) {
+    topic_subscribers *subs = malloc(sizeof(topic_subscribers) + cap * sizeof(topic_subscriber));
+    if (!subs) {
+        perror("Failed to grow subscriber list");
+        return NULL;
+    }
+    subs->cap = cap;
+    if (count > 0) {
+        memcpy(subs->items, old->items, count * sizeof(topic_subscriber));
+    }
+    atomic_init(&subs->count, count);
+    return subs;
+}
+
+//length of the level starting at topic[start]
+static size_t level_length(const char *topic, size_t len, size_t start) {
+    const char *slash = memchr(topic + start, '/', len - start);
+    return slash ? (size_t)(slash - (topic + start)) : len - start;
+}
+
+//adds subscriber to filter, returns 1 if new, 0 if it was already subscribed (QoS updated), -1 on error
+int topic_tree_subscribe(topic_tree *tree, const char *filter, size_t len, void *subscriber, uint8_t qos) {
+    topic_node *node = &tree->root;
+
+    //walk down level by level, creating missing nodes
+    size_t start = 0;
+    while (1) {
+        size_t level_len = level_length(filter, len, start);
+        topic_node *child = child_find(node, filter + start, level_len);
+        if (!child) {
+            child = child_insert(tree, node, filter + start, level_len);
+            if (!child) {
+                perror("Failed to allocate topic tree node");
+                return -1;
+            }
+        }
+        node = child;
+        start += level_len + 1;
+        if (start > len) {
+            break;
+        }
+    }
+
+    topic_subscribers *subs = atomic_load_explicit(&node->subscribers, memory_order_relaxed);
+    uint32_t count = subs ? atomic_load_explicit(&subs->count, memory_order_relaxed) : 0;
+    int ret = 1;
+    for (uint32_t i = 0; i < count; i++) {
+        if (subs->items[i].subscriber == subscriber) {
+            if (subs->items[i].qos == qos) {
+                return 0;
+            }
+            //readers may be looking at the entry, the QoS changes in a copy
+            topic_subscribers *updated = subscribers_copy(subs, count, subs->cap);
+            if (!updated) {
+                return -1;
+            }
+            updated->items[i].qos = qos;
+            atomic_store_explicit(&node->subscribers, updated, memory_order_release);
+            tree_release(tree, subs, free);
+            ret = 0;
+            break;
+        }
+    }
+
+    if (ret == 1) {
+        if (subs && count < subs->cap) { //appended past count, readers see it once count is raised
+            subs->items[count].subscriber = subscriber;
+            subs->items[count].qos = qos;
+            atomic_store_explicit(&subs->count, count + 1, memory_order_release);
+        }
+        else {
+            topic_subscribers *grown = subscribers_copy(subs, count, subs ? subs->cap * 2 : 2);
+            if (!grown) {
+                return -1;
+            }
+            grown->items[count].subscriber = subscriber;
+            grown->items[count].qos = qos;
+            atomic_store_explicit(&grown->count, count + 1, memory_order_relaxed);
+            atomic_store_explicit(&node->subscribers, grown, memory_order_release);
+            tree_release(tree, subs, free);
+        }
+        tree->filter_count++;
+    }
+
+    if (tree->epochs) {
+        epoch_reclaim(tree->epochs);
+    }
+    return ret;
+}
+
+//unlinks nodes left without subscribers or children, walking up towards the root
+static void prune(topic_tree *tree, topic_node *node) {
+    while (node != &tree->root && atomic_load_explicit(&node->subscribers, memory_order_relaxed) == NULL && node->children_count == 0) {
+        topic_node *parent = node->parent;
+        child_remove(parent, node);
+        tree_release(tree, node, node_free);
+        node = parent;
+    }
+}
+
+//removes subscriber from filter, returns 1 if removed, 0 if it wasn't subscribed, -1 on error (still subscribed)
+int topic_tree_unsubscribe(topic_tree *tree, const char *filter, size_t len, void *subscriber) {
+    topic_node *node = &tree->root;
+
+    size_t start = 0;
+    while (1) {
+        size_t level_len = level_length(filter, len, start);
+        node = child_find(node, filter + start, level_len);
+        if (!node) {
+            return 0;
+        }
+        start += level_len + 1;
+        if (start > len) {
+            break;
+        }
+    }
+
+    topic_subscribers *subs = atomic_load_explicit(&node->subscribers, memory_order_relaxed);
+    uint32_t count = subs ? atomic_load_explicit(&subs->count, memory_order_relaxed) : 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (subs->items[i].subscriber == subscriber) {
+            //readers may be walking the list, the rest moves to a copy (shrunk once mostly empty)
+            topic_subscribers *rest = NULL;
+            if (count > 1) {
+                uint32_t cap = (count - 1) * 4 <= subs->cap ? subs->cap / 2 : subs->cap;
+                rest = subscribers_copy(subs, i, cap);
+                if (!rest) {
+                    return -1;
+                }
+                memcpy(rest->items + i, subs->items + i + 1, (count - i - 1) * sizeof(topic_subscriber));
+                atomic_store_explicit(&rest->count, count - 1, memory_order_relaxed);
+            }
+            atomic_store_explicit(&node->subscribers, rest, memory_order_release);
+            tree_release(tree, subs, free);
+            tree->filter_count--;
+            prune(tree, node);
+            if (tree->epochs) {
+                epoch_reclaim(tree->epochs);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void deliver(topic_node *node, topic_match_cb cb, void *arg) {
+    topic_subscribers *subs = atomic_load_explicit(&node->subscribers, memory_order_acquire);
+    if (subs == NULL) {
+        return;
+    }
+    uint32_t count = atomic_load_explicit(&subs->count, memory_order_acquire);
+    for (uint32_t i = 0; i < count; i++) {
+        cb(subs->items[i].subscriber, subs->items[i].qos, arg);
+    }
+}
+
+//one topic_tree_match: the levels of the topic and their hashes, computed the first time a branch looks a level up
+typedef struct {
+    const char *topic;
+    const topic_levels *levels;
+    uint32_t *hashes;
+    uint32_t hashed;               //levels below this index have their hash in hashes
+    topic_match_cb cb;
+    void *arg;
+} match_walk;
+
+//matches the levels of the topic from level on below node
+static void match_levels(match_walk *walk, topic_node *node, uint32_t level, int first_level) {
+    const topic_levels *levels = walk->levels;
+    if (level == levels->count) { //all levels consumed
+        deliver(node, walk->cb, walk->arg);
+        topic_node *multi = child_find_hashed(node, "#", 1, WILDCARD_HASH('#'));
+        if (multi) {
+            deliver(multi, walk->cb, walk->arg);
+        }
+        return;
+    }
+
+    size_t start = level ? levels->ends[level - 1] + 1 : 0;
+    size_t level_len = levels->ends[level] - start;
+    const char *name = walk->topic + start;
+
+    //'#' also matches the parent level ("a/#" matches "a"), wildcards never match '$' topics at the first level
+    int wildcards = !(first_level && level_len > 0 && name[0] == '$');
+    if (wildcards) {
+        topic_node *multi = child_find_hashed(node, "#", 1, WILDCARD_HASH('#'));
+        if (multi) {
+            deliver(multi, walk->cb, walk->arg);
+        }
+        topic_node *single = child_find_hashed(node, "+", 1, WILDCARD_HASH('+'));
+        if (single) {
+            match_levels(walk, single, level + 1, 0);
+        }
+    }
+    while (walk->hashed <= level) { //levels are reached in order, a '+' branch went down before this lookup
+        uint32_t i = walk->hashed++;
+        size_t i_start = i ? levels->ends[i - 1] + 1 : 0;
+        walk->hashes[i] = level_hash(walk->topic + i_start, levels->ends[i] - i_start);
+    }
+    topic_node *exact = child_find_hashed(node, name, level_len, walk->hashes[level]);
+    if (exact) {
+        match_levels(walk, exact, level + 1, 0);
+    }
+}
+
+//calls cb for every subscription matching a topic name, cost depends on topic depth not on subscriber count
+void topic_tree_match(topic_tree *tree, const char *topic, size_t len, topic_match_cb cb, void *arg) {
+    uint16_t ends[len + 1];
+    topic_levels levels = {ends};
+    topic_scan(topic, len, &levels); //callers checked the name already
+    topic_tree_match_levels(tree, topic, &levels, cb, arg);
+}
+
+//same with the levels topic_scan found, so a topic scanned once while parsing isn't split again
+void topic_tree_match_levels(topic_tree *tree, const char *topic, const topic_levels *levels, topic_match_cb cb, void *arg) {
+    uint32_t hashes[levels->count];
+    match_walk walk = {topic, levels, hashes, 0, cb, arg};
+    match_levels(&walk, &tree->root, 0, 1);
+}
+
+//calls cb for every entry at node and below it
+static void scan_subtree(topic_node *node, int first_level, topic_match_cb cb, void *arg) {
+    deliver(node, cb, arg);
+    topic_children *table = atomic_load_explicit(&node->children, memory_order_acquire);
+    for (uint32_t i = 0; table && i < table->cap; i++) {
+        topic_node *child = slot_child(table, i);
+        if (child && !(first_level && child->level_len > 0 && child->level[0] == '$')) {
+            scan_subtree(child, 0, cb, arg);
+        }
+    }
+}
+
+//walks the names stored below node that match the remaining levels of a filter
+static void scan_levels(topic_node *node, const char *filter, size_t len, size_t start, int first_level, topic_match_cb cb, void *arg) {
+    if (start > len) { //all levels consumed
+        deliver(node, cb, arg);
+        return;
+    }
+
+    size_t level_len = level_length(filter, len, start);
+    if (level_len == 1 && filter[start] == '#') { //the parent level and everything below it, '$' names excluded at the first level
+        if (!first_level) {
+            deliver(node, cb, arg);
+        }
+        topic_children *table = atomic_load_explicit(&node->children, memory_order_acquire);
+        for (uint32_t i = 0; table && i < table->cap; i++) {
+            topic_node *child = slot_child(table, i);
+            if (child && !(first_level && child->level_len > 0 && child->level[0] == '$')) {
+                scan_subtree(child, 0, cb, arg);
+            }
+        }
+        return;
+    }
+    if (level_len == 1 && filter[start] == '+') {
+        topic_children *table = atomic_load_explicit(&node->children, memory_order_acquire);
+        for (uint32_t i = 0; table && i < table->cap; i++) {
+            topic_node *child = slot_child(table, i);
+            if (child && !(first_level && child->level_len > 0 && child->level[0] == '$')) {
+                scan_levels(child, filter, len, start + level_len + 1, 0, cb, arg);
+            }
+        }
+        return;
+    }
+    topic_node *exact = child_find(node, filter + start, level_len);
+    if (exact) {
+        scan_levels(exact, filter, len, start + level_len + 1, 0, cb, arg);
+    }
+}
+
+//reverse of topic_tree_match, for trees keyed by topic names: calls cb for every stored name a filter matches
+void topic_tree_scan(topic_tree *tree, const char *filter, size_t len, topic_match_cb cb, void *arg) {
+    scan_levels(&tree->root, filter, len, 0, 1, cb, arg);
+}
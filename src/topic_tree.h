@@ -0,0 +1,77 @@
+#ifndef TOPIC_TREE_H
+#define TOPIC_TREE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "epoch.h"
+#include "topic_scan.h"
+
+//=============================================================//
+//subscription index: one node per topic level, each node holds the subscribers of the filter ending there
+//writers must be serialized by the caller; readers (match, scan) may run alongside them without a lock when the tree
+//has an epoch domain: everything a reader can reach is either immutable or replaced by one atomic pointer store,
+//and memory a writer unlinks is retired through the domain instead of freed
+
+//subscriber entry of a filter
+typedef struct {
+    void *subscriber;              //session subscribed to the filter
+    uint8_t qos;                   //granted QoS
+} topic_subscriber;
+
+//subscribers of a filter, entries below count never change: new ones are appended past count before count is
+//raised, removals and QoS updates replace the whole list
+typedef struct {
+    _Atomic uint32_t count;
+    uint32_t cap;
+    topic_subscriber items[];
+} topic_subscribers;
+
+struct topic_node;
+
+//open-addressing hash table of a node's children keyed by level name, at most half of the slots are used
+//children are added in place, removed ones leave a tombstone so readers probing past them still find the rest,
+//the table is rebuilt (and replaced) when full of children and tombstones
+typedef struct {
+    uint32_t cap;                  //power of two
+    struct topic_node *_Atomic slots[];
+} topic_children;
+
+typedef struct topic_node {
+    char *level;                   //level name (not null-terminated)
+    size_t level_len;
+    struct topic_node *parent;
+
+    _Atomic(topic_children *) children; //NULL when no children were ever added
+    uint32_t children_count;       //writer side: live children
+    uint32_t children_used;        //writer side: slots holding a child or a tombstone
+
+    _Atomic(topic_subscribers *) subscribers; //NULL when nobody is subscribed
+} topic_node;
+
+typedef struct {
+    topic_node root;
+    size_t filter_count;           //number of (filter, subscriber) pairs stored, writer side
+    epoch_domain *epochs;          //retires replaced memory, NULL frees it right away (readers excluded by a lock)
+} topic_tree;
+
+//called once per matching (filter, subscriber) pair
+typedef void (*topic_match_cb)(void *subscriber, uint8_t qos, void *arg);
+
+//initializes an empty tree, epochs (may be NULL) is the domain lock-free readers enter
+void topic_tree_init(topic_tree *tree, epoch_domain *epochs);
+//checks a SUBSCRIBE/UNSUBSCRIBE filter: UTF-8 without U+0000, '+' and '#' must fill a whole level and '#' must be last
+int topic_filter_valid(const char *filter, size_t len);
+//adds subscriber to filter, returns 1 if new, 0 if it was already subscribed (QoS updated), -1 on error
+int topic_tree_subscribe(topic_tree *tree, const char *filter, size_t len, void *subscriber, uint8_t qos);
+//removes subscriber from filter, returns 1 if removed, 0 if it wasn't subscribed, -1 on error (still subscribed)
+int topic_tree_unsubscribe(topic_tree *tree, const char *filter, size_t len, void *subscriber);
+//calls cb for every subscription matching a topic name, cost depends on topic depth not on subscriber count
+void topic_tree_match(topic_tree *tree, const char *topic, size_t len, topic_match_cb cb, void *arg);
+//same with the levels topic_scan found, so a topic scanned once while parsing isn't split again
+void topic_tree_match_levels(topic_tree *tree, const char *topic, const topic_levels *levels, topic_match_cb cb, void *arg);
+//reverse of topic_tree_match, for trees keyed by topic names: calls cb for every stored name a filter matches
+void topic_tree_scan(topic_tree *tree, const char *filter, size_t len, topic_match_cb cb, void *arg);
+
+#endif // TOPIC_TREE_H
@@ -0,0 +1,296 @@
+#include "broker.h"
+
+#define TX_COMPACT_MIN 65536        //consumed tx_buf prefix worth moving out while the queue is still busy
+#define TX_INLINE_FRAME_MAX 512     //frames up to this size are copied whole instead of referenced
+
+//makes room for one more segment at the tail of the ring
+static int tx_reserve_segment(connection *conn) {
+    if (conn->tx_count < conn->tx_seg_cap) {
+        return 0;
+    }
+    uint32_t new_cap = conn->tx_seg_cap ? conn->tx_seg_cap * 2 : 16;
+    tx_segment *segs = malloc(new_cap * sizeof(tx_segment));
+    if (!segs) {
+        perror("Failed to grow outbound queue");
+        return -1;
+    }
+    for (uint32_t i = 0; i < conn->tx_count; i++) { //unwrap the ring into the new array
+        segs[i] = conn->tx_segs[(conn->tx_head + i) % conn->tx_seg_cap];
+    }
+    free(conn->tx_segs);
+    conn->tx_segs = segs;
+    conn->tx_seg_cap = new_cap;
+    conn->tx_head = 0;
+    return 0;
+}
+
+static tx_segment *tx_tail(connection *conn) {
+    if (conn->tx_count == 0) {
+        return NULL;
+    }
+    return &conn->tx_segs[(conn->tx_head + conn->tx_count - 1) % conn->tx_seg_cap];
+}
+
+//remembers the connection so the event loop flushes it when the current batch ends
+void tx_mark_dirty(broker_ctx *broker, connection *conn) {
+    if (conn->tx_dirty) {
+        return;
+    }
+    if (broker->dirty_count == broker->dirty_cap) {
+        int new_cap = broker->dirty_cap ? broker->dirty_cap * 2 : 64;
+        int *grown = realloc(broker->dirty_fds, new_cap * sizeof(int));
+        if (!grown) {
+            perror("Failed to grow dirty connection list");
+            return; //still flushed on its next EPOLLOUT or batch
+        }
+        broker->dirty_fds = grown;
+        broker->dirty_cap = new_cap;
+    }
+    broker->dirty_fds[broker->dirty_count++] = conn->conn_fd;
+    conn->tx_dirty = 1;
+}
+
+//copies bytes to the end of the outbound queue, merging with a previous copied segment when contiguous
+static int tx_append_bytes(connection *conn, const void *data, size_t len) {
+    if (conn->tx_len + len > conn->tx_cap) {
+        size_t new_cap = conn->tx_cap ? conn->tx_cap : 1024;
+        while (new_cap < conn->tx_len + len) {
+            new_cap *= 2;
+        }
+        uint8_t *grown = realloc(conn->tx_buf, new_cap);
+        if (!grown) {
+            perror("Failed to grow outbound buffer");
+            return -1;
+        }
+        conn->tx_buf = grown;
+        conn->tx_cap = new_cap;
+    }
+
+    tx_segment *tail = tx_tail(conn);
+    if (tail && tail->frame == NULL && tail->offset + tail->len == conn->tx_len) {
+        tail->len += len;
+    }
+    else {
+        if (tx_reserve_segment(conn) < 0) {
+            return -1;
+        }
+        tail = &conn->tx_segs[(conn->tx_head + conn->tx_count) % conn->tx_seg_cap];
+        tail->frame = NULL;
+        tail->offset = conn->tx_len;
+        tail->len = len;
+        conn->tx_count++;
+    }
+    memcpy(conn->tx_buf + conn->tx_len, data, len);
+    conn->tx_len += len;
+    conn->tx_bytes += len;
+    return 0;
+}
+
+//queues a range of a shared frame by reference
+static int tx_append_frame(connection *conn, pub_frame *frame, size_t offset, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (tx_reserve_segment(conn) < 0) {
+        return -1;
+    }
+    tx_segment *seg = &conn->tx_segs[(conn->tx_head + conn->tx_count) % conn->tx_seg_cap];
+    seg->frame = frame;
+    seg->offset = offset;
+    seg->len = len;
+    frame->refcount++;
+    conn->tx_count++;
+    conn->tx_bytes += len;
+    return 0;
+}
+
+//state of the queue before a packet is appended, so a packet that can't be queued whole is taken back out
+typedef struct {
+    uint32_t count;
+    size_t tail_len;               //a copied tail segment grows in place when bytes are merged into it
+    size_t len;
+    size_t bytes;
+} tx_mark;
+
+static tx_mark tx_mark_get(connection *conn) {
+    tx_segment *tail = tx_tail(conn);
+    tx_mark mark = {conn->tx_count, tail ? tail->len : 0, conn->tx_len, conn->tx_bytes};
+    return mark;
+}
+
+//drops what was appended since mark, a half queued packet would break the framing of the stream
+static void tx_rollback(connection *conn, tx_mark mark) {
+    while (conn->tx_count > mark.count) {
+        pub_frame_release(tx_tail(conn)->frame);
+        conn->tx_count--;
+    }
+    tx_segment *tail = tx_tail(conn);
+    if (tail) {
+        tail->len = mark.tail_len;
+    }
+    conn->tx_len = mark.len;
+    conn->tx_bytes = mark.bytes;
+}
+
+//queues a copy of one packet given as pieces, written when the current batch ends
+int tx_queue_iov(broker_ctx *broker, connection *conn, const struct iovec *iov, int iov_count) {
+    tx_mark mark = tx_mark_get(conn);
+    for (int i = 0; i < iov_count; i++) {
+        if (tx_append_bytes(conn, iov[i].iov_base, iov[i].iov_len) < 0) {
+            tx_rollback(conn, mark);
+            return -1;
+        }
+    }
+    broker->tx_packets++;
+    METRIC_INC(packets_out[((uint8_t *)iov[0].iov_base)[0] >> 4]);
+    tx_mark_dirty(broker, conn);
+    return 0;
+}
+
+//queues a shared PUBLISH frame with this recipient's first byte and packet ID, skipping bytes already sent
+int tx_queue_frame(broker_ctx *broker, connection *conn, pub_frame *frame, uint8_t first_byte, int pck_id, size_t skip) {
+    uint8_t pck_id_bytes[2] = {(pck_id >> 8) & 0xFF, pck_id & 0xFF};
+    size_t pck_id_len = frame->qos ? 2 : 0; //QoS 0 frames have no packet ID, that piece stays empty
+
+    //small frames are cheaper to copy than to reference, and coalesce with neighbouring packets
+    if (frame->len <= TX_INLINE_FRAME_MAX && skip == 0) {
+        uint8_t copy[TX_INLINE_FRAME_MAX];
+        memcpy(copy, frame->data, frame->len);
+        copy[0] = first_byte;
+        memcpy(copy + frame->pck_id_offset, pck_id_bytes, pck_id_len);
+        struct iovec iov = {copy, frame->len};
+        return tx_queue_iov(broker, conn, &iov, 1);
+    }
+
+    //frame pieces: first byte | header up to packet ID | packet ID | payload
+    tx_mark mark = tx_mark_get(conn);
+    size_t piece_start[4] = {0, 1, frame->pck_id_offset, frame->pck_id_offset + pck_id_len};
+    size_t piece_end[4] = {1, frame->pck_id_offset, frame->pck_id_offset + pck_id_len, frame->len};
+    for (int i = 0; i < 4; i++) {
+        size_t start = piece_start[i] > skip ? piece_start[i] : skip;
+        if (start >= piece_end[i]) {
+            continue;
+        }
+        int ret;
+        if (i == 0) {
+            ret = tx_append_bytes(conn, &first_byte, 1);
+        }
+        else if (i == 2) {
+            ret = tx_append_bytes(conn, pck_id_bytes + (start - piece_start[i]), piece_end[i] - start);
+        }
+        else {
+            ret = tx_append_frame(conn, frame, start, piece_end[i] - start);
+        }
+        if (ret < 0) {
+            tx_rollback(conn, mark);
+            return -1;
+        }
+    }
+    broker->tx_packets++;
+    METRIC_INC(packets_out[first_byte >> 4]);
+    tx_mark_dirty(broker, conn);
+    return 0;
+}
+
+//drops written bytes from the head of the queue
+static void tx_consume(connection *conn, size_t written) {
+    conn->tx_bytes -= written;
+    conn->tx_written += written;
+    while (written > 0) {
+        tx_segment *seg = &conn->tx_segs[conn->tx_head];
+        if (written < seg->len) {
+            seg->offset += written;
+            seg->len -= written;
+            return;
+        }
+        written -= seg->len;
+        pub_frame_release(seg->frame);
+        conn->tx_head = (conn->tx_head + 1) % conn->tx_seg_cap;
+        conn->tx_count--;
+    }
+}
+
+//moves still queued copied bytes to the front of tx_buf once the consumed prefix is large, used when the socket is full
+void tx_compact(connection *conn) {
+    size_t start = conn->tx_len;
+    for (uint32_t i = 0; i < conn->tx_count; i++) {
+        tx_segment *seg = &conn->tx_segs[(conn->tx_head + i) % conn->tx_seg_cap];
+        if (seg->frame == NULL) {
+            start = seg->offset;
+            break;
+        }
+    }
+    if (start < TX_COMPACT_MIN || start < conn->tx_len / 2) {
+        return;
+    }
+    memmove(conn->tx_buf, conn->tx_buf + start, conn->tx_len - start);
+    conn->tx_len -= start;
+    for (uint32_t i = 0; i < conn->tx_count; i++) {
+        tx_segment *seg = &conn->tx_segs[(conn->tx_head + i) % conn->tx_seg_cap];
+        if (seg->frame == NULL) {
+            seg->offset -= start;
+        }
+    }
+}
+
+//points iov at the head of the queue, returns the entries used (at most max)
+int tx_prepare(connection *conn, struct iovec *iov, int max) {
+    int iov_count = conn->tx_count < (uint32_t)max ? (int)conn->tx_count : max;
+    for (int i = 0; i < iov_count; i++) {
+        tx_segment *seg = &conn->tx_segs[(conn->tx_head + i) % conn->tx_seg_cap];
+        iov[i].iov_base = (seg->frame ? seg->frame->data : conn->tx_buf) + seg->offset;
+        iov[i].iov_len = seg->len;
+    }
+    return iov_count;
+}
+
+//drops bytes the socket took from the head of the queue
+void tx_sent(broker_ctx *broker, connection *conn, size_t written) {
+    broker->tx_writes++;
+    METRIC_ADD(bytes_out, written);
+    tx_consume(conn, written);
+    if (conn->tx_count == 0) {
+        conn->tx_len = 0; //queue empty, copied bytes start over at the front
+    }
+    if (conn->ack_count > 0) {
+        inbound_acks_written(conn);
+    }
+}
+
+//writes as much of the queue as the socket takes, returns 0 when empty, 1 when the socket is full, -1 on error
+int tx_flush(broker_ctx *broker, connection *conn) {
+    while (conn->tx_count > 0) {
+        struct iovec iov[IOV_MAX];
+        int iov_count = tx_prepare(conn, iov, IOV_MAX);
+
+        ssize_t written = writev(conn->conn_fd, iov, iov_count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                tx_compact(conn);
+                return 1;
+            }
+            perror("Failed to send packets");
+            return -1;
+        }
+        tx_sent(broker, conn, written);
+    }
+    conn->tx_len = 0;
+    return 0;
+}
+
+//releases everything still queued, used when the connection closes
+void tx_queue_free(connection *conn) {
+    while (conn->tx_count > 0) {
+        pub_frame_release(conn->tx_segs[conn->tx_head].frame);
+        conn->tx_head = (conn->tx_head + 1) % conn->tx_seg_cap;
+        conn->tx_count--;
+    }
+    free(conn->tx_segs);
+    free(conn->tx_buf);
+    conn->tx_segs = NULL;
+    conn->tx_buf = NULL;
+    conn->tx_bytes = 0;
+}
@@ -0,0 +1,196 @@
+#include "broker.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+//maps one of the rings, NULL on failure
+static void *uring_map(int fd, size_t size, off_t offset) {
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+//registers the provided buffer ring and hands every buffer to the kernel
+static int uring_buffers_init(uring *ring) {
+    ring->buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        perror("Failed to map provided buffer ring");
+        return -1;
+    }
+    ring->buf_data = malloc((size_t)URING_BUFFERS * URING_BUF_SIZE);
+    if (!ring->buf_data) {
+        perror("Failed to allocate receive buffers");
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg = {0};
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUF_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        LOG_WARN("io_uring provided buffer rings unsupported: %s", strerror(errno));
+        return -1;
+    }
+    ring->buf_tail = 0;
+    for (uint16_t id = 0; id < URING_BUFFERS; id++) {
+        uring_buffer_return(ring, id);
+    }
+    return 0;
+}
+
+//sets up the rings and the provided buffers, -1 when the kernel lacks a required feature
+int uring_init(uring *ring) {
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params = {0};
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                   IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = URING_ENTRIES * 4;
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        LOG_WARN("io_uring setup failed: %s", strerror(errno));
+        return -1;
+    }
+    //completions beyond the queue are kept (NODROP), waits take a timeout (EXT_ARG)
+    uint32_t required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & required) != required) {
+        LOG_WARN("io_uring lacks required features (0x%x)", params.features);
+        uring_free(ring);
+        return -1;
+    }
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_map_size > ring->sq_map_size) {
+        ring->sq_map_size = ring->cq_map_size;
+    }
+    ring->sq_map = uring_map(ring->fd, ring->sq_map_size, IORING_OFF_SQ_RING);
+    ring->cq_map = ring->sq_map;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = uring_map(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+    if (!ring->sq_map || !ring->sqes) {
+        perror("Failed to map io_uring");
+        uring_free(ring);
+        return -1;
+    }
+
+    uint8_t *sq = ring->sq_map;
+    ring->sq_head = (_Atomic uint32_t *)(sq + params.sq_off.head);
+    ring->sq_tail = (_Atomic uint32_t *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(uint32_t *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = *(uint32_t *)(sq + params.sq_off.ring_entries);
+    ring->sq_local_tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    uint32_t *array = (uint32_t *)(sq + params.sq_off.array);
+    for (uint32_t i = 0; i < ring->sq_entries; i++) {
+        array[i] = i;
+    }
+
+    uint8_t *cq = ring->cq_map;
+    ring->cq_head = (_Atomic uint32_t *)(cq + params.cq_off.head);
+    ring->cq_tail = (_Atomic uint32_t *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    if (uring_buffers_init(ring) < 0) {
+        uring_free(ring);
+        return -1;
+    }
+    return 0;
+}
+
+//unmaps and closes everything
+void uring_free(uring *ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->sq_map) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    if (ring->buf_ring) {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    }
+    free(ring->buf_data);
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+//next free SQE, zeroed, submitting first when the queue is full, NULL on failure
+struct io_uring_sqe *uring_sqe(uring *ring) {
+    uint32_t head = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        if (uring_submit(ring, 0) < 0) {
+            return NULL;
+        }
+        head = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+        if (ring->sq_local_tail - head >= ring->sq_entries) {
+            LOG_ERROR("io_uring submission queue full");
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_local_tail++;
+    ring->sq_pending++;
+    return sqe;
+}
+
+//submits the written SQEs and waits up to wait_ms (-1 forever, 0 not at all) for a completion, -1 on failure
+int uring_submit(uring *ring, int wait_ms) {
+    atomic_store_explicit(ring->sq_tail, ring->sq_local_tail, memory_order_release);
+
+    //deferred task work only runs with GETEVENTS, so it is always set, even without waiting
+    struct __kernel_timespec timeout;
+    struct io_uring_getevents_arg arg = {0};
+    if (wait_ms > 0) {
+        timeout.tv_sec = wait_ms / 1000;
+        timeout.tv_nsec = (long long)(wait_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&timeout;
+    }
+    unsigned int min_complete = wait_ms != 0 ? 1 : 0;
+    ring->enters++;
+    long ret = syscall(__NR_io_uring_enter, ring->fd, ring->sq_pending, min_complete,
+                       IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (ret < 0) {
+        if (errno == EINTR || errno == ETIME || errno == EAGAIN || errno == EBUSY) {
+            return 0; //signal, timeout or completions to reap first
+        }
+        perror("io_uring_enter failed");
+        return -1;
+    }
+    ring->sq_pending -= (uint32_t)ret;
+    return 0;
+}
+
+//oldest unconsumed completion, NULL when there is none
+struct io_uring_cqe *uring_peek(uring *ring) {
+    uint32_t head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(ring->cq_tail, memory_order_acquire)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+//consumes the completion returned by uring_peek
+void uring_advance(uring *ring) {
+    uint32_t head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    atomic_store_explicit(ring->cq_head, head + 1, memory_order_release);
+}
+
+//data of a provided buffer picked by a recv
+uint8_t *uring_buffer(uring *ring, uint16_t buffer_id) {
+    return ring->buf_data + (size_t)buffer_id * URING_BUF_SIZE;
+}
+
+//gives a provided buffer back to the kernel
+void uring_buffer_return(uring *ring, uint16_t buffer_id) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(ring, buffer_id);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = buffer_id;
+    ring->buf_tail++;
+    //the tail shares its slot with the first buffer's reserved field
+    atomic_store_explicit((_Atomic uint16_t *)&ring->buf_ring->tail, ring->buf_tail, memory_order_release);
+}
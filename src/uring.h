@@ -0,0 +1,73 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+//=============================================================//
+//minimal io_uring driver on the raw system calls: submission and completion rings mapped from the kernel, plus a
+//ring of provided receive buffers the kernel picks from for multishot recv
+//one ring per shard, created on the shard's thread (single issuer, task work deferred until the loop asks for
+//completions), setup fails on kernels without these features and the loop keeps using epoll
+
+#define URING_ENTRIES 4096         //submission queue size, the completion queue is 4 times larger
+#define URING_BUFFERS 1024         //provided receive buffers, power of two
+#define URING_BUF_SIZE 4096        //bytes per receive buffer, a recv completion carries at most this
+#define URING_BUF_GROUP 0
+#define URING_SEND_BATCH 256       //connections flushed by one io_uring_enter
+#define URING_SEND_IOV 64          //queue segments per connection and send, the rest goes in the next round
+
+typedef struct {
+    int fd;                        //-1 when the ring isn't used
+
+    //submission ring, SQE i always sits in slot i of the index array
+    _Atomic uint32_t *sq_head;
+    _Atomic uint32_t *sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t sq_local_tail;        //SQEs written so far, published to the kernel on submit
+    uint32_t sq_pending;           //written and not submitted yet
+    struct io_uring_sqe *sqes;
+
+    //completion ring
+    _Atomic uint32_t *cq_head;
+    _Atomic uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;                  //same as sq_map when the kernel maps both rings at once
+    size_t cq_map_size;
+    size_t sqes_size;
+
+    //provided buffers, handed back to the kernel as soon as their data is copied out
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    uint8_t *buf_data;             //URING_BUFFERS * URING_BUF_SIZE
+    uint16_t buf_tail;
+
+    uint64_t enters;               //io_uring_enter calls
+} uring;
+
+//sets up the rings and the provided buffers, -1 when the kernel lacks a required feature
+int uring_init(uring *ring);
+//unmaps and closes everything
+void uring_free(uring *ring);
+//next free SQE, zeroed, submitting first when the queue is full, NULL on failure
+struct io_uring_sqe *uring_sqe(uring *ring);
+//submits the written SQEs and waits up to wait_ms (-1 forever, 0 not at all) for a completion, -1 on failure
+int uring_submit(uring *ring, int wait_ms);
+//oldest unconsumed completion, NULL when there is none
+struct io_uring_cqe *uring_peek(uring *ring);
+//consumes the completion returned by uring_peek
+void uring_advance(uring *ring);
+//data of a provided buffer picked by a recv
+uint8_t *uring_buffer(uring *ring, uint16_t buffer_id);
+//gives a provided buffer back to the kernel
+void uring_buffer_return(uring *ring, uint16_t buffer_id);
+
+#endif // URING_H
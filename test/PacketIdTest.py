@@ -0,0 +1,121 @@
+import socket
+import struct
+import sys
+import argparse
+
+# Configure command line arguments
+parser = argparse.ArgumentParser(description='Packet ID reuse test: a QoS 1 PUBLISH reusing an acknowledged packet ID is a new message.')
+parser.add_argument('ip', type=str, help='MQTT broker IP address')
+parser.add_argument('port', type=int, help='MQTT broker port')
+args = parser.parse_args()
+
+broker = args.ip
+port = args.port
+
+# paho hands out packet IDs and DUP flags itself, so packets are built by hand
+def encode_length(n):
+    out = bytearray()
+    while True:
+        byte = n % 128
+        n //= 128
+        if n:
+            byte |= 0x80
+        out.append(byte)
+        if not n:
+            return bytes(out)
+
+def string(s):
+    s = s.encode()
+    return struct.pack('!H', len(s)) + s
+
+def packet(first_byte, body):
+    return bytes([first_byte]) + encode_length(len(body)) + body
+
+class Client:
+    def __init__(self, client_id):
+        self.sock = socket.create_connection((broker, port))
+        self.sock.settimeout(3)
+        self.buf = b''
+        self.sock.sendall(packet(0x10, string('MQTT') + bytes([4, 0x02]) + struct.pack('!H', 60) + string(client_id)))
+        first_byte, body = self.read()
+        assert first_byte == 0x20 and body[1] == 0, f"CONNACK refused: {body}"
+
+    def fill(self, n):
+        while len(self.buf) < n:
+            data = self.sock.recv(65536)
+            if not data:
+                raise EOFError("connection closed by broker")
+            self.buf += data
+
+    def read(self):
+        self.fill(2)
+        length, multiplier, i = 0, 1, 1
+        while True:
+            self.fill(i + 1)
+            byte = self.buf[i]
+            length += (byte & 127) * multiplier
+            multiplier *= 128
+            i += 1
+            if not byte & 128:
+                break
+        self.fill(i + length)
+        first_byte, body = self.buf[0], self.buf[i:i + length]
+        self.buf = self.buf[i + length:]
+        return first_byte, body
+
+    def publish(self, topic, payload, pck_id, dup):
+        self.sock.sendall(self.publish_packet(topic, payload, pck_id, dup))
+
+    def publish_packet(self, topic, payload, pck_id, dup):
+        return packet(0x32 | (dup << 3), string(topic) + struct.pack('!H', pck_id) + payload)
+
+    def expect_puback(self, pck_id):
+        first_byte, body = self.read()
+        assert first_byte == 0x40 and struct.unpack('!H', body)[0] == pck_id, f"expected PUBACK {pck_id}, got {first_byte:#x} {body}"
+
+    def expect_message(self, payload):
+        first_byte, body = self.read()
+        assert first_byte >> 4 == 3, f"expected PUBLISH, got {first_byte:#x}"
+        topic_len = struct.unpack('!H', body[:2])[0]
+        pck_id = struct.unpack('!H', body[2 + topic_len:4 + topic_len])[0]
+        assert body[4 + topic_len:] == payload, f"expected {payload}, got {body[4 + topic_len:]}"
+        self.sock.sendall(packet(0x40, struct.pack('!H', pck_id)))
+
+subscriber = Client("id-test-sub")
+subscriber.sock.sendall(packet(0x82, struct.pack('!H', 1) + string("id/test") + bytes([1])))
+first_byte, body = subscriber.read()
+assert first_byte == 0x90 and body[2] == 1, "SUBSCRIBE refused"
+
+# after its PUBACK, an ID is free: reusing it on the same connection, even with DUP set, is a new message
+publisher = Client("id-test-pub")
+publisher.publish("id/test", b"first", 7, 0)
+publisher.expect_puback(7)
+subscriber.expect_message(b"first")
+publisher.publish("id/test", b"second", 7, 1)
+publisher.expect_puback(7)
+subscriber.expect_message(b"second")
+print("ID reused on the same connection: delivered")
+
+# same after the connection is lost without DISCONNECT, the broker keeps the session of a client ID
+publisher.sock.close()
+publisher = Client("id-test-pub")
+publisher.publish("id/test", b"third", 7, 1)
+publisher.expect_puback(7)
+subscriber.expect_message(b"third")
+print("ID reused after reconnecting: delivered")
+
+# a retransmission while the ID is outstanding (its PUBACK not written yet) is acknowledged but not routed again:
+# both copies arrive in one segment, so the broker reads them before it writes the first PUBACK
+publisher.sock.sendall(publisher.publish_packet("id/test", b"fourth", 9, 0) + publisher.publish_packet("id/test", b"fourth", 9, 1))
+publisher.expect_puback(9)
+publisher.expect_puback(9)
+publisher.publish("id/test", b"fifth", 10, 0)
+publisher.expect_puback(10)
+subscriber.expect_message(b"fourth")
+subscriber.expect_message(b"fifth")  # not a second "fourth"
+print("Retransmission of an outstanding ID: routed once")
+
+publisher.sock.sendall(packet(0xE0, b''))
+subscriber.sock.sendall(packet(0xE0, b''))
+print("All tests passed")
+sys.exit(0)
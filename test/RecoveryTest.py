@@ -0,0 +1,184 @@
+import os
+import shutil
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+import zlib
+import argparse
+
+# Configure command line arguments
+parser = argparse.ArgumentParser(description='Recovery test: segments left next to the base file that replaced them '
+                                             '(a crash right after compaction) must not mix into the recovered state.')
+parser.add_argument('broker', type=str, help='path of the mqtt_broker binary')
+parser.add_argument('port', type=int, help='port to run the broker on')
+parser.add_argument('--dir', type=str, default=None, help='persistence directory (default: a fresh temporary one)')
+args = parser.parse_args()
+
+port = args.port
+log_dir = args.dir or tempfile.mkdtemp(prefix='recovery-test-')
+os.makedirs(log_dir, exist_ok=True)
+
+def encode_length(n):
+    out = bytearray()
+    while True:
+        byte = n % 128
+        n //= 128
+        if n:
+            byte |= 0x80
+        out.append(byte)
+        if not n:
+            return bytes(out)
+
+def string(s):
+    s = s.encode()
+    return struct.pack('!H', len(s)) + s
+
+def packet(first_byte, body):
+    return bytes([first_byte]) + encode_length(len(body)) + body
+
+# log records as src/persist.h lays them out: header, session IDs, data, padded to 8 bytes, CRC-32 from byte 8 on
+SESSION, SUBSCRIBE, MESSAGE = 1, 2, 4
+
+def record(rtype, session_id=0, rid=0, qos=0, ids=(), data=b''):
+    body = struct.pack('<BBHIQII', rtype, qos, 0, session_id, rid, len(ids), len(data))
+    body += b''.join(struct.pack('<I', i) for i in ids) + data
+    length = (8 + len(body) + 7) & ~7
+    body += bytes(length - 8 - len(body))
+    return struct.pack('<II', length, zlib.crc32(body)) + body
+
+def publish_frame(topic, payload):
+    return packet(0x32, string(topic) + struct.pack('!H', 0) + payload)
+
+# session 1 never reached the disk, so recovery renumbers c from 2 to 1 and d from 3 to 2:
+# once the segment is back next to the new base, its old IDs name other clients there
+segment_name = 'shard00-00000001.log'
+segment = (record(SESSION, 0, data=b'a') + record(SESSION, 2, data=b'c') + record(SESSION, 3, data=b'd') +
+           record(SUBSCRIBE, 2, rid=1, qos=1, data=b'c/inbox') + record(SUBSCRIBE, 3, rid=2, qos=1, data=b'd/inbox') +
+           record(MESSAGE, rid=3, ids=[2], data=publish_frame('c/inbox', b'queued for c')) +
+           record(MESSAGE, rid=4, ids=[3], data=publish_frame('d/inbox', b'queued for d')))
+with open(os.path.join(log_dir, segment_name), 'wb') as f:
+    f.write(segment)
+
+def start_broker():
+    proc = subprocess.Popen([args.broker, '-p', str(port), '-T', '1', '-D', log_dir])
+    for _ in range(100):
+        try:
+            socket.create_connection(('127.0.0.1', port)).close()
+            return proc
+        except OSError:
+            time.sleep(0.05)
+    proc.kill()
+    sys.exit("broker did not start")
+
+def crash(proc):
+    proc.send_signal(signal.SIGKILL)
+    proc.wait()
+
+class Client:
+    def __init__(self, client_id):
+        self.sock = socket.create_connection(('127.0.0.1', port))
+        self.sock.settimeout(3)
+        self.buf = b''
+        self.sock.sendall(packet(0x10, string('MQTT') + bytes([4, 0x02]) + struct.pack('!H', 60) + string(client_id)))
+        first_byte, body = self.read()
+        assert first_byte == 0x20 and body[1] == 0, f"CONNACK refused: {body}"
+
+    def fill(self, n):
+        while len(self.buf) < n:
+            data = self.sock.recv(65536)
+            if not data:
+                raise EOFError("connection closed by broker")
+            self.buf += data
+
+    def read(self):
+        self.fill(2)
+        length, multiplier, i = 0, 1, 1
+        while True:
+            self.fill(i + 1)
+            byte = self.buf[i]
+            length += (byte & 127) * multiplier
+            multiplier *= 128
+            i += 1
+            if not byte & 128:
+                break
+        self.fill(i + length)
+        first_byte, body = self.buf[0], self.buf[i:i + length]
+        self.buf = self.buf[i + length:]
+        return first_byte, body
+
+    def publish(self, topic, payload):
+        self.sock.sendall(packet(0x32, string(topic) + struct.pack('!H', 1) + payload))
+        first_byte, _ = self.read()
+        assert first_byte == 0x40, f"expected PUBACK, got {first_byte:#x}"
+
+    def expect_message(self, topic, payload):
+        first_byte, body = self.read()
+        assert first_byte >> 4 == 3, f"expected PUBLISH, got {first_byte:#x}"
+        topic_len = struct.unpack('!H', body[:2])[0]
+        got_topic = body[2:2 + topic_len].decode()
+        pck_id = struct.unpack('!H', body[2 + topic_len:4 + topic_len])[0]
+        got = (got_topic, body[4 + topic_len:])
+        assert got == (topic, payload), f"expected {(topic, payload)}, got {got}"
+        self.sock.sendall(packet(0x40, struct.pack('!H', pck_id)))
+
+    def expect_nothing(self):
+        self.sock.settimeout(0.5)
+        try:
+            first_byte, body = self.read()
+            raise AssertionError(f"unexpected packet {first_byte:#x} {body}")
+        except socket.timeout:
+            pass
+        self.sock.settimeout(3)
+
+    def close(self):
+        self.sock.sendall(packet(0xE0, b''))
+        self.sock.close()
+
+# first start: recovery folds the segment into a base file, then the broker crashes
+broker = start_broker()
+crash(broker)
+bases = [name for name in os.listdir(log_dir) if name.startswith('base-')]
+assert bases and segment_name not in os.listdir(log_dir), f"segment not compacted: {os.listdir(log_dir)}"
+
+# the crash window: the base file is installed but the inputs it replaces are still there
+with open(os.path.join(log_dir, segment_name), 'wb') as f:
+    f.write(segment)
+print("Segment left next to", bases[0])
+
+broker = start_broker()
+try:
+    assert segment_name not in os.listdir(log_dir), "covered segment not removed"
+
+    # every client gets its own queued message once, and only its own subscription
+    c = Client('c')
+    c.expect_message('c/inbox', b'queued for c')
+    c.expect_nothing()
+    d = Client('d')
+    d.expect_message('d/inbox', b'queued for d')
+    d.expect_nothing()
+    print("Queued messages recovered once per client")
+
+    publisher = Client('publisher')
+    publisher.publish('c/inbox', b'live for c')
+    c.expect_message('c/inbox', b'live for c')
+    publisher.publish('d/inbox', b'live for d')
+    d.expect_message('d/inbox', b'live for d')
+    c.expect_nothing()
+    d.expect_nothing()
+    a = Client('a')
+    a.expect_nothing()
+    print("Subscriptions recovered for the right clients")
+
+    for client in (a, c, d, publisher):
+        client.close()
+finally:
+    crash(broker)
+    if args.dir is None:
+        shutil.rmtree(log_dir)
+
+print("All tests passed")
+sys.exit(0)